@@ -0,0 +1,176 @@
+/** @file ascii.c
+    Benchmark of TYPE A line end conversion: lf_to_crlf() and crlf_to_lf(), which use
+    the widest vector kernels the CPU has, against plain byte loops. Both are fed the
+    same text of 60-byte lines and must produce the same output; prints MB/s of input
+    converted by each, best of several runs.
+
+    Before that, receive_ascii() is checked to stay within the transfer buffer when
+    a block ends with CR and the next one doesn't (converted data is a byte longer
+    than received then), with every possible split of the buffer.
+
+    usage: bench-ascii [text-MB] [runs] */
+
+
+#include "reefs.h"
+
+volatile sig_atomic_t terminating = 0;
+volatile sig_atomic_t reloading = 0;
+
+#define CHECK_BUF_LEN BUF_LEN
+#define GUARD_LEN 64
+
+
+/******************************************************************************
+ * Plain loops
+ */
+
+static size_t lf_to_crlf_loop(const char* in, size_t len, char* out)
+{
+    char* o = out;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        if (in[i] == '\n')  *o++ = '\r';
+        *o++ = in[i];
+    }
+    return o - out;
+}
+
+/** Whole text at once, so there's no CR carried over between blocks. */
+static size_t crlf_to_lf_loop(const char* in, size_t len, char* out)
+{
+    char* o = out;
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (in[i] != '\r' || i + 1 == len || in[i + 1] != '\n')   *o++ = in[i];
+    return o - out;
+}
+
+
+/******************************************************************************
+ * Receiving blocks that end with CR
+ */
+
+/** Receives a file whose first block (for a buffer split at `split`) ends with CR
+    into a buffer followed by guard bytes. Fails if the guard is overwritten or the
+    result differs from converting the file at once. */
+static void check_receive(struct session* ses, size_t split)
+{
+    size_t len = 3 * CHECK_BUF_LEN, i;
+    char* in = (char*)malloc(len);
+    char* expected = (char*)malloc(len);
+    char* buf = (char*)malloc(CHECK_BUF_LEN + GUARD_LEN);
+    char* got = (char*)malloc(len);
+    if (!in || !expected || !buf || !got)   FATAL("Allocating buffers.");
+
+    for (i = 0; i < len; ++i)   in[i] = 'a' + i % 26;
+    in[split - 1] = '\r';
+    memset (buf + CHECK_BUF_LEN, 0x5a, GUARD_LEN);
+
+    FILE* src = tmpfile();
+    FILE* dst = tmpfile();
+    if (!src || !dst || fwrite(in, 1, len, src) != len || fflush(src) != 0)    FATAL("Writing temporary file.");
+    rewind (src);
+
+    if (receive_ascii(ses, fileno(dst), fileno(src), buf, CHECK_BUF_LEN) != (ssize_t)len)
+        FATAL("Receiving failed.");
+    for (i = 0; i < GUARD_LEN; ++i)
+        if (buf[CHECK_BUF_LEN + i] != 0x5a)     FATAL("Receiving overran the transfer buffer.");
+
+    size_t n = crlf_to_lf_loop(in, len, expected);
+    if (lseek(fileno(dst), 0, SEEK_SET) == -1 || read_data(fileno(dst), got, len) != (ssize_t)n
+        || memcmp(got, expected, n) != 0)
+        FATAL("Received data differs.");
+
+    fclose (src);
+    fclose (dst);
+    free (got);
+    free (buf);
+    free (expected);
+    free (in);
+}
+
+
+/******************************************************************************
+ * Timing
+ */
+
+static double elapsed(const struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t lf_to_crlf_kernel(const char* in, size_t len, char* out)     { return lf_to_crlf(in, len, out); }
+static size_t crlf_to_lf_kernel(const char* in, size_t len, char* out)
+{
+    int cr = 0;
+    size_t n = crlf_to_lf(in, len, out, &cr);
+    if (cr) out[n++] = '\r';
+    return n;
+}
+
+/** Converts the text with given function, returning best MB/s (of input) of runs. */
+static double run(size_t (*convert)(const char*, size_t, char*), const char* in, size_t len,
+                  char* out, size_t* out_len, int runs)
+{
+    double best = 0;
+    int r;
+    for (r = 0; r < runs; ++r)
+    {
+        struct timespec start;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        *out_len = convert(in, len, out);
+        double mbs = len / elapsed(&start) / 1e6;
+        if (mbs > best) best = mbs;
+    }
+    return best;
+}
+
+
+/*****************************************************************************/
+
+int main(int argc, char* argv[])
+{
+    size_t len = (size_t)(argc > 1 ? atol(argv[1]) : 64) << 20;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    // session without limits, enough for receive_ascii()
+    struct server serv;
+    struct session ses;
+    memset (&serv, 0, sizeof(serv));
+    memset (&ses, 0, sizeof(ses));
+    ses.server = &serv;
+    size_t split;
+    for (split = 1; split <= CHECK_BUF_LEN; ++split)  check_receive (&ses, split);
+    printf ("receive_ascii() stays within its buffer for blocks ending with CR.\n");
+
+    char* lf = (char*)malloc(len);
+    char* crlf = (char*)malloc(2 * len);
+    char* out1 = (char*)malloc(2 * len);
+    char* out2 = (char*)malloc(2 * len);
+    if (!lf || !crlf || !out1 || !out2)   FATAL("Allocating buffers.");
+    size_t i;
+    for (i = 0; i < len; ++i)   lf[i] = i % 60 == 59 ? '\n' : ' ' + i % 90;
+    size_t crlf_len = lf_to_crlf_loop(lf, len, crlf);
+
+    size_t n1, n2;
+    printf ("Converting %zu MB of 60-byte lines, best of %d runs:\n", len >> 20, runs);
+    double loop = run(lf_to_crlf_loop, lf, len, out1, &n1, runs);
+    double kernel = run(lf_to_crlf_kernel, lf, len, out2, &n2, runs);
+    if (n1 != n2 || memcmp(out1, out2, n1) != 0)    FATAL("LF to CRLF results differ.");
+    printf ("  %-24s %8.0f MB/s\n  %-24s %8.0f MB/s\n", "LF to CRLF, byte loop", loop, "LF to CRLF, lf_to_crlf", kernel);
+
+    loop = run(crlf_to_lf_loop, crlf, crlf_len, out1, &n1, runs);
+    kernel = run(crlf_to_lf_kernel, crlf, crlf_len, out2, &n2, runs);
+    if (n1 != n2 || n1 != len || memcmp(out1, out2, n1) != 0 || memcmp(out1, lf, len) != 0)
+        FATAL("CRLF to LF results differ.");
+    printf ("  %-24s %8.0f MB/s\n  %-24s %8.0f MB/s\n", "CRLF to LF, byte loop", loop, "CRLF to LF, crlf_to_lf", kernel);
+
+    free (out2);
+    free (out1);
+    free (crlf);
+    free (lf);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/** @file parse.c
+    Benchmark of FTP command parsing: parse_ftp_command() against the way commands
+    were looked up before it (copying the line, cutting it at the first whitespace
+    and comparing the verb with every command's name). Both are fed the same mix
+    of typical command lines; prints millions of commands per second of each.
+
+    usage: bench-parse [millions-of-commands] */
+
+
+#include "reefs.h"
+
+volatile sig_atomic_t terminating = 0;
+volatile sig_atomic_t reloading = 0;
+
+
+static const char* lines[] = {
+    "USER anonymous", "PASS guest@example.com", "SYST", "FEAT", "PWD",
+    "TYPE I", "PASV", "SIZE pub/file.tar.gz", "RETR pub/file.tar.gz", "QUIT",
+};
+#define LINES_COUNT ((int)(sizeof(lines) / sizeof(lines[0])))
+
+
+/** Old lookup: copies the line and compares the verb with names of all commands. */
+static int parse_copying(const char* cmd, const char** data)
+{
+    int cmd_len = strlen(cmd);
+    char* buf = (char*)malloc((cmd_len + 1) * sizeof(char));
+    if (!buf)   return -1;
+    strcpy (buf, cmd);
+
+    char* cmd_data = buf + cmd_len;
+    char* p;
+    for (p = buf; *p; ++p)
+        if (isspace(*p))  { *p = '\0'; cmd_data = p + 1; break; }
+
+    int i, res = -1;
+    for (i = 0; i < ftp_commands_count(); ++i)
+        if (strcmp(buf, ftp_command_name(i)) == 0)
+        {
+            res = i;
+            *data = cmd + (cmd_data - buf);
+            break;
+        }
+
+    free (buf);
+    return res;
+}
+
+/** Parses n lines with given parser, returning millions of commands per second. */
+static double run(int (*parse)(const char*, const char**), long n, long* check)
+{
+    struct timespec start, end;
+    const char* data;
+    long i, sum = 0;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; ++i)
+        sum += parse(lines[i % LINES_COUNT], &data) + (*data != '\0');
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    *check = sum;   // keeps the work from being optimized away, and both parsers must agree
+    double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return n / t / 1e6;
+}
+
+
+int main(int argc, char* argv[])
+{
+    long n = (argc > 1 ? atol(argv[1]) : 20) * 1000000L;
+    long old_sum, new_sum;
+
+    double old_rate = run(parse_copying, n, &old_sum);
+    double new_rate = run(parse_ftp_command, n, &new_sum);
+    if (old_sum != new_sum) FATAL("Parsers disagree.");
+
+    printf ("Parsing %ld M commands (mix of %d lines):\n", n / 1000000L, LINES_COUNT);
+    printf ("  %-24s %8.1f M cmds/s\n", "copy + strcmp", old_rate);
+    printf ("  %-24s %8.1f M cmds/s\n", "parse_ftp_command", new_rate);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/** @file segments.c
+    Benchmark of segmented downloads (RANG) against a running server: fetches a file
+    split into 1, 2, 4 and 8 byte ranges, each over its own passive data connection.
+    All connections go through a loopback proxy that holds every chunk for a fixed
+    one-way latency before forwarding it. The proxy doesn't limit the rate, but like
+    TCP it keeps at most a window of bytes unacknowledged, and a chunk counts as
+    acknowledged one more latency after it's forwarded, so a single connection can't
+    move more than a window per round trip. Prints MB/s for each number of segments.
+
+    usage: bench-segments port user password file [latency-ms] [window-KB] */
+
+
+#include "reefs.h"
+#include <netinet/in.h>
+#include <poll.h>
+
+volatile sig_atomic_t terminating = 0;
+volatile sig_atomic_t reloading = 0;
+
+#define READER_BUF (64 * 1024)
+
+static int latency_ms = 20;
+static int window = 256 * 1024;
+
+
+/******************************************************************************
+ * Delay proxy
+ */
+
+struct chunk
+{
+    struct chunk* next;
+    double due;     // when it's forwarded; acknowledged a latency later
+    size_t len;
+    char data[];
+};
+
+/** One way through the proxy. Chunks from head to next_out are forwarded, but not
+    acknowledged yet; in_flight counts bytes of all chunks in the queue. */
+struct direction
+{
+    int from, to;
+    struct chunk* head;
+    struct chunk* next_out;
+    struct chunk* tail;
+    long long in_flight;
+    int eof;
+};
+
+struct proxy
+{
+    pthread_t thread;
+    struct direction way[2];
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(int port)
+{
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int sfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (sfd == -1)  FATAL("Creating socket.");
+    if (connect(sfd, (struct sockaddr*)&addr, sizeof(addr)) == -1)  FATAL("Connecting to server.");
+    return sfd;
+}
+
+/** Forwards chunks that are due and drops the acknowledged ones. Returns seconds until
+    the next of these is due, or -1 if there's nothing queued. */
+static double advance(struct direction* d, double t)
+{
+    double l = latency_ms / 1e3;
+    for (; d->next_out && d->next_out->due <= t; d->next_out = d->next_out->next)
+        if (write_data(d->to, d->next_out->data, d->next_out->len) == -1)   d->eof = 1;
+    while (d->head != d->next_out && d->head->due + l <= t)
+    {
+        struct chunk* c = d->head;
+        d->head = c->next;
+        d->in_flight -= c->len;
+        free (c);
+    }
+    if (!d->head)   d->tail = NULL;
+    if (d->next_out)    return d->next_out->due - t;
+    return d->head ? d->head->due + l - t : -1;
+}
+
+/** Reads what the window allows and queues it to be forwarded a latency later. */
+static void take(struct direction* d, double t)
+{
+    size_t len = window - d->in_flight < READER_BUF ? window - d->in_flight : READER_BUF;
+    struct chunk* c = (struct chunk*)malloc(sizeof(struct chunk) + len);
+    if (!c) FATAL("Allocating chunk.");
+    ssize_t got = TEMP_FAILURE_RETRY(recv(d->from, c->data, len, 0));
+    if (got <= 0)
+    {
+        free (c);
+        d->eof = 1;
+        return;
+    }
+    c->next = NULL;
+    c->due = t + latency_ms / 1e3;
+    c->len = got;
+    if (d->tail)    d->tail->next = c;
+    else            d->head = c;
+    d->tail = c;
+    if (!d->next_out)   d->next_out = c;
+    d->in_flight += got;
+}
+
+static void* proxy_proc(void* arg)
+{
+    struct proxy* p = (struct proxy*)arg;
+    int i, closed[2] = { 0, 0 };
+    while (!closed[0] || !closed[1])
+    {
+        struct pollfd pfd[2];
+        int nfds = 0;
+        double t = now(), wait = -1;
+        for (i = 0; i < 2; ++i)
+        {
+            struct direction* d = &(p->way[i]);
+            double w = advance(d, t);
+            if (w >= 0 && (wait < 0 || w < wait))  wait = w;
+            if (d->eof && !d->next_out && !closed[i])
+            {
+                shutdown (d->to, SHUT_WR);
+                closed[i] = 1;
+            }
+            if (!d->eof && d->in_flight < window)
+            {
+                pfd[nfds].fd = d->from;
+                pfd[nfds].events = POLLIN;
+                pfd[nfds++].revents = 0;
+            }
+        }
+        if (nfds == 0 && wait < 0)  break;
+        if (TEMP_FAILURE_RETRY(poll(pfd, nfds, wait < 0 ? -1 : (int)(wait * 1e3) + 1)) == -1)
+            FATAL("Polling proxy.");
+        for (i = 0; i < nfds; ++i)
+            if (pfd[i].revents)
+                take (pfd[i].fd == p->way[0].from ? &(p->way[0]) : &(p->way[1]), now());
+    }
+
+    for (i = 0; i < 2; ++i)
+        while (p->way[i].head)
+        {
+            struct chunk* c = p->way[i].head;
+            p->way[i].head = c->next;
+            free (c);
+        }
+    close (p->way[0].from);
+    close (p->way[0].to);
+    free (p);
+    return 0;
+}
+
+/** Connects to the port through a new proxy, returning the socket to use instead. */
+static int proxy_connect(int port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int lfd = socket(PF_INET, SOCK_STREAM, 0), cfd, pfd;
+    if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, len) == -1 || listen(lfd, 1) == -1
+        || getsockname(lfd, (struct sockaddr*)&addr, &len) == -1)
+        FATAL("Listening on loopback.");
+    if ((cfd = socket(PF_INET, SOCK_STREAM, 0)) == -1
+        || connect(cfd, (struct sockaddr*)&addr, len) == -1
+        || (pfd = accept(lfd, NULL, NULL)) == -1)
+        FATAL("Connecting to proxy.");
+    close (lfd);
+
+    struct proxy* p = (struct proxy*)calloc(1, sizeof(struct proxy));
+    if (!p) FATAL("Allocating proxy.");
+    p->way[0].from = connect_to(port);
+    p->way[0].to = pfd;
+    p->way[1].from = pfd;
+    p->way[1].to = p->way[0].from;
+    if (pthread_create(&(p->thread), NULL, proxy_proc, p) != 0) FATAL("Starting proxy thread.");
+    pthread_detach (p->thread);
+    return cfd;
+}
+
+
+/******************************************************************************
+ * Control connection
+ */
+
+static FILE* control_in;
+static int control;
+static int completed;   // segments whose 226 came while sending commands
+
+/** Reads a reply (the last line of a multiline one) and returns its code. */
+static int read_reply(char* line, size_t cap)
+{
+    for (;;)
+    {
+        if (!fgets(line, cap, control_in))  FATAL("Reading reply.");
+        if (isdigit((unsigned char)line[0]) && isdigit((unsigned char)line[1])
+            && isdigit((unsigned char)line[2]) && line[3] == ' ')
+            return atoi(line);
+    }
+}
+
+/** Sends a command and returns the code of its reply. Segments finishing meanwhile
+    are counted in `completed`, no command here is answered with 226. */
+static int command(const char* cmd, char* line, size_t cap)
+{
+    char buf[BUF_LEN + MAX_PATH];
+    int len = snprintf(buf, sizeof(buf), "%s\r\n", cmd);
+    if (write_data(control, buf, len) == -1)    FATAL("Sending command.");
+    int code;
+    while ((code = read_reply(line, cap)) == 226)
+        ++completed;
+    return code;
+}
+
+
+/******************************************************************************
+ * Segments
+ */
+
+struct reader
+{
+    pthread_t thread;
+    int socket;
+    long long bytes;
+};
+
+static void* reader_proc(void* arg)
+{
+    struct reader* rd = (struct reader*)arg;
+    char* buf = (char*)malloc(READER_BUF);
+    ssize_t c;
+    while ((c = TEMP_FAILURE_RETRY(recv(rd->socket, buf, READER_BUF, 0))) > 0)
+        rd->bytes += c;
+    free (buf);
+    close (rd->socket);
+    return 0;
+}
+
+/** Downloads the file split into n ranges, returning MB/s. */
+static double fetch(const char* file, long long size, int n)
+{
+    struct reader readers[MAX_SEGMENTS];
+    char line[BUF_LEN], cmd[BUF_LEN + MAX_PATH];
+    long long step = (size + n - 1) / n, total = 0;
+    struct timespec start, end;
+    int i;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    completed = 0;
+    for (i = 0; i < n; ++i)
+    {
+        int h1, h2, h3, h4, p1, p2;
+        if (command("PASV", line, sizeof(line)) != 227
+            || sscanf(strchr(line, '('), "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+            FATAL("PASV failed.");
+        readers[i].socket = proxy_connect(p1 * 256 + p2);
+        readers[i].bytes = 0;
+
+        long long a = i * step, b = (i + 1) * step < size ? (i + 1) * step - 1 : size - 1;
+        snprintf (cmd, sizeof(cmd), "RANG %lld %lld", a, b);
+        if (command(cmd, line, sizeof(line)) != 350)    FATAL("RANG failed.");
+        snprintf (cmd, sizeof(cmd), "RETR %s", file);
+        if (command(cmd, line, sizeof(line)) != 150)    FATAL("RETR failed.");
+        if (pthread_create(&(readers[i].thread), NULL, reader_proc, &readers[i]) != 0)
+            FATAL("Starting reader thread.");
+    }
+
+    // final replies come in completion order
+    for (i = completed; i < n; ++i)
+        if (read_reply(line, sizeof(line)) != 226)  FATAL("Segment failed.");
+    for (i = 0; i < n; ++i)
+    {
+        pthread_join (readers[i].thread, NULL);
+        total += readers[i].bytes;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    if (total != size)  FATAL("Download incomplete.");
+    double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return size / t / 1e6;
+}
+
+
+/*****************************************************************************/
+
+int main(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        fprintf (stdout, "%s", "usage: bench-segments port user password file [latency-ms] [window-KB]\n");
+        return EXIT_FAILURE;
+    }
+    if (argc > 5)   latency_ms = atoi(argv[5]);
+    if (argc > 6)   window = atoi(argv[6]) * 1024;
+    if (window <= 0)    FATAL("Invalid window.");
+    signal (SIGPIPE, SIG_IGN);
+
+    control = proxy_connect(atoi(argv[1]));
+    if (!(control_in = fdopen(dup(control), "r")))  FATAL("Opening control connection.");
+
+    char line[BUF_LEN], cmd[BUF_LEN + MAX_PATH];
+    read_reply (line, sizeof(line));
+    snprintf (cmd, sizeof(cmd), "USER %s", argv[2]);    command (cmd, line, sizeof(line));
+    snprintf (cmd, sizeof(cmd), "PASS %s", argv[3]);
+    if (command(cmd, line, sizeof(line)) != 230)    FATAL("Login failed.");
+    if (command("TYPE I", line, sizeof(line)) != 200)   FATAL("TYPE I failed.");
+    snprintf (cmd, sizeof(cmd), "SIZE %s", argv[4]);
+    if (command(cmd, line, sizeof(line)) != 213)    FATAL("SIZE failed.");
+    long long size = atoll(line + 4);
+
+    printf ("Fetching %lld bytes, %d ms each way, %d KB window:\n", size, latency_ms, window / 1024);
+    int n;
+    for (n = 1; n <= 8; n *= 2)
+        printf ("  %d segments %8.1f MB/s\n", n, fetch(argv[4], size, n));
+
+    command ("QUIT", line, sizeof(line));
+    return 0;
+}
@@ -0,0 +1,321 @@
+/** @file transfer.c
+    Benchmark of ways a download can move a file to the data connection: copying through
+    a BUF_LEN buffer (as it was done before sendfile()), copying through transfer buffer,
+    splice() through a pipe, sendfile() and io_uring. The file goes over a loopback TCP
+    connection to a child process that just drains it. Uploads are measured the same way
+    the other way round, with a child process feeding the connection. Prints MB/s of each
+    method and file size, and CPU time the benchmark process spent per GB moved (user and
+    system, io_uring workers included; the peer's share isn't, as it's another process),
+    each the best of several runs.
+
+    Sizes are in bytes, with an optional K, M or G suffix; the default sweep is 4K 64K 1M
+    64M 1G (give 10G explicitly, it needs that much room in /tmp). Small files are sent
+    many times per run, so per-transfer setup shows: sends reuse one connection, receives
+    take a new one each, as uploads end at EOF.
+
+    usage: bench-transfer [-r runs] [size...] */
+
+
+#include "reefs.h"
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+volatile sig_atomic_t terminating = 0;
+volatile sig_atomic_t reloading = 0;
+
+
+/******************************************************************************
+ * Loopback connection
+ */
+
+struct peer
+{
+    pid_t pid;
+    int socket;
+};
+
+static char* xfer_buf;
+
+/** Forks a process that reads the socket to EOF, then writes back how many bytes it got. */
+static void start_drain(struct peer* p)
+{
+    if ((p->pid = fork()) == -1)    FATAL("Starting drain process.");
+    if (p->pid > 0) return;
+
+    static char buf[ZERO_COPY_CHUNK];
+    long long bytes = 0;
+    ssize_t c;
+    while ((c = TEMP_FAILURE_RETRY(recv(p->socket, buf, sizeof(buf), 0))) > 0)
+        bytes += c;
+    write_data (p->socket, (const char*)&bytes, sizeof(bytes));
+    _exit (0);
+}
+
+/** Forks a process that writes bytes to the socket, then shuts it down. */
+static void start_feed(struct peer* p, long long bytes)
+{
+    if ((p->pid = fork()) == -1)    FATAL("Starting feed process.");
+    if (p->pid > 0) return;
+
+    static char buf[DEFAULT_TRANSFER_CHUNK];
+    long long left;
+    for (left = bytes; left > 0; left -= sizeof(buf))
+        if (write_data(p->socket, buf, left < (long long)sizeof(buf) ? left : sizeof(buf)) == -1)  break;
+    shutdown (p->socket, SHUT_WR);
+    _exit (0);
+}
+
+/** Connects a pair of TCP sockets over loopback; *out is the client end. */
+static void connect_loopback(int* out, int* in)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int lfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, len) == -1 || listen(lfd, 1) == -1
+        || getsockname(lfd, (struct sockaddr*)&addr, &len) == -1)
+        FATAL("Listening on loopback.");
+    if ((*out = socket(PF_INET, SOCK_STREAM, 0)) == -1
+        || connect(*out, (struct sockaddr*)&addr, len) == -1
+        || (*in = accept(lfd, NULL, NULL)) == -1)
+        FATAL("Connecting over loopback.");
+    close (lfd);
+}
+
+static double elapsed(const struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Returns user and system CPU time of this process so far, in seconds. */
+static double cpu_time()
+{
+    struct rusage ru;
+    getrusage (RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+
+/******************************************************************************
+ * Methods
+ */
+
+static ssize_t send_small(int out_fd, int in_fd)     { char buf[BUF_LEN]; return copy_data(out_fd, in_fd, buf, BUF_LEN); }
+static ssize_t send_copy(int out_fd, int in_fd)      { return copy_data(out_fd, in_fd, xfer_buf, DEFAULT_TRANSFER_CHUNK); }
+static ssize_t send_splice(int out_fd, int in_fd)    { return splice_data(out_fd, in_fd, DEFAULT_TRANSFER_CHUNK); }
+static ssize_t send_sendfile(int out_fd, int in_fd)  { return sendfile_data(out_fd, in_fd); }
+static ssize_t send_uring(int out_fd, int in_fd)     { return uring_send(out_fd, in_fd, DEFAULT_TRANSFER_CHUNK); }
+
+static const struct { const char* name; ssize_t (*send)(int, int); } methods[] = {
+    { "copy (BUF_LEN)", send_small },
+    { "copy (transfer-chunk)", send_copy },
+    { "splice", send_splice },
+    { "sendfile", send_sendfile },
+    { "io_uring", send_uring },
+};
+
+static ssize_t receive_small(int out_fd, int in_fd)  { char buf[BUF_LEN]; return copy_data(out_fd, in_fd, buf, BUF_LEN); }
+static ssize_t receive_copy(int out_fd, int in_fd)   { return copy_data(out_fd, in_fd, xfer_buf, DEFAULT_TRANSFER_CHUNK); }
+static ssize_t receive_splice(int out_fd, int in_fd) { return splice_data(out_fd, in_fd, DEFAULT_TRANSFER_CHUNK); }
+static ssize_t receive_uring(int out_fd, int in_fd)  { return uring_receive(out_fd, in_fd, DEFAULT_TRANSFER_CHUNK, NULL); }
+
+static const struct { const char* name; ssize_t (*receive)(int, int); } receive_methods[] = {
+    { "copy (BUF_LEN)", receive_small },
+    { "copy (transfer-chunk)", receive_copy },
+    { "splice", receive_splice },
+    { "io_uring", receive_uring },
+};
+
+/** Result of one run; mbs is 0 if the method isn't available. */
+struct result
+{
+    double mbs;
+    double cpu_per_gb;  // seconds
+};
+
+/** Sends the whole file `repeats` times over one connection. */
+static struct result run_send(ssize_t (*send)(int, int), int fd, long long size, int repeats)
+{
+    struct result res = { 0, 0 };
+    struct peer d;
+    int out, i;
+    connect_loopback (&out, &(d.socket));
+    start_drain (&d);
+
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    double cpu = cpu_time();
+    for (i = 0; i < repeats; ++i)
+    {
+        lseek (fd, 0, SEEK_SET);
+        ssize_t c = send(out, fd);
+        if (c == -1 && errno == ENOSYS && i == 0)   break;
+        if (c != size)  FATAL("Transfer incomplete.");
+    }
+    shutdown (out, SHUT_WR);
+    long long bytes = -1;
+    recv (out, &bytes, sizeof(bytes), MSG_WAITALL);
+    double t = elapsed(&start);
+    cpu = cpu_time() - cpu;
+
+    waitpid (d.pid, NULL, 0);
+    close (out);
+    close (d.socket);
+    if (i == 0) return res;
+    if (bytes != size * repeats)    FATAL("Transfer incomplete.");
+    res.mbs = size * repeats / t / 1e6;
+    res.cpu_per_gb = cpu / (size * repeats / 1e9);
+    return res;
+}
+
+/** Receives size bytes into the file `repeats` times, each over a new connection.
+    Connecting and starting the feed aren't timed: the clock starts once data arrives. */
+static struct result run_receive(ssize_t (*receive)(int, int), int fd, long long size, int repeats)
+{
+    struct result res = { 0, 0 };
+    double t = 0, cpu = 0;
+    int i;
+    for (i = 0; i < repeats; ++i)
+    {
+        struct peer d;
+        int in;
+        connect_loopback (&(d.socket), &in);
+        if (ftruncate(fd, 0) == -1) FATAL("Truncating temporary file.");
+        lseek (fd, 0, SEEK_SET);
+        start_feed (&d, size);
+        struct pollfd pfd = { in, POLLIN, 0 };
+        poll (&pfd, 1, -1);
+
+        struct timespec start;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        double cpu_start = cpu_time();
+        ssize_t c = receive(fd, in);
+        t += elapsed(&start);
+        cpu += cpu_time() - cpu_start;
+
+        close (in);
+        close (d.socket);
+        waitpid (d.pid, NULL, 0);
+        if (c == -1 && errno == ENOSYS && i == 0)   return res;
+        if (c != size)  FATAL("Transfer incomplete.");
+    }
+    res.mbs = size * repeats / t / 1e6;
+    res.cpu_per_gb = cpu / (size * repeats / 1e9);
+    return res;
+}
+
+
+/******************************************************************************
+ * Sizes
+ */
+
+/** Bytes a run moves at least, by repeating transfers of small files. */
+#define SWEEP_RUN_BYTES   (64LL << 20)
+/** Transfers a run makes at most (receives use a connection each). */
+#define SWEEP_MAX_REPEATS 2000
+
+static const char* default_sizes[] = { "4K", "64K", "1M", "64M", "1G" };
+
+/** Parses a size in bytes with an optional K, M or G suffix. */
+static long long parse_size(const char* text)
+{
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    int shift = 0;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'K': shift = 10; break;
+    case 'M': shift = 20; break;
+    case 'G': shift = 30; break;
+    }
+    if (shift)  ++end;
+    if (end == text || *end || size <= 0)   FATAL("Invalid size.");
+    return size << shift;
+}
+
+/** Refills the file with exactly size bytes. */
+static void fill_file(int fd, long long size)
+{
+    long long left;
+    if (ftruncate(fd, 0) == -1) FATAL("Truncating temporary file.");
+    lseek (fd, 0, SEEK_SET);
+    for (left = size; left > 0; left -= DEFAULT_TRANSFER_CHUNK)
+        if (write_data(fd, xfer_buf, left < DEFAULT_TRANSFER_CHUNK ? left : DEFAULT_TRANSFER_CHUNK) == -1)
+            FATAL("Writing temporary file.");
+}
+
+
+/*****************************************************************************/
+
+/** Runs a method `runs` times, printing its best MB/s and CPU time per GB. */
+static void print_best(const char* name, struct result (*run)(ssize_t (*)(int, int), int, long long, int),
+                       ssize_t (*method)(int, int), int fd, long long size, int repeats, int runs)
+{
+    struct result best = { 0, 0 };
+    int r;
+    for (r = 0; r < runs; ++r)
+    {
+        struct result res = run(method, fd, size, repeats);
+        if (res.mbs == 0)   { printf ("  %-24s unavailable\n", name); return; }
+        if (res.mbs > best.mbs) best.mbs = res.mbs;
+        if (best.cpu_per_gb == 0 || res.cpu_per_gb < best.cpu_per_gb)  best.cpu_per_gb = res.cpu_per_gb;
+    }
+    printf ("  %-24s %8.0f MB/s %8.2f s CPU/GB\n", name, best.mbs, best.cpu_per_gb);
+}
+
+
+int main(int argc, char* argv[])
+{
+    int runs = 3, first = 1;
+    if (argc > 2 && strcmp(argv[1], "-r") == 0)
+    {
+        runs = atoi(argv[2]);
+        first = 3;
+    }
+    const char** sizes = first < argc ? (const char**)argv + first : default_sizes;
+    int count = first < argc ? argc - first : (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+    signal (SIGPIPE, SIG_IGN);
+
+    // file lands in the page cache as it's written, so disk speed doesn't matter
+    char path[] = "/tmp/reefs-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)   FATAL("Creating temporary file.");
+    unlink (path);
+    if (!(xfer_buf = (char*)malloc(DEFAULT_TRANSFER_CHUNK)))    FATAL("Allocating buffer.");
+    long long i;
+    for (i = 0; i < DEFAULT_TRANSFER_CHUNK; ++i)    xfer_buf[i] = (char)(i * 7);
+
+    printf ("Best of %d runs over loopback:\n", runs);
+    int s, m;
+    for (s = 0; s < count; ++s)
+    {
+        long long size = parse_size(sizes[s]);
+        long long repeats = SWEEP_RUN_BYTES / size;
+        if (repeats < 1)    repeats = 1;
+        if (repeats > SWEEP_MAX_REPEATS)    repeats = SWEEP_MAX_REPEATS;
+
+        fill_file (fd, size);
+        printf ("Sending %s (%lld bytes) x %lld:\n", sizes[s], size, repeats);
+        for (m = 0; m < (int)(sizeof(methods) / sizeof(methods[0])); ++m)
+        {
+            print_best (methods[m].name, run_send, methods[m].send, fd, size, repeats, runs);
+        }
+
+        printf ("Receiving %s (%lld bytes) x %lld:\n", sizes[s], size, repeats);
+        for (m = 0; m < (int)(sizeof(receive_methods) / sizeof(receive_methods[0])); ++m)
+        {
+            print_best (receive_methods[m].name, run_receive, receive_methods[m].receive, fd, size, repeats, runs);
+        }
+    }
+
+    free (xfer_buf);
+    close (fd);
+    return 0;
+}
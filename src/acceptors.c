@@ -0,0 +1,318 @@
+/** @file acceptors.c
+    Acceptor shards: threads accepting clients on their own SO_REUSEPORT listeners of the
+    server port, so that the kernel spreads incoming connections among them. Each shard
+    (and every session it accepts) can be pinned to a core of its own */
+
+
+#include "reefs.h"
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+
+/******************************************************************************
+ * Cores
+ */
+
+/** Returns the core that shard is pinned to (n-th of cores process may run on, modulo
+    their number), or -1 if shards aren't pinned. */
+int acceptor_cpu(const struct server* serv, int shard)
+{
+    if (!serv->config.cpu_affinity) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == -1)    return -1;
+    int count = CPU_COUNT(&set);
+    if (count == 0) return -1;
+
+    int n = shard % count, cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set) && n-- == 0)   return cpu;
+    return -1;
+}
+
+/** Makes threads created with attr run on the core only. */
+int pin_thread_attr(pthread_attr_t* attr, int cpu)
+{
+    if (cpu < 0)    return 0;
+
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    errno = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set);
+    return errno ? -1 : 0;
+}
+
+
+/******************************************************************************
+ * Acceptor threads
+ */
+
+/** Turns away a client that exceeds the limit of concurrent sessions. */
+static void reject_session(struct session* ses)
+{
+    respond (ses, 421, "Too many users, try again later.");
+
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, "Client `%s` rejected, too many users.", ses->ip_address);
+    log_event (ses->server, buf);
+
+    shutdown (ses->control_socket, SHUT_RDWR);
+    TEMP_FAILURE_RETRY(close(ses->control_socket));
+}
+
+/** Turns away a client whose address is over its limits, before anything is
+    allocated for it. A flood of them is logged at most once a second per acceptor,
+    with the number of those left out since the last line. */
+static void refuse_client(struct acceptor* acc, int fd, const struct sockaddr_in* addr, int reason)
+{
+    static const char REPLY[] = "421 Too many connections from your address, try again later.\r\n";
+    send (fd, REPLY, sizeof(REPLY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    TEMP_FAILURE_RETRY(close(fd));
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (now.tv_sec == acc->refusals_logged) { ++acc->refusals_unlogged; return; }
+    acc->refusals_logged = now.tv_sec;
+
+    char buf[BUF_LEN], more[64] = "";
+    if (acc->refusals_unlogged > 0)
+        snprintf (more, sizeof(more), " (%lu more refused since last logged)", acc->refusals_unlogged);
+    acc->refusals_unlogged = 0;
+    snprintf (buf, BUF_LEN, "Client `%s` refused, %s.%s", inet_ntoa(addr->sin_addr),
+              reason == EUSERS ? "too many sessions from its address" : "connecting too often", more);
+    log_event (acc->server, buf);
+}
+
+/** Tells whether accepting has failed only because of that particular client
+    (or because there was nobody to accept after all). */
+static int accept_failure_transient(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == ECONNABORTED || err == EPROTO || err == EINTR;
+}
+
+/** Tells whether accepting has failed for lack of descriptors or memory, which sessions
+    ending free sooner or later. */
+static int accept_failure_resources(int err)
+{
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+/** Accepts every client waiting on shard's listener. Sessions are started from here,
+    so their threads inherit shard's core. Returns -1 if it has run out of descriptors
+    or memory, with clients still waiting. */
+static int accept_clients(struct acceptor* acc)
+{
+    struct server* serv = acc->server;
+    struct session* ses;
+    struct session rejected;
+    struct client* client;
+
+    for (;;)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(struct sockaddr_in);
+        int fd = accept4(acc->socket, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (accept_failure_transient(errno))    return 0;
+            if (accept_failure_resources(errno))    return -1;
+            FATAL("Accepting incoming connection");
+        }
+
+        // check limits of client's address first, so that floods cost next to nothing
+        if (admit_client(serv, &addr, &client) == -1)
+        {
+            if (errno != EUSERS && errno != EAGAIN) FATAL("Tracking client");
+            refuse_client (acc, fd, &addr, errno);
+            continue;
+        }
+
+        // then take a pooled slot if there is one to spare
+        if (!(ses = acquire_session(serv->sessions)))
+        {
+            if (errno != EAGAIN)    FATAL("Allocating session");
+            leave_client (serv, client);
+            new_session (fd, &addr, &rejected);
+            rejected.server = serv;
+            reject_session (&rejected);
+            continue;
+        }
+        new_session (fd, &addr, ses);
+        ses->server = serv;
+        ses->acceptor = acc;
+        ses->client = client;
+        strncpy (ses->current_dir, serv->config.root_dir, MAX_PATH); // set initial directory
+        __atomic_add_fetch (&(acc->accepted), 1, __ATOMIC_RELAXED);
+
+        // start servicing the new connection
+        if (start_session(ses) == -1)   FATAL("Handling client session");
+    }
+}
+
+/** Worker function for acceptor thread. */
+void* acceptor_proc(void* arg)
+{
+    struct acceptor* acc = (struct acceptor*)arg;
+
+    // leave signal handling to the main thread
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGHUP);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct pollfd fds[2];
+    fds[0].fd = acc->socket;            fds[0].events = POLLIN;
+    fds[1].fd = acc->server->stop_fd;   fds[1].events = POLLIN;
+    int pause_ms = 0;   // backing off while out of descriptors or memory
+    char buf[BUF_LEN];
+    while (!terminating)
+    {
+        // listener stays readable with clients nobody can accept, so it isn't polled while paused
+        if ((pause_ms ? poll(fds + 1, 1, pause_ms) : poll(fds, 2, -1)) == -1)
+        {
+            if (errno != EINTR) FATAL("Waiting for incoming connections.");
+            continue;
+        }
+        if (fds[1].revents)     break;
+        if (!pause_ms && !fds[0].revents)   continue;
+
+        if (accept_clients(acc) != -1)
+        {
+            if (pause_ms)
+            {
+                snprintf (buf, BUF_LEN, "Acceptor %d accepting clients again.", acc->index);
+                log_event (acc->server, buf);
+            }
+            pause_ms = 0;
+            continue;
+        }
+
+        // logged once per episode, however long it takes
+        if (!pause_ms)
+        {
+            snprintf (buf, BUF_LEN, "Acceptor %d pausing, can't accept clients: %s.", acc->index, strerror(errno));
+            log_event (acc->server, buf);
+        }
+        pause_ms = !pause_ms ? ACCEPT_PAUSE_MS
+                 : pause_ms * 2 < ACCEPT_PAUSE_MAX_MS ? pause_ms * 2 : ACCEPT_PAUSE_MAX_MS;
+        __atomic_add_fetch (&(acc->pauses), 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the shards
+ */
+
+/** Opens listener of a shard. All of them share the port, the kernel balancing
+    connections among them. */
+static int open_listener(const struct config* cfg)
+{
+    int sfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd == -1)  return -1;
+
+    int reuse = 1;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)cfg->port);
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &reuse, (socklen_t)sizeof(int)) == -1
+        || setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &reuse, (socklen_t)sizeof(int)) == -1
+        || bind(sfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) == -1
+        || listen(sfd, cfg->listen_backlog) == -1)
+    {
+        int err = errno;
+        TEMP_FAILURE_RETRY(close(sfd));
+        errno = err;    return -1;
+    }
+
+    return sfd;
+}
+
+/** Opens listeners of all shards; they're accepted from only when shards are started. */
+int init_acceptors(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    int count = serv->config.acceptors > 0 ? serv->config.acceptors : 1;
+    struct acceptor* accs = (struct acceptor*)calloc(count, sizeof(struct acceptor));
+    if (!accs)  return -1;
+    if ((serv->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)    { free(accs); return -1; }
+
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        accs[i].server = serv;
+        accs[i].index = i;
+        accs[i].cpu = acceptor_cpu(serv, i);
+        if ((accs[i].socket = open_listener(&(serv->config))) == -1)
+        {
+            int err = errno;
+            while (--i >= 0)    TEMP_FAILURE_RETRY(close(accs[i].socket));
+            TEMP_FAILURE_RETRY(close(serv->stop_fd));
+            free (accs);
+            errno = err;    return -1;
+        }
+    }
+
+    serv->acceptors = accs;
+    serv->acceptors_count = count;
+    return 0;
+}
+
+/** Starts accepting clients, each shard by its own thread. */
+int start_acceptors(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->acceptors)   { errno = EBADFD; return -1; }
+
+    int i;
+    for (i = 0; i < serv->acceptors_count; ++i)
+    {
+        struct acceptor* acc = &(serv->acceptors[i]);
+        pthread_attr_t attr;
+        pthread_attr_init (&attr);
+        int res = pin_thread_attr(&attr, acc->cpu) == -1
+                  || pthread_create(&(acc->thread), &attr, acceptor_proc, acc) != 0;
+        pthread_attr_destroy (&attr);
+        if (res)    { errno = EAGAIN; return -1; }
+        acc->started = 1;
+    }
+
+    return 0;
+}
+
+/** Stops accepting clients and closes the listeners. */
+int stop_acceptors(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->acceptors)   return 0;
+
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(serv->stop_fd, &one, sizeof(one)));
+
+    int i;
+    for (i = 0; i < serv->acceptors_count; ++i)
+    {
+        if (serv->acceptors[i].started) pthread_join (serv->acceptors[i].thread, NULL);
+        TEMP_FAILURE_RETRY(close(serv->acceptors[i].socket));
+    }
+    TEMP_FAILURE_RETRY(close(serv->stop_fd));
+    return 0;
+}
+
+/** Frees the shards, once nothing reads their stats any more. */
+int free_acceptors(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    free (serv->acceptors);
+    serv->acceptors = NULL;
+    serv->acceptors_count = 0;
+    return 0;
+}
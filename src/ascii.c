@@ -0,0 +1,245 @@
+/** @file ascii.c
+    TYPE A transfers: files are stored with LF line ends and sent with CRLF ones.
+    Line ends are found 16 or 32 bytes at a time (SSE2 or AVX2, whichever the CPU
+    has), falling back to a plain byte loop elsewhere */
+
+
+#include "reefs.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+/******************************************************************************
+ * Conversion kernels
+ */
+
+// turn n bytes of input into output, returning the end of output; input of
+// CRLF-to-LF kernels never ends with CR, so that it's known what follows every CR
+typedef char* (*ascii_kernel)(char* out, const char* in, size_t n);
+
+/** Copies block of width bytes, putting CR before those marked in the mask (LFs). */
+static inline char* expand_block(char* out, const char* in, unsigned mask, int width)
+{
+    int start = 0;
+    while (mask)
+    {
+        int p = __builtin_ctz(mask);
+        memcpy (out, in + start, p - start);
+        out += p - start;
+        *out++ = '\r';
+        *out++ = '\n';
+        start = p + 1;
+        mask &= mask - 1;
+    }
+    memcpy (out, in + start, width - start);
+    return out + width - start;
+}
+
+/** Copies block of width bytes, leaving out those marked in the mask (CRs before LF). */
+static inline char* squeeze_block(char* out, const char* in, unsigned mask, int width)
+{
+    int start = 0;
+    while (mask)
+    {
+        int p = __builtin_ctz(mask);
+        memcpy (out, in + start, p - start);
+        out += p - start;
+        start = p + 1;
+        mask &= mask - 1;
+    }
+    memcpy (out, in + start, width - start);
+    return out + width - start;
+}
+
+static char* lf_to_crlf_bytes(char* out, const char* in, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+    {
+        if (in[i] == '\n')  *out++ = '\r';
+        *out++ = in[i];
+    }
+    return out;
+}
+
+static char* crlf_to_lf_bytes(char* out, const char* in, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        if (in[i] != '\r' || in[i + 1] != '\n') *out++ = in[i];
+    return out;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static char* lf_to_crlf_sse2(char* out, const char* in, size_t n)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (mask)   out = expand_block(out, in + i, mask, 16);
+        else        { _mm_storeu_si128((__m128i*)out, v); out += 16; }
+    }
+    return lf_to_crlf_bytes(out, in + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static char* crlf_to_lf_sse2(char* out, const char* in, size_t n)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 17 <= n; i += 16)   // looks at the byte after the block too
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        if (mask)
+        {
+            __m128i next = _mm_loadu_si128((const __m128i*)(in + i + 1));
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(next, lf));
+        }
+        if (mask)   out = squeeze_block(out, in + i, mask, 16);
+        else        { _mm_storeu_si128((__m128i*)out, v); out += 16; }
+    }
+    return crlf_to_lf_bytes(out, in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static char* lf_to_crlf_avx2(char* out, const char* in, size_t n)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        if (mask)   out = expand_block(out, in + i, mask, 32);
+        else        { _mm256_storeu_si256((__m256i*)out, v); out += 32; }
+    }
+    return lf_to_crlf_sse2(out, in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static char* crlf_to_lf_avx2(char* out, const char* in, size_t n)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 33 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        if (mask)
+        {
+            __m256i next = _mm256_loadu_si256((const __m256i*)(in + i + 1));
+            mask &= (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(next, lf));
+        }
+        if (mask)   out = squeeze_block(out, in + i, mask, 32);
+        else        { _mm256_storeu_si256((__m256i*)out, v); out += 32; }
+    }
+    return crlf_to_lf_sse2(out, in + i, n - i);
+}
+
+#endif
+
+static ascii_kernel lf_to_crlf_kernel = lf_to_crlf_bytes;
+static ascii_kernel crlf_to_lf_kernel = crlf_to_lf_bytes;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/** Picks the widest kernels the CPU can run. */
+static void choose_kernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        lf_to_crlf_kernel = lf_to_crlf_avx2;
+        crlf_to_lf_kernel = crlf_to_lf_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        lf_to_crlf_kernel = lf_to_crlf_sse2;
+        crlf_to_lf_kernel = crlf_to_lf_sse2;
+    }
+#endif
+}
+
+
+/******************************************************************************
+ * Converting
+ */
+
+/** Converts LF line ends to CRLF. Output must have room for twice the input.
+    Returns the length of output. */
+size_t lf_to_crlf(const char* in, size_t len, char* out)
+{
+    pthread_once (&kernels_once, choose_kernels);
+    return lf_to_crlf_kernel(out, in, len) - out;
+}
+
+/** Converts CRLF line ends to LF (other CRs are left as they are). Input may come in
+    blocks, *cr keeping track of CR that ended the previous one (it's written out by
+    the next block unless that starts with LF, or has to be written by the caller once
+    there are no more blocks). Output must have room for the input and one more byte
+    (for that CR). Returns the length of output. */
+size_t crlf_to_lf(const char* in, size_t len, char* out, int* cr)
+{
+    if (len == 0)   return 0;
+    pthread_once (&kernels_once, choose_kernels);
+
+    char* o = out;
+    if (*cr && *in != '\n') *o++ = '\r';
+    if ((*cr = in[len - 1] == '\r'))  --len;
+    return crlf_to_lf_kernel(o, in, len) - out;
+}
+
+
+/******************************************************************************
+ * Transfers
+ */
+
+/** Sends the file in TYPE A, converting its line ends on the way. Transfer buffer
+    is split into a third for the file and the rest for converted data.
+    Returns the number of bytes sent. */
+ssize_t send_ascii(struct session* ses, int out_fd, int in_fd, char* buf, size_t buf_len)
+{
+    size_t in_len = buf_len / 3;
+    char* out = buf + in_len;
+    ssize_t c;
+    size_t len = 0;
+
+    while ((c = read_data(in_fd, buf, in_len)) > 0)
+    {
+        size_t n = lf_to_crlf(buf, c, out);
+        if (throttled_write(ses, out_fd, out, n) < (ssize_t)n)  return -1;
+        len += n;
+    }
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Receives the file in TYPE A, converting its line ends on the way. Transfer buffer
+    is split in halves for received and converted data, the latter a byte bigger for CR
+    held back from the previous block. Returns the number of bytes received. */
+ssize_t receive_ascii(struct session* ses, int out_fd, int in_fd, char* buf, size_t buf_len)
+{
+    size_t in_len = (buf_len - 1) / 2;
+    char* out = buf + in_len;
+    int cr = 0;
+    ssize_t c;
+    size_t len = 0;
+
+    while ((c = throttled_read(ses, in_fd, buf, in_len)) > 0)
+    {
+        size_t n = crlf_to_lf(buf, c, out, &cr);
+        if (n > 0 && write_data(out_fd, out, n) < (ssize_t)n)   return -1;
+        len += c;
+    }
+    if (c < 0)  return -1;
+    if (cr && write_data(out_fd, "\r", 1) < 1)  return -1;
+
+    return len;
+}
@@ -0,0 +1,193 @@
+/** @file clients.c
+    Admission control by client's address: limits of concurrent sessions and of
+    connection rate per address, checked as soon as a connection is accepted */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Table of addresses
+ */
+
+static unsigned bucket_of(in_addr_t addr)
+{
+    return ((uint32_t)addr * 2654435761u) % CLIENT_BUCKETS;
+}
+
+static pthread_mutex_t* lock_of(struct client_table* tab, unsigned bucket)
+{
+    return &(tab->locks[bucket % CLIENT_STRIPES]);
+}
+
+/** Adds connections that address has earned since last refill, up to the limit per minute.
+    Must be called with bucket's lock held. */
+static void refill_client(struct client* c, int rate, const struct timespec* now)
+{
+    double elapsed = (now->tv_sec - c->stamp.tv_sec) + (now->tv_nsec - c->stamp.tv_nsec) / 1e9;
+    if (elapsed <= 0)   return;
+
+    c->tokens += elapsed * rate / 60;
+    if (c->tokens > rate)   c->tokens = rate;
+    c->stamp = *now;
+}
+
+/** Tells whether the entry holds nothing a new one wouldn't, so it can be dropped. */
+static int client_idle(const struct client* c, int rate)
+{
+    return c->sessions == 0 && (rate == 0 || c->tokens >= rate);
+}
+
+/** Finds address in its bucket, dropping idle entries met on the way.
+    Must be called with bucket's lock held. */
+static struct client* find_client(struct client_table* tab, unsigned bucket, in_addr_t addr,
+                                  int rate, const struct timespec* now)
+{
+    struct client **p = &(tab->buckets[bucket]), *c;
+    while ((c = *p))
+    {
+        if (c->addr == addr)    return c;
+
+        refill_client (c, rate, now);
+        if (client_idle(c, rate))
+        {
+            *p = c->next;
+            free (c);
+            __atomic_sub_fetch (&(tab->tracked), 1, __ATOMIC_RELAXED);
+        }
+        else p = &(c->next);
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Admitting clients
+ */
+
+/** Checks whether a client connecting from the address may start a session, and counts
+    the session in if so. Returns -1 with errno set to EUSERS if the address has too many
+    sessions already, or to EAGAIN if it's connecting too often. The client is to be
+    passed to leave_client() once its session ends (it's NULL if nothing is tracked). */
+int admit_client(struct server* serv, const struct sockaddr_in* addr, struct client** client)
+{
+    if (!serv || !addr || !client)  { errno = EFAULT; return -1; }
+
+    *client = NULL;
+    struct client_table* tab = serv->clients;
+    if (!tab)   return 0;
+
+    int max_sessions = serv->config.max_clients_per_ip;
+    int rate = serv->config.ip_connection_rate;
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    unsigned bucket = bucket_of(addr->sin_addr.s_addr);
+    pthread_mutex_t* lock = lock_of(tab, bucket);
+    pthread_mutex_lock (lock);
+
+    struct client* c = find_client(tab, bucket, addr->sin_addr.s_addr, rate, &now);
+    if (!c)
+    {
+        if (!(c = (struct client*)calloc(1, sizeof(struct client))))
+        {
+            pthread_mutex_unlock (lock);
+            return -1;
+        }
+        c->addr = addr->sin_addr.s_addr;
+        c->tokens = rate;
+        c->stamp = now;
+        c->next = tab->buckets[bucket];
+        tab->buckets[bucket] = c;
+        __atomic_add_fetch (&(tab->tracked), 1, __ATOMIC_RELAXED);
+    }
+    else refill_client (c, rate, &now);
+
+    int err = 0;
+    if (max_sessions > 0 && c->sessions >= max_sessions)
+    {
+        __atomic_add_fetch (&(tab->rejected_sessions), 1, __ATOMIC_RELAXED);
+        err = EUSERS;
+    }
+    else if (rate > 0 && c->tokens < 1)
+    {
+        __atomic_add_fetch (&(tab->rejected_rate), 1, __ATOMIC_RELAXED);
+        err = EAGAIN;
+    }
+    else
+    {
+        if (rate > 0)   c->tokens -= 1;
+        ++c->sessions;
+        *client = c;
+    }
+    pthread_mutex_unlock (lock);
+
+    if (err)    { errno = err; return -1; }
+    return 0;
+}
+
+/** Counts out a session of the client. Its entry stays until it's idle, so that
+    the connection rate is still enforced once the session is gone. */
+void leave_client(const struct server* serv, struct client* c)
+{
+    if (!serv || !serv->clients || !c)  return;
+
+    pthread_mutex_t* lock = lock_of(serv->clients, bucket_of(c->addr));
+    pthread_mutex_lock (lock);
+    --c->sessions;
+    pthread_mutex_unlock (lock);
+}
+
+
+/******************************************************************************
+ * Managing the table
+ */
+
+int init_clients(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    serv->clients = NULL;
+    if (serv->config.max_clients_per_ip <= 0 && serv->config.ip_connection_rate <= 0)
+        return 0;
+
+    struct client_table* tab = (struct client_table*)calloc(1, sizeof(struct client_table));
+    if (!tab)   return -1;
+    int i;
+    for (i = 0; i < CLIENT_STRIPES; ++i)    pthread_mutex_init (&(tab->locks[i]), NULL);
+
+    serv->clients = tab;
+    return 0;
+}
+
+int free_clients(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->clients)     return 0;
+
+    struct client_table* tab = serv->clients;
+    int i;
+    for (i = 0; i < CLIENT_BUCKETS; ++i)
+        while (tab->buckets[i])
+        {
+            struct client* c = tab->buckets[i];
+            tab->buckets[i] = c->next;
+            free (c);
+        }
+    for (i = 0; i < CLIENT_STRIPES; ++i)    pthread_mutex_destroy (&(tab->locks[i]));
+    free (tab);
+    serv->clients = NULL;
+    return 0;
+}
+
+int client_table_stats(const struct server* serv, struct client_table_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+    if (!serv->clients)     { errno = EBADFD; return -1; }
+
+    const struct client_table* tab = serv->clients;
+    stats->tracked = __atomic_load_n(&(tab->tracked), __ATOMIC_RELAXED);
+    stats->rejected_sessions = __atomic_load_n(&(tab->rejected_sessions), __ATOMIC_RELAXED);
+    stats->rejected_rate = __atomic_load_n(&(tab->rejected_rate), __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,316 @@
+/** @file compress.c
+    MODE Z transfers: data compressed with deflate on the fly, and on-disk cache
+    of files compressed before, so that repeated downloads aren't compressed again */
+
+
+#include "reefs.h"
+#include <zlib.h>
+
+
+/******************************************************************************
+ * Per-thread streams
+ */
+
+// compression state of a thread; deflate's takes a few hundred KB,
+// so it's set up once and only reset for each transfer
+struct zstate
+{
+    z_stream def;
+    int def_level;              // -1 = not initialized
+    z_stream inf;
+    int inf_ready;
+    unsigned char out[DEFLATE_OUT_LEN];
+};
+
+static pthread_key_t zstate_key;
+static pthread_once_t zstate_once = PTHREAD_ONCE_INIT;
+
+static unsigned long cache_hits, cache_misses, cache_stores;
+
+static void free_zstate(void* arg)
+{
+    struct zstate* zs = (struct zstate*)arg;
+    if (zs->def_level != -1)    deflateEnd (&(zs->def));
+    if (zs->inf_ready)          inflateEnd (&(zs->inf));
+    free (zs);
+}
+
+static void create_zstate_key()
+{
+    pthread_key_create (&zstate_key, free_zstate);
+}
+
+static struct zstate* thread_zstate()
+{
+    pthread_once (&zstate_once, create_zstate_key);
+
+    struct zstate* zs = (struct zstate*)pthread_getspecific(zstate_key);
+    if (!zs)
+    {
+        // zeroed z_streams use default allocators
+        if (!(zs = (struct zstate*)calloc(1, sizeof(struct zstate))))   return NULL;
+        zs->def_level = -1;
+        pthread_setspecific (zstate_key, zs);
+    }
+    return zs;
+}
+
+/** Returns thread's compressor, ready for a new stream. */
+static z_stream* thread_deflater(struct zstate* zs, int level)
+{
+    if (zs->def_level == level)
+    {
+        deflateReset (&(zs->def));
+        return &(zs->def);
+    }
+
+    if (zs->def_level != -1)    deflateEnd (&(zs->def));
+    zs->def_level = -1;
+    if (deflateInit(&(zs->def), level) != Z_OK) { errno = ENOMEM; return NULL; }
+    zs->def_level = level;
+    return &(zs->def);
+}
+
+/** Returns thread's decompressor, ready for a new stream. */
+static z_stream* thread_inflater(struct zstate* zs)
+{
+    if (zs->inf_ready)
+    {
+        inflateReset (&(zs->inf));
+        return &(zs->inf);
+    }
+
+    if (inflateInit(&(zs->inf)) != Z_OK)    { errno = ENOMEM; return NULL; }
+    zs->inf_ready = 1;
+    return &(zs->inf);
+}
+
+
+/******************************************************************************
+ * Compressing and decompressing data
+ */
+
+/** Compresses the rest of input file into output descriptor and, while *cache_ok is set,
+    into cache_fd as well (failing to write the cache only clears *cache_ok). Output is
+    subject to session's bandwidth limits. Returns number of compressed bytes written to out_fd. */
+static ssize_t deflate_data(struct session* ses, z_stream* z, unsigned char* out, int out_fd, int in_fd,
+                            char* buf, size_t buf_len, int cache_fd, int* cache_ok)
+{
+    ssize_t c;
+    size_t len = 0;
+    int flush;
+
+    do
+    {
+        if ((c = TEMP_FAILURE_RETRY(read(in_fd, buf, buf_len))) < 0)  return -1;
+        flush = c == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z->next_in = (Bytef*)buf;
+        z->avail_in = c;
+
+        // compressor never fails on a consistent stream, it may only need more room
+        do
+        {
+            z->next_out = out;
+            z->avail_out = DEFLATE_OUT_LEN;
+            deflate (z, flush);
+
+            size_t have = DEFLATE_OUT_LEN - z->avail_out;
+            if (have == 0)  continue;
+            if (throttled_write(ses, out_fd, (const char*)out, have) < 0)  return -1;
+            if (*cache_ok && write_data(cache_fd, (const char*)out, have) < 0)  *cache_ok = 0;
+            len += have;
+        } while (z->avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    return len;
+}
+
+/** Decompresses a single deflate stream from input descriptor (read within session's
+    bandwidth limits) into output file. Returns number of compressed bytes read; -1 with
+    errno set to EPROTO if the stream is corrupt or ends prematurely. */
+static ssize_t inflate_data(struct session* ses, z_stream* z, unsigned char* out, int out_fd, int in_fd,
+                            char* buf, size_t buf_len)
+{
+    ssize_t c;
+    size_t len = 0;
+    int res = Z_OK;
+
+    while (res != Z_STREAM_END)
+    {
+        if ((c = throttled_read(ses, in_fd, buf, buf_len)) < 0)  return -1;
+        if (c == 0) { errno = EPROTO; return -1; }
+        z->next_in = (Bytef*)buf;
+        z->avail_in = c;
+        len += c;
+
+        do
+        {
+            z->next_out = out;
+            z->avail_out = DEFLATE_OUT_LEN;
+            res = inflate(z, Z_NO_FLUSH);
+            if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)   { errno = EPROTO; return -1; }
+
+            size_t have = DEFLATE_OUT_LEN - z->avail_out;
+            if (have > 0 && write_data(out_fd, (const char*)out, have) < 0)   return -1;
+        } while (z->avail_out == 0 && res != Z_STREAM_END);
+    }
+
+    return len;
+}
+
+
+/******************************************************************************
+ * Cache of compressed files
+ */
+
+// header of a compressed variant, telling which version of the file it was made of
+struct deflate_header
+{
+    char magic[8];
+    int64_t size, mtime_sec, mtime_nsec, level;
+};
+
+#define DEFLATE_MAGIC "REEFS-Z1"
+
+/** Builds path of file's compressed variant in the cache. It's named after file's identity
+    only, so that a variant of the file before it changed is replaced by the new one. */
+static char* cache_path(const struct config* cfg, const struct stat* st, char* out)
+{
+    int c = snprintf(out, MAX_PATH, "%s/%llx-%llx.z", cfg->deflate_cache_dir,
+                     (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    if (c < 0 || c >= MAX_PATH) { errno = ENAMETOOLONG; return NULL; }
+    return out;
+}
+
+static void fill_header(struct deflate_header* h, const struct stat* st, int level)
+{
+    memset (h, 0, sizeof(struct deflate_header));
+    memcpy (h->magic, DEFLATE_MAGIC, sizeof(h->magic));
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->level = level;
+}
+
+/** Sends compressed variant of the file from cache. Returns -1 with errno set to ENOENT
+    if there is none, or it's of another version of the file (or compression level). */
+static ssize_t send_cached(struct session* ses, const char* path, const struct stat* st)
+{
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd == -1)   return -1;
+
+    struct deflate_header want, have;
+    fill_header (&want, st, ses->server->config.deflate_level);
+    if (read_data(fd, (char*)&have, sizeof(have)) != (ssize_t)sizeof(have) || memcmp(&want, &have, sizeof(have)) != 0)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = ENOENT; return -1;
+    }
+
+    ssize_t c;
+    size_t chunk = ses->server->config.transfer_chunk;
+    if (throttling(ses))
+        c = throttled_send(ses, ses->data_socket, fd, NULL, SIZE_MAX, session_buffer(ses), chunk);
+    else if ((c = sendfile_data(ses->data_socket, fd)) == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? copy_data(ses->data_socket, fd, buf, chunk) : -1;
+    }
+
+    int err = errno;
+    TEMP_FAILURE_RETRY(close(fd));
+    errno = err;
+    return c;
+}
+
+/** Creates the cache directory, if there's to be any. */
+int init_deflate_cache(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    const char* dir = serv->config.deflate_cache_dir;
+    if (serv->config.deflate_level == 0 || !*dir)   return 0;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)  return -1;
+    return 0;
+}
+
+int deflate_cache_stats(struct deflate_cache_stats* stats)
+{
+    if (!stats) { errno = EFAULT; return -1; }
+
+    stats->hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+    stats->stores = __atomic_load_n(&cache_stores, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Transfers
+ */
+
+/** Sends the rest of open file over session's data connection, compressed. Whole files
+    are served from the cache when possible; otherwise they're stored there while sent. */
+ssize_t send_deflated(struct session* ses, int fd, off_t offset)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    const struct config* cfg = &(ses->server->config);
+    char* buf = session_buffer(ses);
+    struct zstate* zs = thread_zstate();
+    if (!buf || !zs)    return -1;
+
+    char path[MAX_PATH], temp[MAX_PATH];
+    struct stat st;
+    int cache_fd = -1, cache_ok = 0;
+    if (offset == 0 && *(cfg->deflate_cache_dir) && fstat(fd, &st) != -1 && S_ISREG(st.st_mode)
+        && cache_path(cfg, &st, path))
+    {
+        ssize_t c = send_cached(ses, path, &st);
+        if (c != -1 || errno != ENOENT)
+        {
+            if (c != -1)    __atomic_add_fetch (&cache_hits, 1, __ATOMIC_RELAXED);
+            return c;
+        }
+        __atomic_add_fetch (&cache_misses, 1, __ATOMIC_RELAXED);
+
+        // written aside and moved in place (over the stale variant, if any) when complete,
+        // so that nobody sees it partial
+        struct deflate_header h;
+        fill_header (&h, &st, cfg->deflate_level);
+        int len = snprintf(temp, MAX_PATH, "%s/.tmp-XXXXXX", cfg->deflate_cache_dir);
+        if (len > 0 && len < MAX_PATH && (cache_fd = mkostemp(temp, O_CLOEXEC)) != -1)
+            cache_ok = write_data(cache_fd, (const char*)&h, sizeof(h)) == (ssize_t)sizeof(h);
+    }
+
+    ssize_t c = -1;
+    z_stream* z = thread_deflater(zs, cfg->deflate_level);
+    if (z)  c = deflate_data(ses, z, zs->out, ses->data_socket, fd, buf, cfg->transfer_chunk, cache_fd, &cache_ok);
+
+    if (cache_fd != -1)
+    {
+        int err = errno;
+        if (TEMP_FAILURE_RETRY(close(cache_fd)) == -1)   cache_ok = 0;
+        if (c != -1 && cache_ok && rename(temp, path) != -1)
+            __atomic_add_fetch (&cache_stores, 1, __ATOMIC_RELAXED);
+        else
+            unlink (temp);
+        errno = err;
+    }
+
+    return c;
+}
+
+/** Receives compressed data from session's data connection, writing it to open file. */
+ssize_t receive_deflated(struct session* ses, int fd)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    char* buf = session_buffer(ses);
+    struct zstate* zs = thread_zstate();
+    if (!buf || !zs)    return -1;
+
+    z_stream* z = thread_inflater(zs);
+    if (!z) return -1;
+    return inflate_data(ses, z, zs->out, fd, ses->data_socket, buf, ses->server->config.transfer_chunk);
+}
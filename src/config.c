@@ -3,6 +3,7 @@
 
 
 #include "reefs.h"
+#include <poll.h>
 
 
 /******************************************************************************
@@ -98,7 +99,20 @@ ssize_t read_data(int fd, char* buf, size_t count)
      return len;
 }
 
-/** Writes to file, handling the possibility of signal interruption. */
+/** Waits until non-blocking descriptor (e.g. a socket with full send buffer) can be written to,
+    at most timeout ms (-1 = no limit; ETIMEDOUT once it passes). */
+int wait_writable(int fd, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    int c = TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout));
+    if (c == 0) { errno = ETIMEDOUT; return -1; }
+    return c == -1 ? -1 : 0;
+}
+
+/** Writes to file, handling the possibility of signal interruption
+    (and of non-blocking descriptor being full). */
 ssize_t write_data(int fd, const char* buf, size_t count)
 {
     int c;
@@ -107,6 +121,7 @@ ssize_t write_data(int fd, const char* buf, size_t count)
     do
     {
         c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd, -1) != -1)  continue;
         if (c < 0) return c;
 
         buf += c;
@@ -117,6 +132,184 @@ ssize_t write_data(int fd, const char* buf, size_t count)
     return len;
 }
 
+/** Copies the rest of input file to output descriptor through the supplied buffer. */
+ssize_t copy_data(int out_fd, int in_fd, char* buf, size_t buf_len)
+{
+    ssize_t c;
+    size_t len = 0;
+
+    while ((c = read_data(in_fd, buf, buf_len)) > 0)
+    {
+        if (write_data(out_fd, buf, c) < c) return -1;
+        len += c;
+    }
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Copies the rest of input file to output descriptor (usually a socket) inside the kernel,
+    using sendfile(). Returns number of bytes copied or -1; EINVAL or ENOSYS mean that
+    sendfile() can't handle these descriptors (file offset is kept, so caller may fall back). */
+ssize_t sendfile_data(int out_fd, int in_fd)
+{
+    ssize_t c;
+    size_t len = 0;
+
+    while ((c = TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, NULL, ZERO_COPY_CHUNK))) > 0)
+        len += c;
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Copies count bytes of input file, starting at offset, to output descriptor without
+    touching the file offset, so that many transfers can share the file. sendfile() is used
+    if possible, otherwise the data is copied through buf. Returns number of bytes copied or -1. */
+ssize_t send_range(int out_fd, int in_fd, off_t offset, size_t count, char* buf, size_t buf_len)
+{
+    ssize_t c = 0;
+    size_t len = 0;
+
+    while (len < count)
+    {
+        size_t n = count - len < ZERO_COPY_CHUNK ? count - len : ZERO_COPY_CHUNK;
+        if ((c = TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, &offset, n))) <= 0)    break;
+        len += c;
+    }
+    if (c == -1 && (errno == EINVAL || errno == ENOSYS) && buf)
+    {
+        // sendfile() can't handle these descriptors: copy the rest
+        while (len < count)
+        {
+            size_t n = count - len < buf_len ? count - len : buf_len;
+            if ((c = TEMP_FAILURE_RETRY(pread(in_fd, buf, n, offset))) <= 0)   break;
+            if (write_data(out_fd, buf, c) < c)    { c = -1; break; }
+            offset += c;
+            len += c;
+        }
+    }
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Copies the rest of input to output descriptor through a pipe, using splice() to move
+    up to `chunk` bytes at once. One end may be a socket, the other should be a file.
+    On EINVAL or ENOSYS whatever got stuck in the pipe is still written out (by plain copying),
+    so caller may fall back to copy_data() without losing any data. */
+ssize_t splice_data(int out_fd, int in_fd, size_t chunk)
+{
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) == -1)    return -1;
+    fcntl (pfd[1], F_SETPIPE_SZ, (int)chunk);  // larger pipe means fewer calls (best effort)
+
+    ssize_t c, p = 0;
+    size_t len = 0;
+    for (;;)
+    {
+        c = TEMP_FAILURE_RETRY(splice(in_fd, NULL, pfd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE));
+        if (c <= 0) break;
+
+        // move everything that landed in the pipe to the output
+        while (c > 0)
+        {
+            p = TEMP_FAILURE_RETRY(splice(pfd[0], NULL, out_fd, NULL, c, SPLICE_F_MOVE | SPLICE_F_MORE));
+            if (p <= 0) break;
+            c -= p;
+            len += p;
+        }
+        if (p <= 0) { p = c; c = -1; break; }   // p = bytes left in the pipe
+    }
+
+    int err = errno;
+    if (c < 0 && p > 0 && (err == EINVAL || err == ENOSYS))
+    {
+        // output doesn't support splicing: flush the pipe the old way
+        char buf[BUF_LEN];
+        ssize_t r;
+        while (p > 0 && (r = read_data(pfd[0], buf, p < BUF_LEN ? p : BUF_LEN)) > 0)
+        {
+            if (write_data(out_fd, buf, r) < r) { err = errno; break; }
+            p -= r;
+        }
+    }
+    TEMP_FAILURE_RETRY(close(pfd[0]));
+    TEMP_FAILURE_RETRY(close(pfd[1]));
+    errno = err;
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Like splice_data() (with a file as output), but also lets the tap see the data: each
+    chunk spliced into the pipe is duplicated by tee() into another one, which is read
+    through buf, so that the data leaves the kernel once instead of being read and written
+    again. On EINVAL or ENOSYS the pipe is flushed by plain copying (still tapped), so caller
+    may fall back to copying without losing any data. */
+ssize_t splice_tapped(int out_fd, int in_fd, size_t chunk, char* buf, size_t buf_len, struct data_tap* tap)
+{
+    int pfd[2], cfd[2];
+    if (pipe2(pfd, O_CLOEXEC) == -1)    return -1;
+    if (pipe2(cfd, O_CLOEXEC) == -1)
+    {
+        int err = errno;
+        TEMP_FAILURE_RETRY(close(pfd[0]));
+        TEMP_FAILURE_RETRY(close(pfd[1]));
+        errno = err;    return -1;
+    }
+    // tee() duplicates only as much as the other pipe takes, so they're of the same size
+    fcntl (pfd[1], F_SETPIPE_SZ, (int)chunk);
+    fcntl (cfd[1], F_SETPIPE_SZ, (int)chunk);
+
+    ssize_t c, r;
+    size_t len = 0, left = 0, seen = 0;     // bytes in the pipe, and how many of those the tap has seen
+    for (;;)
+    {
+        if (left == 0)
+        {
+            c = TEMP_FAILURE_RETRY(splice(in_fd, NULL, pfd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE));
+            if (c <= 0) break;
+            left = c;
+        }
+        if (seen == 0)
+        {
+            // duplicate what's in the pipe, and let the tap see the copy
+            c = TEMP_FAILURE_RETRY(tee(pfd[0], cfd[1], left, 0));
+            if (c <= 0) { if (c == 0) errno = EIO; c = -1; break; }
+            for (seen = 0; seen < (size_t)c; seen += r)
+            {
+                r = read_data(cfd[0], buf, (size_t)c - seen < buf_len ? (size_t)c - seen : buf_len);
+                if (r <= 0) break;
+                tap->seen (tap, buf, r);
+            }
+            if (seen < (size_t)c)   { if (r == 0) errno = EIO; c = -1; break; }
+        }
+
+        c = TEMP_FAILURE_RETRY(splice(pfd[0], NULL, out_fd, NULL, seen, SPLICE_F_MOVE | SPLICE_F_MORE));
+        if (c <= 0) { if (c == 0) errno = EIO; c = -1; break; }
+        left -= c;
+        seen -= c;
+        len += c;
+    }
+
+    int err = errno;
+    if (c < 0 && left > 0 && (err == EINVAL || err == ENOSYS))
+    {
+        // tee() or output doesn't support splicing: flush the pipe the old way
+        while (left > 0 && (r = read_data(pfd[0], buf, left < buf_len ? left : buf_len)) > 0)
+        {
+            if ((size_t)r > seen)   tap->seen (tap, buf + seen, r - seen);
+            seen = (size_t)r < seen ? seen - r : 0;
+            if (write_data(out_fd, buf, r) < r) { err = errno; break; }
+            left -= r;
+        }
+    }
+    TEMP_FAILURE_RETRY(close(cfd[0]));
+    TEMP_FAILURE_RETRY(close(cfd[1]));
+    TEMP_FAILURE_RETRY(close(pfd[0]));
+    TEMP_FAILURE_RETRY(close(pfd[1]));
+    errno = err;
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
 /** Reads a line from file. Result is allocated on heap and should be freed by caller. */
 char* read_line(int fd)
 {
@@ -222,37 +415,60 @@ int is_config_command(const char* line)
 
 /*****************************************************************************/
 
+/** Reads the users file into an array, growing it geometrically. File is read at once
+    and parsed in place, as it may well contain hundreds of thousands of accounts. */
 struct user* parse_users_file(const char* file, int* users_count)
 {
     if (!file || !users_count)  { errno = EFAULT; return 0; }
 
     int fd;
-    if ((fd = TEMP_FAILURE_RETRY(open(file, O_RDONLY))) == -1)    return 0;
-
-    char* line = NULL;
-    char** cmd;
-    int cmd_count;
-    struct user* res = NULL;
+    if ((fd = TEMP_FAILURE_RETRY(open(file, O_RDONLY | O_CLOEXEC))) == -1)    return 0;
+
+    struct stat st;
+    char* text = NULL;
+    ssize_t len = -1;
+    if (fstat(fd, &st) != -1 && (text = (char*)malloc(st.st_size + 1)))
+        len = read_data(fd, text, st.st_size);
+    TEMP_FAILURE_RETRY(close(fd));
+    if (len < 0)    { free(text); return 0; }
+    text[len] = '\0';
+
+    struct user* res = (struct user*)malloc(sizeof(struct user));   // no users is fine too
+    int capacity = 1;
     *users_count = 0;
-    for(;;)
+
+    char *line, *next, *login, *password;
+    for (line = text; line && res; line = next)
     {
-        line = read_line(fd);
-        if (!line) return res;
+        if ((next = strchr(line, '\n')))  *next++ = '\0';
+        if (!is_config_command(line))   continue;
 
-        if (!is_config_command(line)) continue;
-        if (!(cmd = split_by_whitespaces(line, &cmd_count)) || cmd_count < 2)
-            { free(line); continue; }  // ignore malformed entries
-        free (line);
+        // login and password are the first two words; ignore malformed entries
+        login = line + strspn(line, " \t\r");
+        password = login + strcspn(login, " \t\r");
+        if (!*password) continue;
+        *password++ = '\0';
+        password += strspn(password, " \t\r");
+        password[strcspn(password, " \t\r")] = '\0';
+        if (!*password) continue;
 
         // add user
-        if (!(res = (struct user*)realloc(res, (*users_count + 1) * sizeof(struct user))))
-            { free(cmd); free(res);  return 0; }
-        strncpy (res[*users_count].login, cmd[0], MAX_LOGIN);
-        strncpy (res[*users_count].password, cmd[1], MAX_PASSWORD);
+        if (*users_count == capacity)
+        {
+            capacity *= 2;
+            struct user* users = (struct user*)realloc(res, capacity * sizeof(struct user));
+            if (!users) { free(res); res = NULL; break; }
+            res = users;
+        }
+        strncpy (res[*users_count].login, login, MAX_LOGIN);
+        res[*users_count].login[MAX_LOGIN - 1] = '\0';
+        strncpy (res[*users_count].password, password, MAX_PASSWORD);
+        res[*users_count].password[MAX_PASSWORD - 1] = '\0';
         ++*users_count;
-
-        free_strings (cmd, cmd_count);
     }
+
+    free (text);
+    return res;
 }
 
 /** Reads a single config line and modifies the supplied config struct accordingly. */
@@ -264,10 +480,135 @@ int read_config_param(char** cmd, struct config* cfg)
         strncpy (cfg->root_dir, cmd[1], MAX_PATH);
     else if (strcmp(cmd[0], "port") == 0)
         cfg->port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "listen-backlog") == 0)
+    {
+        cfg->listen_backlog = atoi(cmd[1]);
+        if (cfg->listen_backlog < 1)    { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "acceptors") == 0)
+    {
+        cfg->acceptors = atoi(cmd[1]);
+        if (cfg->acceptors < 1)         { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "cpu-affinity") == 0)
+    {
+        if (strcmp(cmd[1], "no") == 0)          cfg->cpu_affinity = 0;
+        else if (strcmp(cmd[1], "yes") == 0)    cfg->cpu_affinity = 1;
+        else                                    { errno = EINVAL; return -1; }
+    }
     else if (strcmp(cmd[0], "max-clients") == 0)
         cfg->max_clients = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "max-clients-per-ip") == 0)
+        cfg->max_clients_per_ip = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "ip-connection-rate") == 0)
+        cfg->ip_connection_rate = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "io-model") == 0)
+    {
+        if (strcmp(cmd[1], "threads") == 0)     cfg->io_model = IO_MODEL_THREADS;
+        else if (strcmp(cmd[1], "epoll") == 0)  cfg->io_model = IO_MODEL_EPOLL;
+        else                                    { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "io-backend") == 0)
+    {
+        if (strcmp(cmd[1], "splice") == 0)          cfg->io_backend = IO_BACKEND_SPLICE;
+        else if (strcmp(cmd[1], "copy") == 0)       cfg->io_backend = IO_BACKEND_COPY;
+        else if (strcmp(cmd[1], "io_uring") == 0)   cfg->io_backend = IO_BACKEND_URING;
+        else                                        { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "io-threads") == 0)
+        cfg->io_threads = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "log-sync") == 0)
+    {
+        if (strcmp(cmd[1], "none") == 0)            cfg->log_sync = LOG_SYNC_NONE;
+        else if (strcmp(cmd[1], "periodic") == 0)   cfg->log_sync = LOG_SYNC_PERIODIC;
+        else if (strcmp(cmd[1], "always") == 0)     cfg->log_sync = LOG_SYNC_ALWAYS;
+        else                                        { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "log-overflow") == 0)
+    {
+        if (strcmp(cmd[1], "block") == 0)           cfg->log_overflow = LOG_OVERFLOW_BLOCK;
+        else if (strcmp(cmd[1], "drop") == 0)       cfg->log_overflow = LOG_OVERFLOW_DROP;
+        else                                        { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "log-buffer") == 0)
+        cfg->log_buffer = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "max-segments") == 0)
+    {
+        cfg->max_segments = atoi(cmd[1]);
+        if (cfg->max_segments < 0 || cfg->max_segments > MAX_SEGMENTS)    { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "deflate-level") == 0)
+    {
+        cfg->deflate_level = atoi(cmd[1]);
+        if (cfg->deflate_level < 0 || cfg->deflate_level > 9)  { errno = EINVAL; return -1; }
+    }
+    else if (strcmp(cmd[0], "deflate-cache") == 0)
+        strncpy (cfg->deflate_cache_dir, cmd[1], MAX_PATH);
+    else if (strcmp(cmd[0], "pasv-min-port") == 0)
+        cfg->pasv_min_port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "pasv-max-port") == 0)
+        cfg->pasv_max_port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "active-min-port") == 0)
+        cfg->active_min_port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "active-max-port") == 0)
+        cfg->active_max_port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "connect-timeout") == 0)
+        cfg->connect_timeout = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "login-timeout") == 0)
+        cfg->login_timeout = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "idle-timeout") == 0)
+        cfg->idle_timeout = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "data-timeout") == 0)
+        cfg->data_timeout = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "rate-limit") == 0)
+        cfg->rate_limit = atol(cmd[1]);
+    else if (strcmp(cmd[0], "user-rate-limit") == 0)
+        cfg->user_rate_limit = atol(cmd[1]);
+    else if (strcmp(cmd[0], "session-rate-limit") == 0)
+        cfg->session_rate_limit = atol(cmd[1]);
+    else if (strcmp(cmd[0], "pasv-address") == 0)
+    {
+        struct in_addr addr;
+        if (!inet_aton(cmd[1], &addr))  { errno = EINVAL; return -1; }
+        strncpy (cfg->pasv_address, inet_ntoa(addr), MAX_IPv4_LEN);
+    }
+    else if (strcmp(cmd[0], "metrics-port") == 0)
+        cfg->metrics_port = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "metrics-socket") == 0)
+        strncpy (cfg->metrics_socket, cmd[1], MAX_PATH);
+    else if (strcmp(cmd[0], "list-cache-size") == 0)
+        cfg->list_cache_size = atol(cmd[1]);
+    else if (strcmp(cmd[0], "hot-cache-size") == 0)
+        cfg->hot_cache_size = atol(cmd[1]);
+    else if (strcmp(cmd[0], "hot-file-max") == 0)
+        cfg->hot_file_max = atol(cmd[1]);
+    else if (strcmp(cmd[0], "digest-cache-size") == 0)
+        cfg->digest_cache_size = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "upload-digests") == 0)
+    {
+        cfg->upload_digests = 0;
+        if (strcmp(cmd[1], "none") != 0)
+        {
+            char *name, *save;
+            for (name = strtok_r(cmd[1], ",", &save); name; name = strtok_r(NULL, ",", &save))
+            {
+                int a = digest_algorithm(name);
+                if (a == -1)    { errno = EINVAL; return -1; }
+                cfg->upload_digests |= 1u << a;
+            }
+        }
+    }
+    else if (strcmp(cmd[0], "transfer-chunk") == 0)
+    {
+        if (atoi(cmd[1]) < BUF_LEN)     { errno = EINVAL; return -1; }
+        cfg->transfer_chunk = atoi(cmd[1]);
+    }
     else if (strcmp(cmd[0], "users-file") == 0)
         strncpy (cfg->users_file, cmd[1], MAX_PATH);
+    else if (strcmp(cmd[0], "auth-threads") == 0)
+        cfg->auth_threads = atoi(cmd[1]);
+    else if (strcmp(cmd[0], "transfer-threads") == 0)
+        cfg->transfer_threads = atoi(cmd[1]);
     else if (strcmp(cmd[0], "log-file") == 0)
         strncpy (cfg->log_file, cmd[1], MAX_PATH);
     else
@@ -317,8 +658,39 @@ int load_config(const char* file, struct config* cfg)
     strncpy (cfg->log_file, DEFAULT_LOG_FILE, MAX_PATH);
     strncpy (cfg->root_dir, DEFAULT_ROOT_DIR, MAX_PATH);
     cfg->port = DEFAULT_LISTEN_PORT;
+    cfg->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    cfg->acceptors = DEFAULT_ACCEPTORS;
+    cfg->cpu_affinity = 0;
     cfg->max_clients = 0;
-    cfg->users_count = 0;
+    cfg->max_clients_per_ip = cfg->ip_connection_rate = 0;
+    cfg->io_model = IO_MODEL_THREADS;
+    cfg->io_threads = DEFAULT_IO_THREADS;
+    cfg->transfer_chunk = DEFAULT_TRANSFER_CHUNK;
+    cfg->io_backend = IO_BACKEND_SPLICE;
+    cfg->list_cache_size = DEFAULT_LIST_CACHE_SIZE;
+    cfg->hot_cache_size = DEFAULT_HOT_CACHE_SIZE;
+    cfg->hot_file_max = DEFAULT_HOT_FILE_MAX;
+    cfg->digest_cache_size = DEFAULT_DIGEST_CACHE_SIZE;
+    cfg->upload_digests = 1u << DEFAULT_DIGEST;
+    cfg->log_buffer = DEFAULT_LOG_BUFFER;
+    cfg->log_sync = LOG_SYNC_PERIODIC;
+    cfg->log_overflow = LOG_OVERFLOW_BLOCK;
+    cfg->max_segments = DEFAULT_MAX_SEGMENTS;
+    cfg->deflate_level = DEFAULT_DEFLATE_LEVEL;
+    *(cfg->deflate_cache_dir) = '\0';
+    cfg->pasv_min_port = DEFAULT_PASV_MIN_PORT;
+    cfg->pasv_max_port = DEFAULT_PASV_MAX_PORT;
+    *(cfg->pasv_address) = '\0';
+    cfg->active_min_port = cfg->active_max_port = 0;
+    cfg->connect_timeout = DEFAULT_CONNECT_TIMEOUT_MS;
+    cfg->login_timeout = DEFAULT_LOGIN_TIMEOUT;
+    cfg->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    cfg->data_timeout = DEFAULT_DATA_TIMEOUT;
+    cfg->rate_limit = cfg->user_rate_limit = cfg->session_rate_limit = 0;
+    cfg->metrics_port = 0;
+    *(cfg->metrics_socket) = '\0';
+    cfg->auth_threads = DEFAULT_AUTH_THREADS;
+    cfg->transfer_threads = DEFAULT_TRANSFER_THREADS;
 
     if (parse_config_file (file, cfg) != -1)
     {
@@ -334,8 +706,5 @@ int load_config(const char* file, struct config* cfg)
             { strncpy (cfg->log_file, path, MAX_PATH);      free (path); }
     }
 
-    if (!(cfg->users = parse_users_file(cfg->users_file, &(cfg->users_count))))
-        cfg->users_count = 0;
-
     return 0;
 }
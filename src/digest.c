@@ -0,0 +1,448 @@
+/** @file digest.c
+    Checksums of files (HASH, XCRC, XMD5, XSHA256). SHA and MD5 are left to OpenSSL,
+    which uses SHA extensions of the CPU if it has them, CRC32 to zlib and CRC32C is
+    computed by SSE4.2 instruction (or from a table elsewhere). Checksums are cached,
+    and those of uploaded files are computed on the way in, so that they don't have
+    to be read again */
+
+
+#include "reefs.h"
+#include <zlib.h>
+#include <openssl/evp.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+static const char* const DIGEST_NAMES[DIGEST_ALGORITHMS] = { "SHA-1", "SHA-256", "SHA-512", "MD5", "CRC32", "CRC32C" };
+
+/** Finds the algorithm by its name (case-insensitively). Returns DIGEST_* or -1. */
+int digest_algorithm(const char* name)
+{
+    int i;
+    for (i = 0; i < DIGEST_ALGORITHMS; ++i)
+        if (strcasecmp(name, DIGEST_NAMES[i]) == 0) return i;
+    return -1;
+}
+
+const char* digest_name(int algorithm)
+{
+    return algorithm >= 0 && algorithm < DIGEST_ALGORITHMS ? DIGEST_NAMES[algorithm] : NULL;
+}
+
+
+/******************************************************************************
+ * CRC32C
+ */
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_bytes(uint32_t crc, const unsigned char* p, size_t n)
+{
+    while (n--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy (&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    for (; n > 0; --n)  crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char* p, size_t n) = crc32c_bytes;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/** Fills in the table and picks the instruction if the CPU has it. */
+static void init_crc32c()
+{
+    uint32_t i, j, c;
+    for (i = 0; i < 256; ++i)
+    {
+        for (c = i, j = 0; j < 8; ++j)  c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports("sse4.2"))   crc32c_update = crc32c_sse42;
+#endif
+}
+
+
+/******************************************************************************
+ * Computing checksums
+ */
+
+// checksum being computed
+struct digest
+{
+    int algorithm;
+    EVP_MD_CTX* md;             // SHA and MD5
+    uint32_t crc;               // CRC32 and CRC32C
+};
+
+static const EVP_MD* digest_md(int algorithm)
+{
+    switch (algorithm)
+    {
+        case DIGEST_SHA1:   return EVP_sha1();
+        case DIGEST_SHA256: return EVP_sha256();
+        case DIGEST_SHA512: return EVP_sha512();
+        case DIGEST_MD5:    return EVP_md5();
+    }
+    return NULL;
+}
+
+static int start_digest(struct digest* d, int algorithm)
+{
+    d->algorithm = algorithm;
+    d->md = NULL;
+    d->crc = algorithm == DIGEST_CRC32C ? 0xffffffff : crc32(0, NULL, 0);
+    if (algorithm == DIGEST_CRC32C) pthread_once (&crc32c_once, init_crc32c);
+
+    const EVP_MD* md = digest_md(algorithm);
+    if (!md)    return 0;
+    if (!(d->md = EVP_MD_CTX_new()))    { errno = ENOMEM; return -1; }
+    if (!EVP_DigestInit_ex(d->md, md, NULL))
+    {
+        EVP_MD_CTX_free (d->md);
+        errno = EINVAL; return -1;
+    }
+    return 0;
+}
+
+static void update_digest(struct digest* d, const char* buf, size_t len)
+{
+    if (d->md)                              EVP_DigestUpdate (d->md, buf, len);
+    else if (d->algorithm == DIGEST_CRC32)  d->crc = crc32(d->crc, (const Bytef*)buf, len);
+    else                                    d->crc = crc32c_update(d->crc, (const unsigned char*)buf, len);
+}
+
+/** Writes the checksum out in hex (MAX_DIGEST_HEX bytes at most) and frees the digest. */
+static void finish_digest(struct digest* d, char* hex)
+{
+    if (!d->md)
+    {
+        snprintf (hex, MAX_DIGEST_HEX, "%08x", d->algorithm == DIGEST_CRC32C ? ~d->crc : d->crc);
+        return;
+    }
+
+    unsigned char sum[EVP_MAX_MD_SIZE];
+    unsigned len = 0, i;
+    EVP_DigestFinal_ex (d->md, sum, &len);
+    EVP_MD_CTX_free (d->md);
+    for (i = 0; i < len; ++i)   snprintf (hex + 2 * i, 3, "%02x", sum[i]);
+    hex[2 * len] = '\0';
+}
+
+static void abort_digest(struct digest* d)
+{
+    if (d->md)  EVP_MD_CTX_free (d->md);
+}
+
+
+/******************************************************************************
+ * Cache
+ */
+
+static unsigned digest_hash(dev_t dev, ino_t ino, int algorithm)
+{
+    uint64_t h = ((uint64_t)dev * 31 + (uint64_t)ino) * 8 + algorithm;
+    return (unsigned)((h * 0x9e3779b97f4a7c15ull) >> 32) % DIGEST_CACHE_BUCKETS;
+}
+
+/** Finds the entry of file's checksum, whether it's still valid or not.
+    Must be called with cache's lock held. */
+static struct digest_cache_entry* find_digest(struct digest_cache* dc, const struct stat* st, int algorithm)
+{
+    struct digest_cache_entry* e;
+    for (e = dc->buckets[digest_hash(st->st_dev, st->st_ino, algorithm)]; e; e = e->hash_next)
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->algorithm == algorithm)  return e;
+    return NULL;
+}
+
+static int digest_valid(const struct digest_cache_entry* e, const struct stat* st)
+{
+    return e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/** Moves the entry to the front of LRU list. Must be called with cache's lock held. */
+static void touch_digest(struct digest_cache* dc, struct digest_cache_entry* e)
+{
+    if (dc->head == e)  return;
+
+    if (e->prev)    e->prev->next = e->next;
+    if (e->next)    e->next->prev = e->prev;    else dc->tail = e->prev;
+    e->prev = NULL;
+    e->next = dc->head;
+    dc->head->prev = e;
+    dc->head = e;
+}
+
+static void remove_digest(struct digest_cache* dc, struct digest_cache_entry* e)
+{
+    struct digest_cache_entry** p;
+    for (p = &(dc->buckets[digest_hash(e->dev, e->ino, e->algorithm)]); *p != e; p = &((*p)->hash_next)) { }
+    *p = e->hash_next;
+
+    if (e->prev)    e->prev->next = e->next;    else dc->head = e->next;
+    if (e->next)    e->next->prev = e->prev;    else dc->tail = e->prev;
+    --dc->count;
+    free (e);
+}
+
+/** Looks up file's checksum. Returns 1 and fills in hex if it's cached, 0 otherwise. */
+static int cached_digest(struct digest_cache* dc, const struct stat* st, int algorithm, char* hex)
+{
+    if (!dc)    return 0;
+
+    pthread_mutex_lock (&(dc->lock));
+    struct digest_cache_entry* e = find_digest(dc, st, algorithm);
+    int hit = e && digest_valid(e, st);
+    if (hit)
+    {
+        memcpy (hex, e->hex, MAX_DIGEST_HEX);
+        touch_digest (dc, e);
+        ++dc->hits;
+    }
+    else ++dc->misses;
+    pthread_mutex_unlock (&(dc->lock));
+
+    return hit;
+}
+
+/** Caches file's checksum, replacing whatever was cached for it before. */
+static void cache_digest(struct digest_cache* dc, const struct stat* st, int algorithm, const char* hex)
+{
+    if (!dc)    return;
+
+    pthread_mutex_lock (&(dc->lock));
+    struct digest_cache_entry* e = find_digest(dc, st, algorithm);
+    if (e)  touch_digest (dc, e);
+    else if ((e = (struct digest_cache_entry*)calloc(1, sizeof(struct digest_cache_entry))))
+    {
+        e->dev = st->st_dev;
+        e->ino = st->st_ino;
+        e->algorithm = algorithm;
+
+        unsigned h = digest_hash(e->dev, e->ino, algorithm);
+        e->hash_next = dc->buckets[h];
+        dc->buckets[h] = e;
+        if ((e->next = dc->head))   dc->head->prev = e;
+        else                        dc->tail = e;
+        dc->head = e;
+
+        if (++dc->count > dc->max_count)
+        {
+            remove_digest (dc, dc->tail);
+            ++dc->evictions;
+        }
+    }
+    if (e)
+    {
+        e->size = st->st_size;
+        e->mtime = st->st_mtim;
+        memcpy (e->hex, hex, MAX_DIGEST_HEX);
+        ++dc->stores;
+    }
+    pthread_mutex_unlock (&(dc->lock));
+}
+
+
+/******************************************************************************
+ * Checksums of files
+ */
+
+/** Gets checksum of the file from the cache, or computes it by reading the file
+    through session's transfer buffer. Also tells how big the file is. */
+int file_digest(struct session* ses, const char* file, int algorithm, char* hex, off_t* size)
+{
+    if (!ses || !file || !hex || !size)             { errno = EFAULT; return -1; }
+    if (algorithm < 0 || algorithm >= DIGEST_ALGORITHMS)    { errno = EINVAL; return -1; }
+
+    int fd = TEMP_FAILURE_RETRY(open(file, O_RDONLY | O_CLOEXEC));
+    if (fd == -1)   return -1;
+
+    struct stat st;
+    int err = 0;
+    if (fstat(fd, &st) == -1)       err = errno;
+    else if (!S_ISREG(st.st_mode))  err = EISDIR;
+    if (err)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = err;    return -1;
+    }
+    *size = st.st_size;
+
+    struct digest_cache* dc = ses->server->digests;
+    if (cached_digest(dc, &st, algorithm, hex))
+        return TEMP_FAILURE_RETRY(close(fd));
+
+    char* buf = session_buffer(ses);
+    struct digest d;
+    if (!buf || start_digest(&d, algorithm) == -1)
+    {
+        err = buf ? errno : ENOMEM;
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = err;    return -1;
+    }
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ssize_t c;
+    size_t chunk = ses->server->config.transfer_chunk;
+    while ((c = read_data(fd, buf, chunk)) > 0)
+        update_digest (&d, buf, c);
+    if (c < 0)
+    {
+        err = errno;
+        abort_digest (&d);
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = err;    return -1;
+    }
+    finish_digest (&d, hex);
+
+    // file that changed while being read isn't worth caching
+    struct stat now;
+    if (fstat(fd, &now) != -1 && now.st_size == st.st_size
+        && now.st_mtim.tv_sec == st.st_mtim.tv_sec && now.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+        cache_digest (dc, &st, algorithm, hex);
+
+    return TEMP_FAILURE_RETRY(close(fd));
+}
+
+// checksums of a file being uploaded, computed by the tap of its transfer
+struct upload_digests
+{
+    struct data_tap tap;
+    int count;
+    struct digest d[DIGEST_ALGORITHMS];
+};
+
+static void upload_seen(struct data_tap* tap, const char* buf, size_t len)
+{
+    struct upload_digests* u = (struct upload_digests*)((char*)tap - offsetof(struct upload_digests, tap));
+    int i;
+    for (i = 0; i < u->count; ++i)  update_digest (&(u->d[i]), buf, len);
+}
+
+/** Receives the whole file from data connection, computing the checksums (bits of DIGEST_*)
+    on the way and caching them once it's written. The file is moved the way receive_file()
+    would: by io_uring, whose buffers are checksummed as they're read, or spliced, with
+    the checksums computed on a tee() copy. It's copied through buf only for sessions
+    with bandwidth limits, or when neither works. Returns the number of bytes received. */
+ssize_t receive_digested(struct session* ses, int out_fd, int in_fd, char* buf, size_t buf_len, unsigned algorithms)
+{
+    struct upload_digests u;
+    int i;
+    u.tap.seen = upload_seen;
+    u.count = 0;
+    for (i = 0; i < DIGEST_ALGORITHMS; ++i)
+        if (algorithms & (1u << i))
+        {
+            if (start_digest(&(u.d[u.count]), i) == -1)
+            {
+                while (--u.count >= 0)  abort_digest (&(u.d[u.count]));
+                return -1;
+            }
+            ++u.count;
+        }
+
+    ssize_t c = -1;
+    errno = EINVAL;
+    int backend = ses->server->config.io_backend;
+    if (!throttling(ses) && backend != IO_BACKEND_COPY)
+    {
+        if (backend == IO_BACKEND_URING)
+            c = uring_receive(out_fd, in_fd, buf_len, &(u.tap));
+        if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+            c = splice_tapped(out_fd, in_fd, buf_len, buf, buf_len, &(u.tap));
+    }
+    if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+        size_t len = 0;
+        while ((c = throttled_read(ses, in_fd, buf, buf_len)) > 0)
+        {
+            upload_seen (&(u.tap), buf, c);
+            if (write_data(out_fd, buf, c) < c) { c = -1; break; }
+            len += c;
+        }
+        if (c == 0) c = len;
+    }
+
+    struct stat st;
+    if (c < 0 || fstat(out_fd, &st) == -1)
+    {
+        int err = errno;
+        for (i = 0; i < u.count; ++i)   abort_digest (&(u.d[i]));
+        errno = err;    return -1;
+    }
+    for (i = 0; i < u.count; ++i)
+    {
+        char hex[MAX_DIGEST_HEX];
+        finish_digest (&(u.d[i]), hex);
+        cache_digest (ses->server->digests, &st, u.d[i].algorithm, hex);
+    }
+
+    return c;
+}
+
+
+/******************************************************************************
+ * Managing the cache
+ */
+
+int init_digest_cache(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    serv->digests = NULL;
+    if (serv->config.digest_cache_size <= 0)    return 0;   // disabled
+
+    struct digest_cache* dc = (struct digest_cache*)calloc(1, sizeof(struct digest_cache));
+    if (!dc)    return -1;
+    pthread_mutex_init (&(dc->lock), NULL);
+    dc->max_count = serv->config.digest_cache_size;
+
+    serv->digests = dc;
+    return 0;
+}
+
+int free_digest_cache(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->digests)     return 0;
+
+    struct digest_cache* dc = serv->digests;
+    while (dc->head)    remove_digest (dc, dc->head);
+    pthread_mutex_destroy (&(dc->lock));
+
+    free (dc);
+    serv->digests = NULL;
+    return 0;
+}
+
+int digest_cache_stats(const struct server* serv, struct digest_cache_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+    if (!serv->digests)     { errno = EBADFD; return -1; }
+
+    struct digest_cache* dc = serv->digests;
+    pthread_mutex_lock (&(dc->lock));
+    stats->hits = dc->hits;
+    stats->misses = dc->misses;
+    stats->evictions = dc->evictions;
+    stats->stores = dc->stores;
+    stats->count = dc->count;
+    pthread_mutex_unlock (&(dc->lock));
+    return 0;
+}
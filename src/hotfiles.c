@@ -0,0 +1,328 @@
+/** @file hotfiles.c
+    Cache of small files downloaded over and over: their contents are kept in memory,
+    so that RETR of them is a single write to data connection. Files are looked up
+    without locking, and evicted by CLOCK algorithm once the cache is full */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Lookups
+ */
+
+static unsigned hot_hash(const char* path)
+{
+    unsigned h = 2166136261u;   // FNV-1a
+    for (; *path; ++path)   h = (h ^ (unsigned char)*path) * 16777619u;
+    return h % HOT_CACHE_BUCKETS;
+}
+
+static int hot_file_valid(const struct hot_file* f, const struct stat* st)
+{
+    return f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size
+           && f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/** Announces a reader, returning the phase it's counted in. Files taken out
+    of the table before that phase began are not reachable any more. */
+static unsigned enter_reader(struct hot_cache* hc)
+{
+    for (;;)
+    {
+        unsigned phase = __atomic_load_n(&(hc->phase), __ATOMIC_SEQ_CST);
+        __atomic_add_fetch (&(hc->readers[phase]), 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&(hc->phase), __ATOMIC_SEQ_CST) == phase)   return phase;
+
+        // phase has just changed, and the writer may not have seen this reader
+        __atomic_sub_fetch (&(hc->readers[phase]), 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void leave_reader(struct hot_cache* hc, unsigned phase)
+{
+    __atomic_sub_fetch (&(hc->readers[phase]), 1, __ATOMIC_SEQ_CST);
+}
+
+/** Finds the file without locking. Returns it with a reference taken,
+    or NULL if it isn't cached (or what is cached is out of date). */
+static struct hot_file* find_hot_file(struct hot_cache* hc, const char* path, const struct stat* st)
+{
+    unsigned phase = enter_reader(hc);
+    struct hot_file* f;
+    for (f = __atomic_load_n(&(hc->buckets[hot_hash(path)]), __ATOMIC_ACQUIRE); f;
+         f = __atomic_load_n(&(f->hash_next), __ATOMIC_ACQUIRE))
+        if (strcmp(f->path, path) == 0)
+        {
+            if (!hot_file_valid(f, st)) f = NULL;
+            else
+            {
+                __atomic_add_fetch (&(f->refs), 1, __ATOMIC_ACQUIRE);
+                __atomic_store_n (&(f->referenced), 1, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+    leave_reader (hc, phase);
+
+    __atomic_add_fetch (f ? &(hc->hits) : &(hc->misses), 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+
+/******************************************************************************
+ * Adding and evicting files
+ */
+
+/** Takes the file out of the table; it's freed once nobody can be reading it.
+    Must be called with cache's lock held. */
+static void retire_hot_file(struct hot_cache* hc, struct hot_file* f)
+{
+    struct hot_file** p;
+    for (p = &(hc->buckets[hot_hash(f->path)]); *p != f; p = &((*p)->hash_next)) { }
+    __atomic_store_n (p, f->hash_next, __ATOMIC_RELEASE);
+
+    if (f->clock_next == f) hc->hand = NULL;
+    else
+    {
+        f->clock_prev->clock_next = f->clock_next;
+        f->clock_next->clock_prev = f->clock_prev;
+        if (hc->hand == f)  hc->hand = f->clock_next;
+    }
+    --hc->count;
+    hc->size -= f->size;
+    hc->retired_size += f->size;
+
+    f->retired_next = hc->retired;
+    hc->retired = f;
+}
+
+/** Frees files nobody can be using any more, and starts a new phase if there are
+    files to wait for. Must be called with cache's lock held. */
+static void reclaim_hot_files(struct hot_cache* hc)
+{
+    struct hot_file *f, **p;
+    if (hc->waiting && __atomic_load_n(&(hc->readers[hc->phase ^ 1]), __ATOMIC_SEQ_CST) == 0)
+    {
+        // nobody finds them any more, but some may still be being sent
+        while ((f = hc->waiting))
+        {
+            hc->waiting = f->retired_next;
+            f->retired_next = hc->draining;
+            hc->draining = f;
+        }
+    }
+    for (p = &(hc->draining); (f = *p); )
+        if (__atomic_load_n(&(f->refs), __ATOMIC_ACQUIRE) == 0)
+        {
+            *p = f->retired_next;
+            hc->retired_size -= f->size;
+            free (f);
+        }
+        else p = &(f->retired_next);
+
+    if (!hc->waiting && hc->retired)
+    {
+        hc->waiting = hc->retired;
+        hc->retired = NULL;
+        __atomic_store_n (&(hc->phase), hc->phase ^ 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/** Evicts the first file the clock hand finds unused since it last passed it.
+    Must be called with cache's lock held. */
+static void evict_hot_file(struct hot_cache* hc)
+{
+    while (__atomic_exchange_n(&(hc->hand->referenced), 0, __ATOMIC_RELAXED))
+        hc->hand = hc->hand->clock_next;
+
+    retire_hot_file (hc, hc->hand);
+    ++hc->evictions;
+}
+
+/** Makes room for size bytes, evicting files until the ones in the table and the new one fit.
+    Files evicted are freed only once nobody uses them, which is bounded too: while they take
+    as much as the cache itself, nothing is added. Room is taken right away, so that files read
+    in meanwhile count too. Must be called with cache's lock held. */
+static int reserve_hot_cache(struct hot_cache* hc, size_t size)
+{
+    reclaim_hot_files (hc);
+    if (hc->retired_size + size > hc->max_size) return -1;
+
+    while (hc->hand && hc->size + size > hc->max_size)
+    {
+        // once to start a new phase, once more to free what nobody reads since
+        evict_hot_file (hc);
+        reclaim_hot_files (hc);
+        reclaim_hot_files (hc);
+    }
+    if (hc->size + size > hc->max_size) return -1;     // taken by files being read in
+
+    hc->size += size;
+    return 0;
+}
+
+/** Reads the file in and adds it to the cache. Returns it with a reference taken,
+    or NULL with errno set to EINVAL if it's not to be cached after all (e.g. there's
+    no room for it yet). */
+static struct hot_file* add_hot_file(struct hot_cache* hc, const char* path, const struct stat* st)
+{
+    pthread_mutex_lock (&(hc->lock));
+    int room = reserve_hot_cache(hc, st->st_size);
+    pthread_mutex_unlock (&(hc->lock));
+    if (room == -1) { errno = EINVAL; return NULL; }
+
+    int err = 0, fd = -1;
+    struct hot_file* f = (struct hot_file*)malloc(sizeof(struct hot_file) + st->st_size);
+    if (!f || (fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC))) == -1)
+    {
+        err = errno;
+        pthread_mutex_lock (&(hc->lock));
+        hc->size -= st->st_size;
+        pthread_mutex_unlock (&(hc->lock));
+        free (f);
+        errno = err;    return NULL;
+    }
+    strncpy (f->path, path, MAX_PATH);
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->mtime = st->st_mtim;
+    f->size = st->st_size;
+    f->refs = 1;
+    f->referenced = 1;
+
+    struct stat now;
+    ssize_t c = read_data(fd, f->data, st->st_size);
+    err = c < 0 ? errno : 0;
+    if (c >= 0 && (c != st->st_size || fstat(fd, &now) == -1 || !hot_file_valid(f, &now)))
+        err = EINVAL;   // file is changing under our hands, it's better sent the usual way
+    TEMP_FAILURE_RETRY(close(fd));
+
+    pthread_mutex_lock (&(hc->lock));
+    unsigned h = hot_hash(path);
+    struct hot_file* old = NULL;
+    if (!err)   for (old = hc->buckets[h]; old && strcmp(old->path, path) != 0; old = old->hash_next) { }
+
+    // another transfer may have been quicker, or what's cached is out of date
+    if (err || (old && hot_file_valid(old, st)))
+    {
+        hc->size -= f->size;
+        if (old)    __atomic_add_fetch (&(old->refs), 1, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock (&(hc->lock));
+        free (f);
+        if (err)    errno = err;
+        return old;
+    }
+    if (old)
+    {
+        retire_hot_file (hc, old);
+        ++hc->invalidations;
+    }
+
+    if (hc->hand)
+    {
+        // right behind the hand, so it's the last one to be looked at
+        f->clock_next = hc->hand;
+        f->clock_prev = hc->hand->clock_prev;
+        f->clock_prev->clock_next = f;
+        hc->hand->clock_prev = f;
+    }
+    else    hc->hand = f->clock_next = f->clock_prev = f;
+    f->hash_next = hc->buckets[h];
+    __atomic_store_n (&(hc->buckets[h]), f, __ATOMIC_RELEASE);
+    ++hc->count;
+    pthread_mutex_unlock (&(hc->lock));
+
+    return f;
+}
+
+
+/******************************************************************************
+ * Sending files
+ */
+
+/** Sends the file (from given offset on) from the cache, reading it in first if it
+    isn't there. Returns the number of bytes sent, or -1 with errno set to EINVAL if
+    the file isn't one to be cached (it has to be sent some other way then). */
+ssize_t send_hot_file(struct session* ses, const char* file, const struct stat* st, off_t offset)
+{
+    if (!ses || !file || !st)   { errno = EFAULT; return -1; }
+
+    struct hot_cache* hc = ses->server->hot_files;
+    if (!hc || !S_ISREG(st->st_mode) || (size_t)st->st_size > hc->max_file)  { errno = EINVAL; return -1; }
+
+    struct hot_file* f = find_hot_file(hc, file, st);
+    if (!f && !(f = add_hot_file(hc, file, st)))    return -1;
+
+    ssize_t c = 0;
+    if (offset < f->size)
+        c = throttled_write(ses, ses->data_socket, f->data + offset, f->size - offset);
+    int err = errno;
+    __atomic_sub_fetch (&(f->refs), 1, __ATOMIC_RELEASE);
+
+    errno = err;
+    return c;
+}
+
+
+/******************************************************************************
+ * Managing the cache
+ */
+
+int init_hot_cache(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    serv->hot_files = NULL;
+    if (serv->config.hot_cache_size == 0)   return 0;   // disabled
+
+    struct hot_cache* hc = (struct hot_cache*)calloc(1, sizeof(struct hot_cache));
+    if (!hc)    return -1;
+    pthread_mutex_init (&(hc->lock), NULL);
+    hc->max_size = serv->config.hot_cache_size;
+    hc->max_file = serv->config.hot_file_max;
+    if (hc->max_file > hc->max_size)    hc->max_file = hc->max_size;
+
+    serv->hot_files = hc;
+    return 0;
+}
+
+int free_hot_cache(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->hot_files)   return 0;
+
+    struct hot_cache* hc = serv->hot_files;
+    while (hc->hand)    retire_hot_file (hc, hc->hand);
+    struct hot_file* lists[3] = { hc->retired, hc->waiting, hc->draining };
+    int i;
+    for (i = 0; i < 3; ++i)
+        while (lists[i])
+        {
+            struct hot_file* f = lists[i];
+            lists[i] = f->retired_next;
+            free (f);
+        }
+    pthread_mutex_destroy (&(hc->lock));
+
+    free (hc);
+    serv->hot_files = NULL;
+    return 0;
+}
+
+int hot_cache_stats(const struct server* serv, struct hot_cache_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+    if (!serv->hot_files)   { errno = EBADFD; return -1; }
+
+    struct hot_cache* hc = serv->hot_files;
+    stats->hits = __atomic_load_n(&(hc->hits), __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&(hc->misses), __ATOMIC_RELAXED);
+    pthread_mutex_lock (&(hc->lock));
+    stats->evictions = hc->evictions;
+    stats->invalidations = hc->invalidations;
+    stats->count = hc->count;
+    stats->size = hc->size;
+    stats->retired_size = hc->retired_size;
+    pthread_mutex_unlock (&(hc->lock));
+    return 0;
+}
@@ -0,0 +1,536 @@
+/** @file listing.c
+    Generating directory listings (LIST, NLST, MLSD, MLST) */
+
+
+#include "reefs.h"
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+
+// record returned by getdents64() syscall
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define SIX_MONTHS (182 * 24 * 60 * 60)
+
+
+/******************************************************************************
+ * Output buffering
+ */
+
+/** Writes buffered part of listing to its descriptor. */
+static int flush_listing(struct listing_out* out)
+{
+    if (out->fd < 0)    return 0;   // listing is collected in memory
+    if (out->len > 0 && write_data(out->fd, out->buf, out->len) < (ssize_t)out->len)
+        return -1;
+
+    out->sent += out->len;
+    out->len = 0;
+    return 0;
+}
+
+static int append_listing(struct listing_out* out, const char* text, size_t len)
+{
+    while (len > 0)
+    {
+        if (out->len == out->cap)
+        {
+            if (out->fd < 0 && out->cap >= out->limit && out->overflow_fd >= 0)
+                out->fd = out->overflow_fd;     // send what's rendered so far and stream the rest
+            if (out->fd >= 0)
+            {
+                if (flush_listing(out) == -1)   return -1;
+            }
+            else
+            {
+                // in-memory listing grows up to its limit
+                size_t cap = out->cap ? 2 * out->cap : BUF_LEN;
+                if (out->cap >= out->limit) { errno = EFBIG; return -1; }
+                if (cap > out->limit)       cap = out->limit;
+
+                char* buf = (char*)realloc(out->buf, cap);
+                if (!buf)   return -1;
+                out->buf = buf;
+                out->cap = cap;
+            }
+        }
+
+        size_t n = out->cap - out->len;
+        if (n > len)    n = len;
+        memcpy (out->buf + out->len, text, n);
+        out->len += n;
+        text += n;  len -= n;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Formatting entries
+ */
+
+static char file_type_char(mode_t mode)
+{
+    if (S_ISDIR(mode))  return 'd';
+    if (S_ISLNK(mode))  return 'l';
+    if (S_ISCHR(mode))  return 'c';
+    if (S_ISBLK(mode))  return 'b';
+    if (S_ISFIFO(mode)) return 'p';
+    if (S_ISSOCK(mode)) return 's';
+    return '-';
+}
+
+/** Formats file mode the way `ls -l` does, e.g. drwxr-xr-x. */
+static void format_mode(mode_t mode, char* out)
+{
+    static const char rwx[] = "rwxrwxrwx";
+    int i;
+
+    out[0] = file_type_char(mode);
+    for (i = 0; i < 9; ++i)
+        out[i + 1] = (mode & (S_IRUSR >> i)) ? rwx[i] : '-';
+
+    if (mode & S_ISUID) out[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID) out[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX) out[9] = (mode & S_IXOTH) ? 't' : 'T';
+    out[10] = '\0';
+}
+
+/** Formats MLSD/MLST facts for given file (followed by a space, as the name goes next). */
+int format_facts(const struct stat* st, char* out, size_t len)
+{
+    if (!st || !out)    { errno = EFAULT; return -1; }
+
+    struct tm tm;
+    char modify[16];
+    gmtime_r (&(st->st_mtime), &tm);
+    strftime (modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+
+    const char* type = S_ISDIR(st->st_mode) ? "dir" : S_ISREG(st->st_mode) ? "file"
+                     : S_ISLNK(st->st_mode) ? "OS.unix=slink" : "OS.unix=other";
+    const char* perm = S_ISDIR(st->st_mode) ? "elcmpfd" : "radfw";
+
+    return snprintf(out, len, "type=%s;size=%lld;modify=%s;perm=%s;UNIX.mode=%04o; ",
+                    type, (long long)st->st_size, modify, perm, (unsigned)(st->st_mode & 07777));
+}
+
+/** Appends single listing entry in requested format. */
+static int list_entry(struct listing_out* out, int dirfd, const char* name,
+                      const struct stat* st, int format, time_t now)
+{
+    char line[BUF_LEN + MAX_PATH];
+    int n = 0;
+
+    switch (format)
+    {
+        case LIST_FORMAT_NAMES:
+            break;
+
+        case LIST_FORMAT_FACTS:
+            n = format_facts(st, line, BUF_LEN);
+            break;
+
+        case LIST_FORMAT_LS:
+        default:
+        {
+            char mode[11], date[16];
+            struct tm tm;
+            format_mode (st->st_mode, mode);
+            localtime_r (&(st->st_mtime), &tm);
+
+            // recent files have time shown, older ones (or from the future) the year
+            if (st->st_mtime > now - SIX_MONTHS && st->st_mtime <= now + 60 * 60)
+                strftime (date, sizeof(date), "%b %e %H:%M", &tm);
+            else
+                strftime (date, sizeof(date), "%b %e  %Y", &tm);
+
+            n = snprintf(line, BUF_LEN, "%s %lu %u %u %lld %s ", mode, (unsigned long)st->st_nlink,
+                         (unsigned)st->st_uid, (unsigned)st->st_gid, (long long)st->st_size, date);
+        }
+        break;
+    }
+
+    if (append_listing(out, line, n) == -1)             return -1;
+    if (append_listing(out, name, strlen(name)) == -1)  return -1;
+
+    if (format == LIST_FORMAT_LS && S_ISLNK(st->st_mode))
+    {
+        char target[MAX_PATH];
+        ssize_t c = readlinkat(dirfd, name, target, MAX_PATH - 1);
+        if (c > 0)
+        {
+            if (append_listing(out, " -> ", 4) == -1)   return -1;
+            if (append_listing(out, target, c) == -1)   return -1;
+        }
+    }
+
+    return append_listing(out, "\r\n", 2);
+}
+
+
+/******************************************************************************
+ * Listing directories
+ */
+
+/** Lists directory (or a single file) at given path in requested format.
+    Entries are read in batches with getdents64() and streamed out through the
+    output buffer, so directories of any size take constant memory. */
+int list_directory(struct listing_out* out, const char* path, int format)
+{
+    if (!out || !path)  { errno = EFAULT; return -1; }
+
+    time_t now = time(NULL);
+    struct stat st;
+    if (lstat(path, &st) == -1) return -1;
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (format == LIST_FORMAT_FACTS)    { errno = ENOTDIR; return -1; }
+
+        // listing of a file consists of the file itself
+        char dir[MAX_PATH];
+        strncpy (dir, path, MAX_PATH);
+        char* name = strrchr(dir, '/');
+        if (!name)  { errno = EINVAL; return -1; }
+        *name++ = '\0';
+
+        int dirfd = TEMP_FAILURE_RETRY(open(*dir ? dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dirfd == -1)    return -1;
+        int res = list_entry(out, dirfd, name, &st, format, now);
+        TEMP_FAILURE_RETRY(close(dirfd));
+
+        return res == -1 ? -1 : flush_listing(out);
+    }
+
+    int dirfd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dirfd == -1)    return -1;
+
+    char dents[LIST_DENTS_LEN];
+    long c;
+    int res = 0;
+    while (res == 0 && (c = syscall(SYS_getdents64, dirfd, dents, sizeof(dents))) > 0)
+    {
+        long pos;
+        for (pos = 0; pos < c; )
+        {
+            struct linux_dirent64* d = (struct linux_dirent64*)(dents + pos);
+            pos += d->d_reclen;
+
+            // skip . and .. (like `ls --almost-all`)
+            if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2])))
+                continue;
+
+            if (format == LIST_FORMAT_NAMES)
+                st.st_mode = 0;     // names need no stat() at all
+            else if (fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;           // entry has just vanished
+
+            if ((res = list_entry(out, dirfd, d->d_name, &st, format, now)) == -1)
+                break;
+        }
+    }
+    if (c < 0)  res = -1;
+
+    int err = errno;
+    TEMP_FAILURE_RETRY(close(dirfd));
+    errno = err;
+
+    if (res == -1)  return -1;
+    return flush_listing(out);
+}
+
+/******************************************************************************
+ * Listing cache
+ */
+
+#define LISTING_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY \
+                            | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static unsigned listing_hash(const char* path, int format)
+{
+    unsigned h = 2166136261u ^ (unsigned)format;    // FNV-1a
+    for (; *path; ++path)   h = (h ^ (unsigned char)*path) * 16777619u;
+    return h % LISTING_CACHE_BUCKETS;
+}
+
+static void release_entry(struct listing_cache_entry* e)
+{
+    if (--e->refs == 0) { free (e->data); free (e); }
+}
+
+/** Removes entry from the cache. Its data goes away once no session is sending it.
+    The directory watch is removed along with the last entry that uses it. */
+static void remove_entry(struct listing_cache* lc, struct listing_cache_entry* e)
+{
+    struct listing_cache_entry** p;
+    for (p = &(lc->buckets[listing_hash(e->path, e->format)]); *p != e; p = &((*p)->hash_next)) { }
+    *p = e->hash_next;
+
+    if (e->prev)    e->prev->next = e->next;    else lc->head = e->next;
+    if (e->next)    e->next->prev = e->prev;    else lc->tail = e->prev;
+    lc->size -= e->len;
+
+    struct listing_cache_entry* o;
+    for (o = lc->head; o && o->wd != e->wd; o = o->next) { }
+    if (!o) inotify_rm_watch (lc->inotify_fd, e->wd);
+
+    release_entry (e);
+}
+
+/** Applies pending inotify events, dropping listings of directories that have changed. */
+static void process_listing_events(struct listing_cache* lc)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t c;
+
+    while ((c = read(lc->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        char* p;
+        for (p = buf; p < buf + c; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+        {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            struct listing_cache_entry *e, *next;
+            ++lc->generation;
+
+            for (e = lc->head; e; e = next)
+            {
+                next = e->next;
+                if (e->wd == ev->wd || (ev->mask & IN_Q_OVERFLOW))
+                {
+                    remove_entry (lc, e);
+                    ++lc->invalidations;
+                }
+            }
+        }
+    }
+}
+
+/** Looks up the cached listing, making it the most recently used one.
+    Returned entry is referenced and should be released with listing_cache_release(). */
+static struct listing_cache_entry* listing_cache_get(struct listing_cache* lc, const char* path, int format)
+{
+    pthread_mutex_lock (&(lc->lock));
+    process_listing_events (lc);
+
+    struct listing_cache_entry* e;
+    for (e = lc->buckets[listing_hash(path, format)]; e; e = e->hash_next)
+        if (e->format == format && strcmp(e->path, path) == 0)  break;
+
+    if (e)
+    {
+        ++lc->hits;
+        ++e->refs;
+        if (e != lc->head)
+        {
+            // move to the front of LRU list
+            e->prev->next = e->next;
+            if (e->next)    e->next->prev = e->prev;    else lc->tail = e->prev;
+            e->prev = NULL;
+            e->next = lc->head;
+            lc->head->prev = e;
+            lc->head = e;
+        }
+    }
+    else    ++lc->misses;
+
+    pthread_mutex_unlock (&(lc->lock));
+    return e;
+}
+
+static void listing_cache_release(struct listing_cache* lc, struct listing_cache_entry* e)
+{
+    pthread_mutex_lock (&(lc->lock));
+    release_entry (e);
+    pthread_mutex_unlock (&(lc->lock));
+}
+
+/** Renders the listing and stores it in the cache. Directory is watched before it's read,
+    so the listing isn't cached if anything happened to it in the meantime. Listing that
+    outgrows what one entry may take goes on to out_fd (starting with what's rendered so far)
+    and only a marker is cached, so that the directory is listed directly next time.
+    Returns 0 and the referenced entry to send (NULL if the listing couldn't be rendered
+    in memory, and nothing has been sent), number of bytes streamed if it was too big,
+    or -1 if streaming failed. */
+static ssize_t listing_cache_fill(struct listing_cache* lc, const char* path, int format, int out_fd,
+                                  struct listing_cache_entry** entry)
+{
+    *entry = NULL;
+    pthread_mutex_lock (&(lc->lock));
+    int wd = inotify_add_watch(lc->inotify_fd, path, LISTING_WATCH_MASK);
+    unsigned long generation = lc->generation;
+    pthread_mutex_unlock (&(lc->lock));
+    if (wd == -1)   return 0;
+
+    struct listing_out out;
+    out.fd = -1;
+    out.buf = NULL;
+    out.len = out.cap = out.sent = 0;
+    out.limit = lc->max_size / LISTING_CACHE_MIN_ENTRIES;
+    out.overflow_fd = out_fd;
+
+    int res = list_directory(&out, path, format);
+    int err = errno;
+    struct listing_cache_entry* e = NULL;
+    if ((res != -1 || out.fd >= 0) && (e = (struct listing_cache_entry*)malloc(sizeof(struct listing_cache_entry))))
+    {
+        strncpy (e->path, path, MAX_PATH);
+        e->format = format;
+        e->too_big = out.fd >= 0;
+        e->data = e->too_big ? NULL : out.buf;
+        e->len = e->too_big ? sizeof(struct listing_cache_entry) : out.len;
+        e->wd = wd;
+        e->refs = 1;
+    }
+    if (!e || e->too_big)   free (out.buf);
+
+    pthread_mutex_lock (&(lc->lock));
+    process_listing_events (lc);
+
+    unsigned h = listing_hash(path, format);
+    struct listing_cache_entry* o;
+    for (o = lc->buckets[h]; o; o = o->hash_next)
+        if (o->format == format && strcmp(o->path, path) == 0)  break;
+
+    if (e && res != -1 && !o && lc->generation == generation)
+    {
+        // make room for the new listing
+        while (lc->tail && lc->size + e->len > lc->max_size)
+        {
+            remove_entry (lc, lc->tail);
+            ++lc->evictions;
+        }
+
+        e->hash_next = lc->buckets[h];
+        lc->buckets[h] = e;
+        e->prev = NULL;
+        e->next = lc->head;
+        if (lc->head)   lc->head->prev = e;     else lc->tail = e;
+        lc->head = e;
+        lc->size += e->len;
+        ++e->refs;
+    }
+    else
+    {
+        // directory has changed while it was being read, someone else has cached it already,
+        // or streaming it has failed: the listing (if any) is still good for this one request
+        for (o = lc->head; o && o->wd != wd; o = o->next) { }
+        if (!o) inotify_rm_watch (lc->inotify_fd, wd);
+    }
+    pthread_mutex_unlock (&(lc->lock));
+
+    if (out.fd < 0)
+    {
+        *entry = e;
+        return 0;
+    }
+    if (e)  listing_cache_release (lc, e);
+    errno = err;
+    return res == -1 ? -1 : (ssize_t)out.sent;
+}
+
+int init_listing_cache(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    serv->list_cache = NULL;
+    if (serv->config.list_cache_size == 0)  return 0;   // disabled
+
+    struct listing_cache* lc = (struct listing_cache*)calloc(1, sizeof(struct listing_cache));
+    if (!lc)    return -1;
+    if ((lc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        { free(lc); return -1; }
+    pthread_mutex_init (&(lc->lock), NULL);
+    lc->max_size = serv->config.list_cache_size;
+
+    serv->list_cache = lc;
+    return 0;
+}
+
+int free_listing_cache(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->list_cache)  return 0;
+
+    struct listing_cache* lc = serv->list_cache;
+    while (lc->head)    remove_entry (lc, lc->head);
+    TEMP_FAILURE_RETRY(close(lc->inotify_fd));
+    pthread_mutex_destroy (&(lc->lock));
+
+    free (lc);
+    serv->list_cache = NULL;
+    return 0;
+}
+
+/** Reads listing cache counters. */
+int listing_cache_stats(const struct server* serv, struct listing_cache_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+
+    memset (stats, 0, sizeof(struct listing_cache_stats));
+    struct listing_cache* lc = serv->list_cache;
+    if (!lc)    return 0;
+
+    pthread_mutex_lock (&(lc->lock));
+    stats->hits = lc->hits;
+    stats->misses = lc->misses;
+    stats->evictions = lc->evictions;
+    stats->invalidations = lc->invalidations;
+    stats->size = lc->size;
+    pthread_mutex_unlock (&(lc->lock));
+    return 0;
+}
+
+/*****************************************************************************/
+
+/** Sends listing of given path through session's data connection.
+    Directory listings are served from the cache if possible. */
+int send_listing(struct session* ses, const char* path, int format)
+{
+    if (!ses || !path)          { errno = EFAULT; return -1; }
+    if (ses->data_socket == -1) { errno = EBADF;  return -1; }
+
+    struct listing_cache* lc = ses->server->list_cache;
+    struct listing_cache_entry* e = NULL;
+    ssize_t c = 0;
+    if (lc && !(e = listing_cache_get(lc, path, format)))
+        c = listing_cache_fill(lc, path, format, ses->data_socket, &e);
+    if (e && e->too_big)
+    {
+        // too big to be cached: listed directly
+        listing_cache_release (lc, e);
+        e = NULL;
+    }
+    if (e)
+    {
+        ssize_t len = e->len;
+        c = write_data(ses->data_socket, e->data, len);
+        listing_cache_release (lc, e);
+        if (c < len)    c = -1;
+        else            c = len;
+    }
+    else if (c == 0)
+    {
+        struct listing_out out;
+        out.fd = ses->data_socket;
+        out.len = out.sent = 0;
+        out.cap = out.limit = ses->server->config.transfer_chunk;
+        out.overflow_fd = -1;
+        if (!(out.buf = session_buffer(ses)))   return -1;
+        c = list_directory(&out, path, format) == -1 ? -1 : (ssize_t)out.sent;
+    }
+
+    if (c == -1)
+    {
+        if (errno == EPIPE || errno == ECONNRESET)  ses->terminated = 1;
+        return -1;
+    }
+    metrics_bytes (0, c);
+    return 0;
+}
@@ -0,0 +1,322 @@
+/** @file logger.c
+    Asynchronous log writer: session threads append records to a lock-free ring buffer,
+    a dedicated thread drains it in batches with writev() */
+
+
+#include "reefs.h"
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+
+/******************************************************************************
+ * Ring buffer
+ */
+
+/** Wakes up the writer thread if it's waiting for records. */
+static void wake_writer(struct logger* lg)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);   // publishing the record vs. checking the flag
+    if (__atomic_load_n(&(lg->writer_sleeping), __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        TEMP_FAILURE_RETRY(write(lg->wake_fd, &one, sizeof(one)));
+    }
+}
+
+/** Puts producer to sleep until the writer frees the slot at pos (or stops). */
+static void wait_for_space(struct logger* lg, unsigned long pos)
+{
+    struct log_record* rec = &(lg->records[pos & lg->mask]);
+    pthread_mutex_lock (&(lg->space_lock));
+    __atomic_add_fetch (&(lg->producers_waiting), 1, __ATOMIC_SEQ_CST);
+    // writer checks for waiting producers after freeing slots, so this is checked after announcing
+    while ((long)(__atomic_load_n(&(rec->seq), __ATOMIC_SEQ_CST) - pos) < 0
+           && !__atomic_load_n(&(lg->stopping), __ATOMIC_SEQ_CST)
+           && __atomic_load_n(&(lg->enqueue_pos), __ATOMIC_RELAXED) == pos)
+        pthread_cond_wait (&(lg->space_freed), &(lg->space_lock));
+    __atomic_sub_fetch (&(lg->producers_waiting), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&(lg->space_lock));
+}
+
+/** Wakes up producers waiting for space, if there are any. */
+static void wake_producers(struct logger* lg)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);   // freeing the slots vs. checking for waiters
+    if (__atomic_load_n(&(lg->producers_waiting), __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock (&(lg->space_lock));
+        pthread_cond_broadcast (&(lg->space_freed));
+        pthread_mutex_unlock (&(lg->space_lock));
+    }
+}
+
+/** Appends a record to the log. Safe to call from any number of threads at once.
+    When buffer is full, the record is either dropped or caller sleeps until the writer
+    frees some space, depending on the overflow policy. Once the writer is stopped, records are refused. */
+int log_append(struct logger* lg, const char* text, size_t len)
+{
+    if (!lg || !text)   { errno = EFAULT; return -1; }
+    if (__atomic_load_n(&(lg->stopping), __ATOMIC_ACQUIRE)) { errno = EBADFD; return -1; }
+
+    if (len > LOG_RECORD_LEN - 1)   len = LOG_RECORD_LEN - 1;   // room for the line feed
+
+    // claim a slot (bounded MPMC queue by D. Vyukov)
+    struct log_record* rec;
+    unsigned long pos = __atomic_load_n(&(lg->enqueue_pos), __ATOMIC_RELAXED);
+    int waited = 0;
+    for (;;)
+    {
+        rec = &(lg->records[pos & lg->mask]);
+        unsigned long seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+        long dif = (long)(seq - pos);
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&(lg->enqueue_pos), &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            // buffer is full
+            if (lg->overflow == LOG_OVERFLOW_DROP)
+            {
+                __atomic_add_fetch (&(lg->dropped), 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+            if (!waited)
+                { __atomic_add_fetch (&(lg->blocked), 1, __ATOMIC_RELAXED); waited = 1; }
+            if (__atomic_load_n(&(lg->stopping), __ATOMIC_ACQUIRE)) { errno = EBADFD; return -1; }
+            wake_writer (lg);
+            wait_for_space (lg, pos);
+            pos = __atomic_load_n(&(lg->enqueue_pos), __ATOMIC_RELAXED);
+        }
+        else
+            pos = __atomic_load_n(&(lg->enqueue_pos), __ATOMIC_RELAXED);
+    }
+
+    rec->time = time(NULL);
+    memcpy (rec->text, text, len);
+    rec->text[len] = '\n';
+    rec->len = len + 1;
+    __atomic_store_n (&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+
+    wake_writer (lg);
+    return 0;
+}
+
+/** Checks whether the next record is ready to be written. */
+static int record_ready(struct logger* lg, unsigned long pos)
+{
+    return __atomic_load_n(&(lg->records[pos & lg->mask].seq), __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+
+/******************************************************************************
+ * Writer thread
+ */
+
+/** Writes the batch to log file and its copy to STDOUT. */
+static int write_batch(struct logger* lg, struct iovec* iov, int iov_count)
+{
+    int res = 0, i;
+    size_t total = 0;
+    for (i = 0; i < iov_count; ++i)    total += iov[i].iov_len;
+
+    if (TEMP_FAILURE_RETRY(writev(lg->fd, iov, iov_count)) < (ssize_t)total)
+        { __atomic_add_fetch (&(lg->errors), 1, __ATOMIC_RELAXED); res = -1; }
+    TEMP_FAILURE_RETRY(writev(STDOUT_FILENO, iov, iov_count));
+
+    return res;
+}
+
+static void sync_log(struct logger* lg)
+{
+    fdatasync (lg->fd);
+    lg->unsynced = 0;
+    __atomic_add_fetch (&(lg->syncs), 1, __ATOMIC_RELAXED);
+}
+
+/** Worker function for the log writer thread. */
+void* logger_proc(void* arg)
+{
+    struct logger* lg = (struct logger*)arg;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct iovec iov[2 * LOG_BATCH];
+    char stamps[LOG_BATCH][LOG_STAMP_LEN];
+    time_t stamp_time = (time_t)-1;
+    int stamp = -1;
+
+    struct timespec last_sync;
+    clock_gettime (CLOCK_MONOTONIC, &last_sync);
+
+    for (;;)
+    {
+        // collect a batch of ready records, pointing iovecs straight into the ring
+        int n = 0;
+        unsigned long pos = lg->dequeue_pos;
+        while (n < LOG_BATCH && record_ready(lg, pos + n))
+        {
+            struct log_record* rec = &(lg->records[(pos + n) & lg->mask]);
+            if (rec->time != stamp_time || stamp == -1)
+            {
+                // timestamp is formatted once per second
+                struct tm tm;
+                stamp = (stamp + 1) % LOG_BATCH;
+                stamp_time = rec->time;
+                localtime_r (&stamp_time, &tm);
+                asctime_r (&tm, stamps[stamp]);
+                *strchr(stamps[stamp], '\n') = ' ';
+            }
+
+            iov[2*n].iov_base = stamps[stamp];
+            iov[2*n].iov_len = strlen(stamps[stamp]);
+            iov[2*n + 1].iov_base = rec->text;
+            iov[2*n + 1].iov_len = rec->len;
+            ++n;
+        }
+
+        if (n > 0)
+        {
+            write_batch (lg, iov, 2 * n);
+
+            // keep only the latest timestamp for the next batch
+            if (stamp > 0)  { memcpy (stamps[0], stamps[stamp], LOG_STAMP_LEN); stamp = 0; }
+
+            // give the slots back to producers
+            int i;
+            for (i = 0; i < n; ++i)
+                __atomic_store_n (&(lg->records[(pos + i) & lg->mask].seq), pos + i + lg->mask + 1, __ATOMIC_RELEASE);
+            lg->dequeue_pos = pos + n;
+            wake_producers (lg);
+            __atomic_add_fetch (&(lg->written), n, __ATOMIC_RELAXED);
+            __atomic_add_fetch (&(lg->batches), 1, __ATOMIC_RELAXED);
+
+            lg->unsynced = 1;
+            if (lg->sync == LOG_SYNC_ALWAYS)    sync_log (lg);
+            continue;
+        }
+
+        if (__atomic_load_n(&(lg->stopping), __ATOMIC_ACQUIRE))    break;
+
+        // periodic sync is due?
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+        if (lg->sync == LOG_SYNC_PERIODIC && elapsed_ms >= LOG_SYNC_INTERVAL_MS)
+        {
+            if (lg->unsynced)   sync_log (lg);
+            last_sync = now;
+        }
+
+        // nothing to do: sleep until producers wake us up
+        __atomic_store_n (&(lg->writer_sleeping), 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (!record_ready(lg, lg->dequeue_pos) && !__atomic_load_n(&(lg->stopping), __ATOMIC_SEQ_CST))
+        {
+            struct pollfd pfd;
+            pfd.fd = lg->wake_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, LOG_SYNC_INTERVAL_MS) > 0)
+            {
+                uint64_t val;
+                TEMP_FAILURE_RETRY(read(lg->wake_fd, &val, sizeof(val)));
+            }
+        }
+        __atomic_store_n (&(lg->writer_sleeping), 0, __ATOMIC_SEQ_CST);
+    }
+
+    if (lg->unsynced && lg->sync != LOG_SYNC_NONE)  sync_log (lg);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the logger
+ */
+
+struct logger* start_logger(int fd, const struct config* cfg)
+{
+    if (!cfg)   { errno = EFAULT; return NULL; }
+
+    struct logger* lg = (struct logger*)calloc(1, sizeof(struct logger));
+    if (!lg)    return NULL;
+
+    // ring size must be a power of two
+    size_t size = 2;
+    while (size < cfg->log_buffer)  size *= 2;
+    if (!(lg->records = (struct log_record*)calloc(size, sizeof(struct log_record))))
+        { free(lg); return NULL; }
+
+    size_t i;
+    for (i = 0; i < size; ++i)  lg->records[i].seq = i;
+    lg->mask = size - 1;
+    lg->fd = fd;
+    lg->sync = cfg->log_sync;
+    lg->overflow = cfg->log_overflow;
+    pthread_mutex_init (&(lg->space_lock), NULL);
+    pthread_cond_init (&(lg->space_freed), NULL);
+
+    if ((lg->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+        || pthread_create(&(lg->thread), NULL, logger_proc, lg) != 0)
+    {
+        if (lg->wake_fd != -1)  TEMP_FAILURE_RETRY(close(lg->wake_fd));
+        pthread_cond_destroy (&(lg->space_freed));
+        pthread_mutex_destroy (&(lg->space_lock));
+        free (lg->records); free (lg);
+        return NULL;
+    }
+
+    return lg;
+}
+
+/** Writes out all pending records and stops the writer thread. The logger itself stays,
+    so that threads still around may keep calling log_append() (which refuses records). */
+int stop_logger(struct logger* lg)
+{
+    if (!lg)    { errno = EFAULT; return -1; }
+    if (__atomic_exchange_n(&(lg->stopping), 1, __ATOMIC_SEQ_CST))    return 0;
+
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(lg->wake_fd, &one, sizeof(one)));
+    pthread_join (lg->thread, NULL);
+
+    // producers still waiting for space give up
+    pthread_mutex_lock (&(lg->space_lock));
+    pthread_cond_broadcast (&(lg->space_freed));
+    pthread_mutex_unlock (&(lg->space_lock));
+    return 0;
+}
+
+/** Stops the writer and frees the logger. Nobody may be logging any more. */
+int free_logger(struct logger* lg)
+{
+    if (!lg)    { errno = EFAULT; return -1; }
+
+    stop_logger (lg);
+    TEMP_FAILURE_RETRY(close(lg->wake_fd));
+    pthread_cond_destroy (&(lg->space_freed));
+    pthread_mutex_destroy (&(lg->space_lock));
+    free (lg->records);
+    free (lg);
+    return 0;
+}
+
+int logger_stats(const struct logger* lg, struct logger_stats* stats)
+{
+    if (!lg || !stats)  { errno = EFAULT; return -1; }
+
+    stats->written = __atomic_load_n(&(lg->written), __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&(lg->dropped), __ATOMIC_RELAXED);
+    stats->blocked = __atomic_load_n(&(lg->blocked), __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&(lg->batches), __ATOMIC_RELAXED);
+    stats->syncs = __atomic_load_n(&(lg->syncs), __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&(lg->errors), __ATOMIC_RELAXED);
+    return 0;
+}
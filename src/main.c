@@ -7,6 +7,7 @@
 #include "reefs.h"
 
 volatile sig_atomic_t terminating = 0;
+volatile sig_atomic_t reloading = 0;
 
 
 void usage()
@@ -16,6 +17,7 @@ void usage()
 
 
 void sig_INT(int sig)   { terminating = 1; }
+void sig_HUP(int sig)   { reloading = 1; }
 
 int main(int argc, char* argv[])
 {
@@ -29,8 +31,15 @@ int main(int argc, char* argv[])
     }
 
     struct sigaction sa;
+    memset (&sa, 0, sizeof(sa));
     sa.sa_handler = SIG_IGN;    if (sigaction(SIGPIPE, &sa, NULL) == -1)    FATAL("Ignoring SIGPIPE");
     sa.sa_handler = sig_INT;    if (sigaction(SIGINT, &sa, NULL) == -1)     FATAL("Handling SIGINT");
+    sa.sa_handler = sig_HUP;    if (sigaction(SIGHUP, &sa, NULL) == -1)     FATAL("Handling SIGHUP");
+
+    // threads inherit this, so only start_server() gets to see SIGHUP
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGHUP);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
 
     struct server serv;
     if (init_server(config_file, &serv) == -1)
@@ -0,0 +1,499 @@
+/** @file metrics.c
+    Server metrics, exposed over HTTP in Prometheus text format */
+
+
+#include "reefs.h"
+#include <sys/un.h>
+#include <poll.h>
+
+
+// upper bounds of latency histogram buckets (in microseconds)
+static const unsigned long LATENCY_BUCKETS[METRICS_BUCKETS] = { 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+// per-thread counters; each shard is written by its own thread only
+struct metrics_shard
+{
+    unsigned long cmd_calls[MAX_FTP_COMMANDS];
+    unsigned long cmd_latency[MAX_FTP_COMMANDS][METRICS_BUCKETS + 1];  // last bucket is +Inf
+    unsigned long cmd_latency_us[MAX_FTP_COMMANDS];
+    unsigned long bytes_in, bytes_out;
+
+    struct metrics_shard* next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;               // guards the list of shards
+    pthread_key_t key;
+    struct metrics_shard* shards;
+    struct metrics_shard retired;       // counters of threads that have exited
+
+    long sessions;                      // gauges and counters that aren't per-thread
+    long passive_listeners;
+    unsigned long passive_opened;
+
+    const struct server* server;
+    int listen_fd;
+    pthread_t thread;
+} metrics = { PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct metrics_shard* local_shard = NULL;
+
+// single-writer increment that scrapes can read concurrently
+#define SHARD_ADD(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define SHARD_GET(field)    __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+
+/******************************************************************************
+ * Collecting
+ */
+
+/** Folds counters of exiting thread into the retired shard. */
+static void retire_shard(void* arg)
+{
+    struct metrics_shard* sh = (struct metrics_shard*)arg;
+    struct metrics_shard** p;
+    int i, j;
+
+    pthread_mutex_lock (&metrics.lock);
+    for (p = &metrics.shards; *p && *p != sh; p = &((*p)->next)) { }
+    if (*p) *p = sh->next;
+
+    for (i = 0; i < MAX_FTP_COMMANDS; ++i)
+    {
+        metrics.retired.cmd_calls[i] += sh->cmd_calls[i];
+        metrics.retired.cmd_latency_us[i] += sh->cmd_latency_us[i];
+        for (j = 0; j <= METRICS_BUCKETS; ++j)
+            metrics.retired.cmd_latency[i][j] += sh->cmd_latency[i][j];
+    }
+    metrics.retired.bytes_in += sh->bytes_in;
+    metrics.retired.bytes_out += sh->bytes_out;
+    pthread_mutex_unlock (&metrics.lock);
+
+    free (sh);
+}
+
+/** Returns calling thread's shard, registering it on first use. */
+static struct metrics_shard* get_shard()
+{
+    if (local_shard)    return local_shard;
+
+    struct metrics_shard* sh = (struct metrics_shard*)calloc(1, sizeof(struct metrics_shard));
+    if (!sh)    return NULL;
+
+    pthread_mutex_lock (&metrics.lock);
+    sh->next = metrics.shards;
+    metrics.shards = sh;
+    pthread_mutex_unlock (&metrics.lock);
+
+    pthread_setspecific (metrics.key, sh);  // for retire_shard() at thread exit
+    return local_shard = sh;
+}
+
+void metrics_command(int cmd, const struct timespec* start, const struct timespec* end)
+{
+    struct metrics_shard* sh = get_shard();
+    if (!sh || cmd < 0 || cmd >= MAX_FTP_COMMANDS)  return;
+
+    unsigned long us = (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+    int b;
+    for (b = 0; b < METRICS_BUCKETS && us > LATENCY_BUCKETS[b]; ++b) { }
+
+    SHARD_ADD (sh->cmd_calls[cmd], 1);
+    SHARD_ADD (sh->cmd_latency[cmd][b], 1);
+    SHARD_ADD (sh->cmd_latency_us[cmd], us);
+}
+
+void metrics_bytes(size_t in, size_t out)
+{
+    struct metrics_shard* sh = get_shard();
+    if (!sh)    return;
+
+    if (in)     SHARD_ADD (sh->bytes_in, in);
+    if (out)    SHARD_ADD (sh->bytes_out, out);
+}
+
+void metrics_sessions(int delta)
+{
+    __atomic_add_fetch (&metrics.sessions, delta, __ATOMIC_RELAXED);
+}
+
+void metrics_passive(int delta)
+{
+    __atomic_add_fetch (&metrics.passive_listeners, delta, __ATOMIC_RELAXED);
+    if (delta > 0)  __atomic_add_fetch (&metrics.passive_opened, delta, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * Exposition
+ */
+
+struct text_buf
+{
+    char* data;
+    size_t len, cap;
+};
+
+static void append_text(struct text_buf* t, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void append_text(struct text_buf* t, const char* fmt, ...)
+{
+    va_list args;
+    for (;;)
+    {
+        va_start (args, fmt);
+        int c = vsnprintf(t->data ? t->data + t->len : NULL, t->cap - t->len, fmt, args);
+        va_end (args);
+        if (c < 0)  return;
+        if (t->len + c < t->cap)    { t->len += c; return; }
+
+        size_t cap = t->cap ? 2 * t->cap : 4096;
+        while (cap <= t->len + c)   cap *= 2;
+        char* data = (char*)realloc(t->data, cap);
+        if (!data)  return;
+        t->data = data;
+        t->cap = cap;
+    }
+}
+
+/** Merges all shards and renders metrics in Prometheus text format. */
+static void render_metrics(struct text_buf* t)
+{
+    static struct metrics_shard sum;    // only the metrics thread renders
+    struct metrics_shard* sh;
+    int i, j;
+
+    pthread_mutex_lock (&metrics.lock);
+    memcpy (&sum, &metrics.retired, sizeof(struct metrics_shard));
+    for (sh = metrics.shards; sh; sh = sh->next)
+    {
+        for (i = 0; i < MAX_FTP_COMMANDS; ++i)
+        {
+            sum.cmd_calls[i] += SHARD_GET(sh->cmd_calls[i]);
+            sum.cmd_latency_us[i] += SHARD_GET(sh->cmd_latency_us[i]);
+            for (j = 0; j <= METRICS_BUCKETS; ++j)
+                sum.cmd_latency[i][j] += SHARD_GET(sh->cmd_latency[i][j]);
+        }
+        sum.bytes_in += SHARD_GET(sh->bytes_in);
+        sum.bytes_out += SHARD_GET(sh->bytes_out);
+    }
+    pthread_mutex_unlock (&metrics.lock);
+
+    append_text (t, "# HELP reefs_commands_total FTP commands processed.\n"
+                    "# TYPE reefs_commands_total counter\n");
+    for (i = 0; i < ftp_commands_count() && i < MAX_FTP_COMMANDS; ++i)
+        if (sum.cmd_calls[i])
+            append_text (t, "reefs_commands_total{command=\"%s\"} %lu\n", ftp_command_name(i), sum.cmd_calls[i]);
+
+    append_text (t, "# HELP reefs_command_duration_seconds Time taken to process FTP commands.\n"
+                    "# TYPE reefs_command_duration_seconds histogram\n");
+    for (i = 0; i < ftp_commands_count() && i < MAX_FTP_COMMANDS; ++i)
+    {
+        if (!sum.cmd_calls[i])  continue;
+
+        const char* name = ftp_command_name(i);
+        unsigned long count = 0;
+        for (j = 0; j < METRICS_BUCKETS; ++j)
+        {
+            count += sum.cmd_latency[i][j];
+            append_text (t, "reefs_command_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %lu\n",
+                         name, LATENCY_BUCKETS[j] / 1e6, count);
+        }
+        count += sum.cmd_latency[i][METRICS_BUCKETS];
+        append_text (t, "reefs_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n", name, count);
+        append_text (t, "reefs_command_duration_seconds_sum{command=\"%s\"} %.6f\n", name, sum.cmd_latency_us[i] / 1e6);
+        append_text (t, "reefs_command_duration_seconds_count{command=\"%s\"} %lu\n", name, count);
+    }
+
+    append_text (t, "# HELP reefs_transfer_bytes_total Bytes moved over data connections.\n"
+                    "# TYPE reefs_transfer_bytes_total counter\n"
+                    "reefs_transfer_bytes_total{direction=\"in\"} %lu\n"
+                    "reefs_transfer_bytes_total{direction=\"out\"} %lu\n",
+                 sum.bytes_in, sum.bytes_out);
+
+    append_text (t, "# HELP reefs_sessions Currently connected clients.\n"
+                    "# TYPE reefs_sessions gauge\n"
+                    "reefs_sessions %ld\n",
+                 __atomic_load_n(&metrics.sessions, __ATOMIC_RELAXED));
+
+    append_text (t, "# HELP reefs_passive_listeners Passive mode ports currently listening.\n"
+                    "# TYPE reefs_passive_listeners gauge\n"
+                    "reefs_passive_listeners %ld\n"
+                    "# HELP reefs_passive_opened_total Passive mode ports opened.\n"
+                    "# TYPE reefs_passive_opened_total counter\n"
+                    "reefs_passive_opened_total %lu\n",
+                 __atomic_load_n(&metrics.passive_listeners, __ATOMIC_RELAXED),
+                 __atomic_load_n(&metrics.passive_opened, __ATOMIC_RELAXED));
+
+    if (metrics.server->acceptors)
+    {
+        append_text (t, "# HELP reefs_accepted_total Clients accepted, by acceptor thread.\n"
+                        "# TYPE reefs_accepted_total counter\n");
+        for (i = 0; i < metrics.server->acceptors_count; ++i)
+            append_text (t, "reefs_accepted_total{acceptor=\"%d\"} %lu\n",
+                         i, __atomic_load_n(&(metrics.server->acceptors[i].accepted), __ATOMIC_RELAXED));
+        append_text (t, "# HELP reefs_accept_pauses_total Waits for descriptors or memory to accept clients, by acceptor thread.\n"
+                        "# TYPE reefs_accept_pauses_total counter\n");
+        for (i = 0; i < metrics.server->acceptors_count; ++i)
+            append_text (t, "reefs_accept_pauses_total{acceptor=\"%d\"} %lu\n",
+                         i, __atomic_load_n(&(metrics.server->acceptors[i].pauses), __ATOMIC_RELAXED));
+    }
+
+    struct client_table_stats cts;
+    if (metrics.server->clients && client_table_stats(metrics.server, &cts) != -1)
+        append_text (t, "# HELP reefs_tracked_clients Client addresses tracked for per-address limits.\n"
+                        "# TYPE reefs_tracked_clients gauge\n"
+                        "reefs_tracked_clients %ld\n"
+                        "# HELP reefs_refused_connections_total Connections closed right away, by limit of the address they exceeded.\n"
+                        "# TYPE reefs_refused_connections_total counter\n"
+                        "reefs_refused_connections_total{limit=\"sessions\"} %lu\n"
+                        "reefs_refused_connections_total{limit=\"rate\"} %lu\n",
+                     cts.tracked, cts.rejected_sessions, cts.rejected_rate);
+
+    struct port_stats pps;
+    if (metrics.server->pasv_ports && port_allocator_stats(metrics.server->pasv_ports, &pps) != -1)
+        append_text (t, "# HELP reefs_pasv_ports Passive mode ports in configured range.\n"
+                        "# TYPE reefs_pasv_ports gauge\n"
+                        "reefs_pasv_ports %d\n"
+                        "# HELP reefs_pasv_ports_used Passive mode ports taken by data connections.\n"
+                        "# TYPE reefs_pasv_ports_used gauge\n"
+                        "reefs_pasv_ports_used %ld\n"
+                        "# HELP reefs_pasv_ports_busy Passive mode ports found in use outside the server, skipped for now.\n"
+                        "# TYPE reefs_pasv_ports_busy gauge\n"
+                        "reefs_pasv_ports_busy %ld\n"
+                        "# HELP reefs_pasv_ports_exhausted_total PASV commands refused because no port was free.\n"
+                        "# TYPE reefs_pasv_ports_exhausted_total counter\n"
+                        "reefs_pasv_ports_exhausted_total %lu\n",
+                     pps.total, pps.used, pps.busy, pps.exhausted);
+    if (metrics.server->active_ports && port_allocator_stats(metrics.server->active_ports, &pps) != -1)
+        append_text (t, "# HELP reefs_active_ports Active mode source ports in configured range.\n"
+                        "# TYPE reefs_active_ports gauge\n"
+                        "reefs_active_ports %d\n"
+                        "# HELP reefs_active_ports_used Active mode source ports taken by data connections.\n"
+                        "# TYPE reefs_active_ports_used gauge\n"
+                        "reefs_active_ports_used %ld\n"
+                        "# HELP reefs_active_ports_busy Active mode source ports found in use outside the server, skipped for now.\n"
+                        "# TYPE reefs_active_ports_busy gauge\n"
+                        "reefs_active_ports_busy %ld\n"
+                        "# HELP reefs_active_ports_exhausted_total Active mode connections refused because no port was free.\n"
+                        "# TYPE reefs_active_ports_exhausted_total counter\n"
+                        "reefs_active_ports_exhausted_total %lu\n",
+                     pps.total, pps.used, pps.busy, pps.exhausted);
+
+    struct throttle_stats ts;
+    if (metrics.server->throttle && throttle_stats(metrics.server, &ts) != -1)
+        append_text (t, "# HELP reefs_throttled_transfers Transfers waiting for bandwidth right now, by limit that holds them.\n"
+                        "# TYPE reefs_throttled_transfers gauge\n"
+                        "reefs_throttled_transfers{limit=\"session\"} %ld\n"
+                        "reefs_throttled_transfers{limit=\"user\"} %ld\n"
+                        "reefs_throttled_transfers{limit=\"global\"} %ld\n"
+                        "# HELP reefs_throttle_waits_total Times transfers waited for bandwidth, by limit that held them.\n"
+                        "# TYPE reefs_throttle_waits_total counter\n"
+                        "reefs_throttle_waits_total{limit=\"session\"} %lu\n"
+                        "reefs_throttle_waits_total{limit=\"user\"} %lu\n"
+                        "reefs_throttle_waits_total{limit=\"global\"} %lu\n"
+                        "# HELP reefs_throttle_wait_seconds_total Time transfers waited for bandwidth, by limit that held them.\n"
+                        "# TYPE reefs_throttle_wait_seconds_total counter\n"
+                        "reefs_throttle_wait_seconds_total{limit=\"session\"} %.3f\n"
+                        "reefs_throttle_wait_seconds_total{limit=\"user\"} %.3f\n"
+                        "reefs_throttle_wait_seconds_total{limit=\"global\"} %.3f\n",
+                     ts.waiting[THROTTLE_SESSION], ts.waiting[THROTTLE_USER], ts.waiting[THROTTLE_GLOBAL],
+                     ts.waits[THROTTLE_SESSION], ts.waits[THROTTLE_USER], ts.waits[THROTTLE_GLOBAL],
+                     ts.waited[THROTTLE_SESSION], ts.waited[THROTTLE_USER], ts.waited[THROTTLE_GLOBAL]);
+
+    struct session_pool_stats sps;
+    if (metrics.server->sessions && session_pool_stats(metrics.server, &sps) != -1)
+        append_text (t, "# HELP reefs_session_slots Session slots allocated by the pool.\n"
+                        "# TYPE reefs_session_slots gauge\n"
+                        "reefs_session_slots %d\n"
+                        "# HELP reefs_sessions_peak Most clients connected at once.\n"
+                        "# TYPE reefs_sessions_peak gauge\n"
+                        "reefs_sessions_peak %d\n"
+                        "# HELP reefs_session_memory_bytes Memory taken by sessions in use, incl. their buffers.\n"
+                        "# TYPE reefs_session_memory_bytes gauge\n"
+                        "reefs_session_memory_bytes %lu\n"
+                        "# HELP reefs_session_memory_peak_bytes Most memory taken by sessions at once.\n"
+                        "# TYPE reefs_session_memory_peak_bytes gauge\n"
+                        "reefs_session_memory_peak_bytes %lu\n"
+                        "# HELP reefs_sessions_rejected_total Clients turned away because of max-clients.\n"
+                        "# TYPE reefs_sessions_rejected_total counter\n"
+                        "reefs_sessions_rejected_total %lu\n",
+                     sps.capacity, sps.peak, (unsigned long)sps.memory, (unsigned long)sps.peak_memory, sps.rejected);
+
+    struct listing_cache_stats lcs;
+    if (metrics.server->list_cache && listing_cache_stats(metrics.server, &lcs) != -1)
+        append_text (t, "# HELP reefs_listing_cache_requests_total Directory listing cache lookups.\n"
+                        "# TYPE reefs_listing_cache_requests_total counter\n"
+                        "reefs_listing_cache_requests_total{result=\"hit\"} %lu\n"
+                        "reefs_listing_cache_requests_total{result=\"miss\"} %lu\n"
+                        "# HELP reefs_listing_cache_evictions_total Listings evicted to make room.\n"
+                        "# TYPE reefs_listing_cache_evictions_total counter\n"
+                        "reefs_listing_cache_evictions_total %lu\n"
+                        "# HELP reefs_listing_cache_invalidations_total Listings dropped because directory changed.\n"
+                        "# TYPE reefs_listing_cache_invalidations_total counter\n"
+                        "reefs_listing_cache_invalidations_total %lu\n"
+                        "# HELP reefs_listing_cache_bytes Memory taken by cached listings.\n"
+                        "# TYPE reefs_listing_cache_bytes gauge\n"
+                        "reefs_listing_cache_bytes %lu\n",
+                     lcs.hits, lcs.misses, lcs.evictions, lcs.invalidations, (unsigned long)lcs.size);
+
+    struct digest_cache_stats dgs;
+    if (metrics.server->digests && digest_cache_stats(metrics.server, &dgs) != -1)
+        append_text (t, "# HELP reefs_digest_cache_requests_total Checksum cache lookups.\n"
+                        "# TYPE reefs_digest_cache_requests_total counter\n"
+                        "reefs_digest_cache_requests_total{result=\"hit\"} %lu\n"
+                        "reefs_digest_cache_requests_total{result=\"miss\"} %lu\n"
+                        "# HELP reefs_digest_cache_stores_total Checksums cached, incl. those computed during uploads.\n"
+                        "# TYPE reefs_digest_cache_stores_total counter\n"
+                        "reefs_digest_cache_stores_total %lu\n"
+                        "# HELP reefs_digest_cache_evictions_total Checksums evicted to make room.\n"
+                        "# TYPE reefs_digest_cache_evictions_total counter\n"
+                        "reefs_digest_cache_evictions_total %lu\n"
+                        "# HELP reefs_digest_cache_entries Checksums cached.\n"
+                        "# TYPE reefs_digest_cache_entries gauge\n"
+                        "reefs_digest_cache_entries %d\n",
+                     dgs.hits, dgs.misses, dgs.stores, dgs.evictions, dgs.count);
+
+    struct hot_cache_stats hcs;
+    if (metrics.server->hot_files && hot_cache_stats(metrics.server, &hcs) != -1)
+        append_text (t, "# HELP reefs_hot_cache_requests_total Downloads looked up in the cache of hot files.\n"
+                        "# TYPE reefs_hot_cache_requests_total counter\n"
+                        "reefs_hot_cache_requests_total{result=\"hit\"} %lu\n"
+                        "reefs_hot_cache_requests_total{result=\"miss\"} %lu\n"
+                        "# HELP reefs_hot_cache_evictions_total Files evicted to make room.\n"
+                        "# TYPE reefs_hot_cache_evictions_total counter\n"
+                        "reefs_hot_cache_evictions_total %lu\n"
+                        "# HELP reefs_hot_cache_invalidations_total Cached files found changed on disk.\n"
+                        "# TYPE reefs_hot_cache_invalidations_total counter\n"
+                        "reefs_hot_cache_invalidations_total %lu\n"
+                        "# HELP reefs_hot_cache_files Files cached.\n"
+                        "# TYPE reefs_hot_cache_files gauge\n"
+                        "reefs_hot_cache_files %d\n"
+                        "# HELP reefs_hot_cache_bytes Memory taken by cached files.\n"
+                        "# TYPE reefs_hot_cache_bytes gauge\n"
+                        "reefs_hot_cache_bytes %lu\n"
+                        "# HELP reefs_hot_cache_retired_bytes Memory taken by files out of the cache, but still being looked up or sent.\n"
+                        "# TYPE reefs_hot_cache_retired_bytes gauge\n"
+                        "reefs_hot_cache_retired_bytes %lu\n",
+                     hcs.hits, hcs.misses, hcs.evictions, hcs.invalidations, hcs.count,
+                     (unsigned long)hcs.size, (unsigned long)hcs.retired_size);
+
+    struct logger_stats ls;
+    if (metrics.server->logger && logger_stats(metrics.server->logger, &ls) != -1)
+        append_text (t, "# HELP reefs_log_records_total Log records by outcome.\n"
+                        "# TYPE reefs_log_records_total counter\n"
+                        "reefs_log_records_total{result=\"written\"} %lu\n"
+                        "reefs_log_records_total{result=\"dropped\"} %lu\n"
+                        "# HELP reefs_log_waits_total Times a thread waited for space in log buffer.\n"
+                        "# TYPE reefs_log_waits_total counter\n"
+                        "reefs_log_waits_total %lu\n",
+                     ls.written, ls.dropped, ls.blocked);
+}
+
+/** Answers single HTTP request with current metrics. */
+static void serve_metrics(int fd)
+{
+    // request itself doesn't matter, but it has to be read before replying
+    char req[BUF_LEN];
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0 || recv(fd, req, BUF_LEN, 0) <= 0)
+        return;
+
+    struct text_buf body = { NULL, 0, 0 };
+    render_metrics (&body);
+
+    char head[BUF_LEN];
+    int c = snprintf(head, BUF_LEN, "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %lu\r\n"
+                                    "Connection: close\r\n\r\n", (unsigned long)body.len);
+    if (write_data(fd, head, c) == c && body.data)
+        write_data (fd, body.data, body.len);
+
+    free (body.data);
+}
+
+/** Worker function for thread accepting metrics scrapes. */
+void* metrics_proc(void* arg)
+{
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct pollfd pfd;
+    pfd.fd = metrics.listen_fd;
+    pfd.events = POLLIN;
+    while (!terminating)
+    {
+        if (poll(&pfd, 1, REACTOR_WAIT_MS) <= 0)    continue;
+
+        int fd = TEMP_FAILURE_RETRY(accept4(metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC));
+        if (fd == -1)   continue;
+        serve_metrics (fd);
+        TEMP_FAILURE_RETRY(close(fd));
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Starting and stopping
+ */
+
+int start_metrics(const struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    metrics.server = serv;
+    metrics.listen_fd = -1;
+    if (pthread_key_create(&metrics.key, retire_shard) != 0)    return -1;
+
+    const struct config* cfg = &(serv->config);
+    if (*(cfg->metrics_socket))
+    {
+        // unix domain socket
+        struct sockaddr_un addr;
+        memset (&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy (addr.sun_path, cfg->metrics_socket, sizeof(addr.sun_path) - 1);
+        unlink (cfg->metrics_socket);
+
+        if ((metrics.listen_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)   return -1;
+        if (bind(metrics.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)         return -1;
+    }
+    else if (cfg->metrics_port > 0)
+    {
+        // local TCP port
+        struct sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)cfg->metrics_port);
+
+        if ((metrics.listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)   return -1;
+        int reuse = 1;
+        setsockopt (metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, (socklen_t)sizeof(int));
+        if (bind(metrics.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)         return -1;
+    }
+    else    return 0;   // metrics are collected, but not exposed
+
+    if (listen(metrics.listen_fd, BACKLOG) == -1)   return -1;
+    if (pthread_create(&metrics.thread, NULL, metrics_proc, NULL) != 0) return -1;
+    return 0;
+}
+
+int stop_metrics(const struct server* serv)
+{
+    if (!serv)                      { errno = EFAULT; return -1; }
+    if (metrics.listen_fd == -1)    return 0;
+
+    pthread_join (metrics.thread, NULL);
+    TEMP_FAILURE_RETRY(close(metrics.listen_fd));
+    metrics.listen_fd = -1;
+
+    if (*(serv->config.metrics_socket))  unlink (serv->config.metrics_socket);
+    return 0;
+}
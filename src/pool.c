@@ -0,0 +1,218 @@
+/** @file pool.c
+    Pool of session structs: slots are allocated in slabs that never move
+    and are recycled through a free list */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Slabs
+ */
+
+/** Allocates another slab of count slots and puts them on the free list.
+    Must be called with pool's lock held. */
+static int add_slab(struct session_pool* pool, int count)
+{
+    struct session** slabs = (struct session**)realloc(pool->slabs, (pool->slabs_count + 1) * sizeof(struct session*));
+    if (!slabs) return -1;
+    pool->slabs = slabs;
+
+    struct session* slab = (struct session*)malloc(count * sizeof(struct session));
+    if (!slab)  return -1;
+    pool->slabs[pool->slabs_count++] = slab;
+
+    int i;
+    for (i = count - 1; i >= 0; --i)
+    {
+        slab[i].next_free = pool->free_list;
+        pool->free_list = &slab[i];
+    }
+    pool->capacity += count;
+    pool->reserved += count * sizeof(struct session);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Acquiring and releasing slots
+ */
+
+/** Takes a free slot from the pool. Returns NULL with errno set to EAGAIN
+    if it would exceed the limit of concurrent sessions. */
+struct session* acquire_session(struct session_pool* pool)
+{
+    if (!pool)  { errno = EFAULT; return NULL; }
+
+    struct session* ses = NULL;
+    pthread_mutex_lock (&pool->lock);
+    if (pool->limit > 0 && pool->used >= pool->limit)
+    {
+        ++pool->rejected;
+        errno = EAGAIN;
+    }
+    else if (pool->free_list || add_slab(pool, SESSION_SLAB) != -1)
+    {
+        ses = pool->free_list;
+        pool->free_list = ses->next_free;
+        ses->next_free = NULL;
+        ses->used_prev = NULL;
+        ses->used_next = pool->in_use;
+        if (pool->in_use)   pool->in_use->used_prev = ses;
+        pool->in_use = ses;
+
+        ++pool->used;
+        if (pool->used > pool->peak)    pool->peak = pool->used;
+        pool->memory += sizeof(struct session);
+        if (pool->memory > pool->peak_memory)   pool->peak_memory = pool->memory;
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return ses;
+}
+
+/** Gives the slot back to the pool. Session must have been ended already. */
+int release_session(struct session_pool* pool, struct session* ses)
+{
+    if (!pool || !ses)  { errno = EFAULT; return -1; }
+
+    pthread_mutex_lock (&pool->lock);
+    if (ses->used_prev) ses->used_prev->used_next = ses->used_next;
+    else                pool->in_use = ses->used_next;
+    if (ses->used_next) ses->used_next->used_prev = ses->used_prev;
+    ses->next_free = pool->free_list;
+    pool->free_list = ses;
+    --pool->used;
+    pool->memory -= sizeof(struct session);
+    if (pool->used == 0)    pthread_cond_broadcast (&pool->released);
+    pthread_mutex_unlock (&pool->lock);
+
+    return 0;
+}
+
+/** Accounts for memory allocated (or freed, if bytes < 0) on behalf of a session. */
+void session_pool_account(struct session_pool* pool, long bytes)
+{
+    if (!pool)  return;
+
+    pthread_mutex_lock (&pool->lock);
+    pool->memory += bytes;
+    if (pool->memory > pool->peak_memory)   pool->peak_memory = pool->memory;
+    pthread_mutex_unlock (&pool->lock);
+}
+
+
+/******************************************************************************
+ * Ending sessions when server stops
+ */
+
+/** Ends sessions left behind by event loops (epoll model). Loops, and threads working
+    for them, must have been stopped already, so that nothing else touches the sessions. */
+int end_orphaned_sessions(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+    if (!serv->sessions || serv->config.io_model != IO_MODEL_EPOLL)    return 0;
+
+    struct session_pool* pool = serv->sessions;
+    for (;;)
+    {
+        pthread_mutex_lock (&pool->lock);
+        struct session* ses = pool->in_use;
+        pthread_mutex_unlock (&pool->lock);
+        if (!ses)   break;
+
+        end_session (ses);
+        release_session (pool, ses);
+    }
+
+    return 0;
+}
+
+/** Waits at most timeout ms for all sessions to end (session threads end theirs
+    once they notice the server is terminating). Returns -1 with errno set to ETIMEDOUT
+    if some are still running. */
+int wait_sessions(struct server* serv, int timeout)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->sessions)    return 0;
+
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)    { ++deadline.tv_sec; deadline.tv_nsec -= 1000000000L; }
+
+    struct session_pool* pool = serv->sessions;
+    int res = 0;
+    pthread_mutex_lock (&pool->lock);
+    while (pool->used > 0 && res == 0)
+        res = pthread_cond_timedwait(&pool->released, &pool->lock, &deadline);
+    int used = pool->used;
+    pthread_mutex_unlock (&pool->lock);
+
+    if (used > 0)   { errno = ETIMEDOUT; return -1; }
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the pool
+ */
+
+/** Creates the pool. When number of clients is limited, all slots are allocated upfront. */
+int init_session_pool(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    struct session_pool* pool = (struct session_pool*)calloc(1, sizeof(struct session_pool));
+    if (!pool)  return -1;
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->released, NULL);
+    pool->limit = serv->config.max_clients > 0 ? serv->config.max_clients : 0;
+
+    if (pool->limit > 0 && add_slab(pool, pool->limit) == -1)
+        { free(pool->slabs); pthread_cond_destroy(&pool->released); pthread_mutex_destroy(&pool->lock); free(pool); return -1; }
+
+    serv->sessions = pool;
+    return 0;
+}
+
+/** Frees the pool. If some sessions are still running, their slots are left alone
+    (and so is the rest of the pool) until the process exits. */
+int free_session_pool(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->sessions) return 0;
+
+    struct session_pool* pool = serv->sessions;
+    if (pool->used > 0) return 0;
+
+    int i;
+    for (i = 0; i < pool->slabs_count; ++i)   free (pool->slabs[i]);
+    free (pool->slabs);
+    pthread_cond_destroy (&pool->released);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool);
+
+    serv->sessions = NULL;
+    return 0;
+}
+
+int session_pool_stats(const struct server* serv, struct session_pool_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+    if (!serv->sessions)    { errno = EBADFD; return -1; }
+
+    struct session_pool* pool = serv->sessions;
+    pthread_mutex_lock (&pool->lock);
+    stats->used = pool->used;
+    stats->peak = pool->peak;
+    stats->capacity = pool->capacity;
+    stats->reserved = pool->reserved;
+    stats->memory = pool->memory;
+    stats->peak_memory = pool->peak_memory;
+    stats->rejected = pool->rejected;
+    pthread_mutex_unlock (&pool->lock);
+
+    return 0;
+}
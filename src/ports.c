@@ -0,0 +1,165 @@
+/** @file ports.c
+    Allocators of data connection ports (passive mode listeners and source ports
+    of active mode): bitmaps over configured port ranges, shared by all sessions
+    without locking */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Allocating and releasing ports
+ */
+
+/** Gives back the ports marked busy, once in PORT_BUSY_SECONDS. Only the thread
+    that moves the deadline does so. */
+static void sweep_busy_ports(struct port_allocator* pa)
+{
+    time_t now = time(NULL);
+    time_t at = __atomic_load_n(&(pa->sweep_at), __ATOMIC_RELAXED);
+    if (now < at || !__atomic_compare_exchange_n(&(pa->sweep_at), &at, now + PORT_BUSY_SECONDS,
+                                                 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    size_t w;
+    for (w = 0; w < pa->words_count; ++w)
+    {
+        uint64_t bits = __atomic_exchange_n(&(pa->busy[w]), 0, __ATOMIC_ACQ_REL);
+        if (!bits)  continue;
+        __atomic_and_fetch (&(pa->words[w]), ~bits, __ATOMIC_RELEASE);
+        __atomic_sub_fetch (&(pa->busy_count), __builtin_popcountll(bits), __ATOMIC_RELAXED);
+    }
+}
+
+/** Takes a free port from the range. Search starts where the previous one ended, both
+    in words and in bits within them, so that ports are handed out round-robin and a port
+    that's just been released isn't reused right away. Returns -1 with errno set to EAGAIN
+    if all ports are taken. */
+int acquire_port(struct port_allocator* pa)
+{
+    if (!pa)    { errno = EFAULT; return -1; }
+
+    sweep_busy_ports (pa);
+    unsigned long start = __atomic_fetch_add(&(pa->cursor), 1, __ATOMIC_RELAXED);
+    int first = (start / pa->words_count) % 64;
+    size_t i;
+    for (i = 0; i < pa->words_count; ++i)
+    {
+        size_t w = (start + i) % pa->words_count;
+        uint64_t bits = __atomic_load_n(&(pa->words[w]), __ATOMIC_RELAXED);
+        while (~bits != 0)
+        {
+            // first free bit from where this round starts, wrapping around
+            uint64_t after = ~bits & (~0ULL << first);
+            int bit = __builtin_ctzll(after ? after : ~bits);
+            if (__atomic_compare_exchange_n(&(pa->words[w]), &bits, bits | (1ULL << bit),
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                __atomic_add_fetch (&(pa->used), 1, __ATOMIC_RELAXED);
+                return pa->min_port + (int)(w * 64 + bit);
+            }
+            // lost the race for this word: bits now hold its current value
+        }
+    }
+
+    __atomic_add_fetch (&(pa->exhausted), 1, __ATOMIC_RELAXED);
+    errno = EAGAIN; return -1;
+}
+
+/** Keeps the port, which turned out to be in use outside the server, taken until
+    the next sweep, so that it isn't tried again right away. */
+int skip_busy_port(struct port_allocator* pa, int port)
+{
+    if (!pa)    { errno = EFAULT; return -1; }
+    if (port < pa->min_port || port > pa->max_port) { errno = EINVAL; return -1; }
+
+    size_t idx = port - pa->min_port;
+    __atomic_add_fetch (&(pa->busy_count), 1, __ATOMIC_RELAXED);
+    __atomic_or_fetch (&(pa->busy[idx / 64]), 1ULL << (idx % 64), __ATOMIC_RELEASE);
+    __atomic_sub_fetch (&(pa->used), 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/** Gives the port back. */
+int release_port(struct port_allocator* pa, int port)
+{
+    if (!pa)    { errno = EFAULT; return -1; }
+    if (port < pa->min_port || port > pa->max_port) { errno = EINVAL; return -1; }
+
+    size_t idx = port - pa->min_port;
+    __atomic_and_fetch (&(pa->words[idx / 64]), ~(1ULL << (idx % 64)), __ATOMIC_RELEASE);
+    __atomic_sub_fetch (&(pa->used), 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the allocator
+ */
+
+static struct port_allocator* new_port_allocator(int min, int max)
+{
+    if (min < 1 || max > 65535 || min > max)    { errno = EINVAL; return NULL; }
+
+    struct port_allocator* pa = (struct port_allocator*)calloc(1, sizeof(struct port_allocator));
+    if (!pa)    return NULL;
+    pa->min_port = min;
+    pa->max_port = max;
+    pa->words_count = (max - min) / 64 + 1;
+    if (!(pa->words = (uint64_t*)calloc(pa->words_count, sizeof(uint64_t)))
+        || !(pa->busy = (uint64_t*)calloc(pa->words_count, sizeof(uint64_t))))
+        { free(pa->words); free(pa); return NULL; }
+    pa->sweep_at = time(NULL) + PORT_BUSY_SECONDS;
+
+    // bits past the end of range are taken for good
+    int tail = (max - min + 1) % 64;
+    if (tail)   pa->words[pa->words_count - 1] = ~0ULL << tail;
+
+    return pa;
+}
+
+static void free_port_allocator(struct port_allocator* pa)
+{
+    if (!pa)    return;
+
+    free (pa->busy);
+    free (pa->words);
+    free (pa);
+}
+
+/** Creates allocators of passive mode ports and, if their range is configured,
+    of active mode source ports. */
+int init_ports(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    const struct config* cfg = &(serv->config);
+    serv->active_ports = NULL;
+    if (!(serv->pasv_ports = new_port_allocator(cfg->pasv_min_port, cfg->pasv_max_port)))   return -1;
+    if (cfg->active_min_port > 0
+        && !(serv->active_ports = new_port_allocator(cfg->active_min_port, cfg->active_max_port)))
+        return -1;
+
+    return 0;
+}
+
+int free_ports(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    free_port_allocator (serv->pasv_ports);
+    free_port_allocator (serv->active_ports);
+    serv->pasv_ports = serv->active_ports = NULL;
+    return 0;
+}
+
+int port_allocator_stats(const struct port_allocator* pa, struct port_stats* stats)
+{
+    if (!pa || !stats)  { errno = EFAULT; return -1; }
+
+    stats->total = pa->max_port - pa->min_port + 1;
+    stats->used = __atomic_load_n(&(pa->used), __ATOMIC_RELAXED);
+    stats->busy = __atomic_load_n(&(pa->busy_count), __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&(pa->exhausted), __ATOMIC_RELAXED);
+    return 0;
+}
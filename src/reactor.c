@@ -0,0 +1,320 @@
+/** @file reactor.c
+    Event loops multiplexing control connections (epoll I/O model) */
+
+
+#include "reefs.h"
+#include <sys/eventfd.h>
+
+
+/******************************************************************************
+ * Event loop threads
+ */
+
+/** Unregisters the session from event loop and releases it. */
+static void drop_session(struct event_loop* loop, struct session* ses)
+{
+    epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, ses->control_socket, NULL);
+    if (ses->data_pending)  reactor_unwatch_data (ses);
+    end_session (ses);
+    release_session (ses->server->sessions, ses);
+}
+
+/** Continues sessions whose passwords have been verified or whose transfers are done. */
+static void resume_sessions(struct event_loop* loop)
+{
+    uint64_t val;
+    TEMP_FAILURE_RETRY(read(loop->wake_fd, &val, sizeof(val)));
+
+    pthread_mutex_lock (&(loop->resume_lock));
+    struct session* ses = loop->resumed;
+    loop->resumed = NULL;
+    pthread_mutex_unlock (&(loop->resume_lock));
+
+    struct session* next;
+    for (; ses; ses = next)
+    {
+        next = ses->queue_next;
+        if (resume_session(ses) == -1 || ses->terminated)
+            drop_session (loop, ses);
+    }
+}
+
+/** Worker function for event loop thread. Every readiness notification is a single step
+    of session's state machine: drain the socket and execute whatever commands were completed. */
+void* event_loop_proc(void* arg)
+{
+    struct event_loop* loop = (struct event_loop*)arg;
+
+    // leave signal handling to the main thread
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n, i, j;
+    while (!terminating && !__atomic_load_n(&(loop->stopping), __ATOMIC_RELAXED))
+    {
+        n = epoll_wait(loop->epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_WAIT_MS);
+        if (n == -1)
+        {
+            if (errno != EINTR) FATAL("Waiting for events on control connections.");
+            continue;
+        }
+
+        int resume = 0;
+        for (i = 0; i < n; ++i)
+        {
+            struct session* ses = (struct session*)events[i].data.ptr;
+            if (!ses)   { resume = 1; continue; }
+            if (!events[i].events)  continue;   // session dropped earlier in the batch
+
+            // events of data connection being opened carry the session too; suspended session
+            // is dropped only once it gets resumed, unless it's just waiting for the connection
+            process_data_ready (ses);
+            if ((process_control_input(ses) == -1 || ses->terminated) && !ses->auth_pending
+                && (!ses->transfer_pending || ses->data_pending))
+            {
+                drop_session (loop, ses);
+                for (j = i + 1; j < n; ++j)
+                    if (events[j].data.ptr == ses)  events[j].events = 0;
+            }
+        }
+
+        // after the batch, as resumed sessions may be dropped and some events can refer to them
+        if (resume) resume_sessions (loop);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Transfer threads
+ */
+
+/** Worker function for threads running commands that would block an event loop
+    (data transfers, once their data connections are open), each for a session suspended meanwhile. */
+void* transfer_proc(void* arg)
+{
+    struct reactor* r = (struct reactor*)arg;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    for (;;)
+    {
+        pthread_mutex_lock (&(r->transfer_lock));
+        while (!r->transfers && !r->stopping)
+            pthread_cond_wait (&(r->transfer_cond), &(r->transfer_lock));
+        struct session* ses = r->stopping ? NULL : r->transfers;
+        if (ses)
+        {
+            r->transfers = ses->queue_next;
+            if (!r->transfers)  r->transfers_tail = NULL;
+        }
+        pthread_mutex_unlock (&(r->transfer_lock));
+        if (!ses)   break;  // stopping; sessions still queued stay suspended
+
+        run_transfer (ses);
+        reactor_resume_session (ses);
+    }
+
+    return 0;
+}
+
+/** Queues session's pending command for a transfer thread. Session stays suspended
+    until it's handed back to its event loop. */
+int reactor_submit_transfer(struct reactor* r, struct session* ses)
+{
+    if (!r || !ses) { errno = EFAULT; return -1; }
+
+    ses->queue_next = NULL;
+    pthread_mutex_lock (&(r->transfer_lock));
+    if (r->transfers_tail)  r->transfers_tail->queue_next = ses;
+    else                    r->transfers = ses;
+    r->transfers_tail = ses;
+    pthread_cond_signal (&(r->transfer_cond));
+    pthread_mutex_unlock (&(r->transfer_lock));
+
+    return 0;
+}
+
+
+/** Makes session's event loop watch its data socket until the data connection for pending
+    transfer is open (see process_data_ready()). Called from the loop itself. */
+int reactor_watch_data(struct session* ses)
+{
+    if (!ses || !ses->loop) { errno = EFAULT; return -1; }
+
+    struct epoll_event ev;
+    ev.events = ses->data_conn.mode == MODE_PASSIVE ? EPOLLIN : EPOLLOUT;
+    ev.data.ptr = ses;
+    return epoll_ctl(ses->loop->epoll_fd, EPOLL_CTL_ADD, ses->data_socket, &ev);
+}
+
+int reactor_unwatch_data(struct session* ses)
+{
+    if (!ses || !ses->loop) { errno = EFAULT; return -1; }
+    return epoll_ctl(ses->loop->epoll_fd, EPOLL_CTL_DEL, ses->data_socket, NULL);
+}
+
+
+/******************************************************************************
+ * Managing the reactor
+ */
+
+/** Undoes whatever start_reactor() has done so far, keeping errno of the failure. */
+static int abort_reactor(struct server* serv)
+{
+    int err = errno;
+    stop_reactor (serv);
+    errno = err;
+    return -1;
+}
+
+int start_reactor(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    struct reactor* r = (struct reactor*)calloc(1, sizeof(struct reactor));
+    if (!r) return -1;
+    pthread_mutex_init (&(r->transfer_lock), NULL);
+    pthread_cond_init (&(r->transfer_cond), NULL);
+    serv->reactor = r;  // from now on, stop_reactor() cleans up
+
+    int i, count = serv->config.io_threads > 0 ? serv->config.io_threads : DEFAULT_IO_THREADS;
+    if (!(r->loops = (struct event_loop*)calloc(count, sizeof(struct event_loop))))
+        return abort_reactor(serv);
+    r->loops_count = count;
+    for (i = 0; i < r->loops_count; ++i)
+    {
+        r->loops[i].epoll_fd = r->loops[i].wake_fd = -1;
+        pthread_mutex_init (&(r->loops[i].resume_lock), NULL);
+    }
+
+    for (i = 0; i < r->loops_count; ++i)
+    {
+        struct event_loop* loop = &(r->loops[i]);
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)    return abort_reactor(serv);
+
+        // wakeups for resuming sessions are events with no session attached
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if ((loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+            || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1)
+            return abort_reactor(serv);
+
+        // loop runs on the core of acceptor whose sessions it serves
+        pthread_attr_t attr;
+        pthread_attr_init (&attr);
+        int res = pin_thread_attr(&attr, acceptor_cpu(serv, i % serv->acceptors_count)) == -1
+                  || (errno = pthread_create(&(loop->thread), &attr, event_loop_proc, loop)) != 0;
+        pthread_attr_destroy (&attr);
+        if (res)    return abort_reactor(serv);
+        loop->started = 1;
+    }
+
+    count = serv->config.transfer_threads > 0 ? serv->config.transfer_threads : DEFAULT_TRANSFER_THREADS;
+    if (!(r->workers = (pthread_t*)calloc(count, sizeof(pthread_t))))  return abort_reactor(serv);
+    for (; r->workers_count < count; ++r->workers_count)
+        if ((errno = pthread_create(&(r->workers[r->workers_count]), NULL, transfer_proc, r)) != 0)
+            return abort_reactor(serv);
+
+    return 0;
+}
+
+int stop_reactor(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->reactor) return 0;
+
+    // event loops notice the termination flag on their next wakeup
+    struct reactor* r = serv->reactor;
+    int i;
+    for (i = 0; i < r->loops_count; ++i)
+    {
+        struct event_loop* loop = &(r->loops[i]);
+        __atomic_store_n (&(loop->stopping), 1, __ATOMIC_RELAXED);
+        if (!loop->started) continue;
+
+        uint64_t one = 1;
+        TEMP_FAILURE_RETRY(write(loop->wake_fd, &one, sizeof(one)));
+        pthread_join (loop->thread, NULL);
+    }
+
+    // transfers that are running hand their sessions back to loops that are gone
+    pthread_mutex_lock (&(r->transfer_lock));
+    r->stopping = 1;
+    pthread_cond_broadcast (&(r->transfer_cond));
+    pthread_mutex_unlock (&(r->transfer_lock));
+    for (i = 0; i < r->workers_count; ++i)  pthread_join (r->workers[i], NULL);
+    free (r->workers);
+
+    for (i = 0; i < r->loops_count; ++i)
+    {
+        struct event_loop* loop = &(r->loops[i]);
+        if (loop->wake_fd != -1)    TEMP_FAILURE_RETRY(close(loop->wake_fd));
+        if (loop->epoll_fd != -1)   TEMP_FAILURE_RETRY(close(loop->epoll_fd));
+        pthread_mutex_destroy (&(loop->resume_lock));
+    }
+    pthread_cond_destroy (&(r->transfer_cond));
+    pthread_mutex_destroy (&(r->transfer_lock));
+
+    free (r->loops);
+    free (r);
+    serv->reactor = NULL;
+    return 0;
+}
+
+/** Hands over the session to one of event loops, which owns its slot from now on.
+    Loops are picked round-robin from those serving session's acceptor (if it has none,
+    as there are more acceptors than loops, the loop of acceptor's number is used). */
+int reactor_add_session(struct reactor* r, struct session* ses)
+{
+    if (!r || !ses) { errno = EFAULT; return -1; }
+
+    // greet the client before the loop can see any of its input
+    if (send_welcome_message(ses) == -1 || ses->terminated)
+        { end_session(ses); release_session(ses->server->sessions, ses); return 0; }
+
+    struct acceptor* acc = ses->acceptor;
+    int shards = ses->server->acceptors_count, idx = acc->index % r->loops_count;
+    if (acc->index < r->loops_count)
+    {
+        // only the acceptor's own thread gets here, so its cursor needs no locking
+        int own = (r->loops_count - acc->index + shards - 1) / shards;
+        idx = acc->index + (acc->next_loop % own) * shards;
+        ++acc->next_loop;
+    }
+    struct event_loop* loop = &(r->loops[idx]);
+    ses->loop = loop;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ses;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ses->control_socket, &ev) == -1)
+        { end_session(ses); release_session(ses->server->sessions, ses); return -1; }
+
+    return 0;
+}
+
+/** Hands the session back to its event loop once its password has been verified
+    or its transfer is done. Called from authentication and transfer threads. */
+int reactor_resume_session(struct session* ses)
+{
+    if (!ses || !ses->loop) { errno = EFAULT; return -1; }
+
+    struct event_loop* loop = ses->loop;
+    pthread_mutex_lock (&(loop->resume_lock));
+    ses->queue_next = loop->resumed;
+    loop->resumed = ses;
+    pthread_mutex_unlock (&(loop->resume_lock));
+
+    uint64_t one = 1;
+    if (TEMP_FAILURE_RETRY(write(loop->wake_fd, &one, sizeof(one))) == -1)  return -1;
+    return 0;
+}
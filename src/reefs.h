@@ -19,9 +19,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/utsname.h>
+#include <stdarg.h>
 
 
 #define ARRAY_LEN(x) (sizeof(x)/sizeof((x)[0]))
@@ -32,13 +35,17 @@
  */
 
 #define VERSION "0.5.1"
-#define BACKLOG 5
+#define BACKLOG 5               // of data connection listeners
+#define DEFAULT_LISTEN_BACKLOG 1024     // of listeners of server port
+#define DEFAULT_ACCEPTORS 1
 
 #define BUF_LEN 256
+#define ZERO_COPY_CHUNK (1 << 20)   // max. bytes moved by single sendfile()/splice() call
 #define MAX_LOGIN 64
 #define MAX_PASSWORD 128
 #define MAX_IPv4_LEN (16+1)
-#define MAX_FTP_CMD_LEN (4+1)
+#define MAX_FTP_CMD_LEN (8+1)
+#define MAX_FTP_COMMANDS 64
 
 #ifdef PATH_MAX
 #define MAX_PATH (PATH_MAX+1)
@@ -51,22 +58,137 @@
 #define DEFAULT_LOG_FILE "./log"
 #define DEFAULT_ROOT_DIR "/var/lib/ftp"
 #define DEFAULT_LISTEN_PORT 21
+#define DEFAULT_IO_THREADS 4
+#define DEFAULT_AUTH_THREADS 2
+#define DEFAULT_TRANSFER_THREADS 16
+#define DEFAULT_LOG_BUFFER 1024     // records
+#define DEFAULT_TRANSFER_CHUNK (256 * 1024)
 
 
-#define MIN_PASV_PORT 10384
+#define DEFAULT_PASV_MIN_PORT 10384
+#define DEFAULT_PASV_MAX_PORT 65535
+#define PORT_BIND_ATTEMPTS 8    // ports tried for a data connection when they turn out to be in use
+#define PORT_BUSY_SECONDS 30    // ports found in use outside the server are skipped for 1-2 times that
+#define DEFAULT_CONNECT_TIMEOUT_MS 10000
 
 // FTP connection modes
 #define MODE_NONE 0
 #define MODE_ACTIVE 1
 #define MODE_PASSIVE 2
 
+// arguments taken by FTP commands
+#define ARGS_NONE 0
+#define ARGS_OPTIONAL 1
+#define ARGS_REQUIRED 2
+
 // FTP transmission types
 #define TYPE_BINARY 'I'
 #define TYPE_ASCII 'A'
 
-
-#define LIST_LS_PARAMS "--almost-all -n"
-#define LIST_LS_OUTFILE "/var/tmp/reefs-list"
+// FTP transmission modes
+#define TRANSFER_STREAM 'S'
+#define TRANSFER_DEFLATE 'Z'
+
+// models of servicing control connections
+#define IO_MODEL_THREADS 0      // one thread per session
+#define IO_MODEL_EPOLL 1        // fixed set of event loops multiplexing all sessions
+
+// how data transfers move the bytes
+#define IO_BACKEND_SPLICE 0     // sendfile() or splice(), falling back to copying
+#define IO_BACKEND_COPY 1       // plain read() and write() through transfer buffer
+#define IO_BACKEND_URING 2      // several reads and writes in flight with io_uring
+
+#define CMD_BUF_LEN (4 * MAX_PATH)
+#define OUT_BUF_LEN (2 * MAX_PATH)     // replies waiting to be sent together
+#define FEAT_REPLY_LEN 512      // rendered reply to FEAT
+#define MAX_SEGMENTS 16         // concurrent segmented transfers per session
+#define DEFAULT_MAX_SEGMENTS 8
+#define DEFAULT_DEFLATE_LEVEL 6
+#define DEFLATE_OUT_LEN (64 * 1024)     // compressed data produced at once
+#define URING_DEPTH 8           // buffers of a transfer in flight at once (io_uring backend)
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_WAIT_MS 1000
+#define ACCEPT_PAUSE_MS 100     // acceptor out of descriptors or memory waits this long at first...
+#define ACCEPT_PAUSE_MAX_MS 2000    // ...twice as long after every failure, up to this
+#define SESSION_WAIT_MS 1000    // session threads notice server termination at least this often
+#define SESSION_DRAIN_MS 5000   // how long stopping server waits for sessions to end
+#define CONTROL_WAIT_MS 200       // longest wait for room on control connection of event loop's session
+
+#define TIMER_TICK_MS 100       // resolution of timeouts
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)  // per level of timer wheel
+#define TIMER_LEVELS 4          // wheel reaches 2^24 ticks (~19 days) ahead
+
+// what session's timer is counting down to
+#define TIMEOUT_LOGIN 0         // client has to log in within config.login_timeout
+#define TIMEOUT_IDLE 1          // ...then send a command every config.idle_timeout
+#define TIMEOUT_DATA 2          // data connection has to move within config.data_timeout
+
+#define DEFAULT_LOGIN_TIMEOUT 30    // seconds
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_DATA_TIMEOUT 60
+
+// buckets limiting bandwidth of transfers, from the narrowest one
+#define THROTTLE_SESSION 0
+#define THROTTLE_USER 1
+#define THROTTLE_GLOBAL 2
+#define THROTTLE_LEVELS 3
+#define THROTTLE_BURST_MS 100   // bucket holds tokens for this long at its rate...
+#define THROTTLE_MIN_BURST (64 * 1024)  // ...but at least this many
+#define USER_RATE_BUCKETS 256   // hash table of users' buckets
+
+// per-address admission control of clients
+#define CLIENT_BUCKETS 4096     // hash table of clients' addresses...
+#define CLIENT_STRIPES 64       // ...guarded by this many locks
+
+#define SESSION_SLAB 64         // session slots allocated at once when clients aren't limited
+
+
+// durability of log records
+#define LOG_SYNC_NONE 0         // left to the OS
+#define LOG_SYNC_PERIODIC 1     // fdatasync() every LOG_SYNC_INTERVAL_MS
+#define LOG_SYNC_ALWAYS 2       // fdatasync() after every batch of records
+
+// what to do when log buffer is full
+#define LOG_OVERFLOW_BLOCK 0
+#define LOG_OVERFLOW_DROP 1
+
+#define LOG_RECORD_LEN (MAX_PATH + 64)
+#define LOG_STAMP_LEN 32
+#define LOG_BATCH 64                // records written with single writev()
+#define LOG_SYNC_INTERVAL_MS 1000
+
+#define METRICS_BUCKETS 6           // latency histogram buckets (w/o +Inf)
+#define METRICS_TIMEOUT_MS 1000     // for reading scrape requests
+
+// directory listing formats
+#define LIST_FORMAT_LS 0        // `ls -l` lines (LIST)
+#define LIST_FORMAT_NAMES 1     // bare names (NLST)
+#define LIST_FORMAT_FACTS 2     // machine-readable facts (MLSD)
+
+#define LIST_DENTS_LEN (32 * 1024)  // buffer for getdents64()
+
+#define DEFAULT_LIST_CACHE_SIZE (4 * 1024 * 1024)
+#define LISTING_CACHE_BUCKETS 1024
+#define LISTING_CACHE_MIN_ENTRIES 4     // no single listing may take more of the cache
+
+// checksum algorithms (HASH, XCRC, XMD5, XSHA256)
+#define DIGEST_SHA1 0
+#define DIGEST_SHA256 1
+#define DIGEST_SHA512 2
+#define DIGEST_MD5 3
+#define DIGEST_CRC32 4
+#define DIGEST_CRC32C 5
+#define DIGEST_ALGORITHMS 6
+#define DEFAULT_DIGEST DIGEST_SHA256
+#define MAX_DIGEST_HEX (2 * 64 + 1)     // SHA-512 in hex
+
+#define DEFAULT_DIGEST_CACHE_SIZE 4096  // files
+
+#define DEFAULT_HOT_CACHE_SIZE (32 * 1024 * 1024)
+#define DEFAULT_HOT_FILE_MAX (256 * 1024)   // larger files are never cached
+#define HOT_CACHE_BUCKETS 4096
+#define DIGEST_CACHE_BUCKETS 1024
 
 
 /******************************************************************************
@@ -87,18 +209,99 @@ struct config
 
     char root_dir[MAX_PATH];    // root directory of the server
     short port;
+    int listen_backlog;         // connections waiting to be accepted, per acceptor
+    int acceptors;              // threads accepting clients, each on its own listener
+    int cpu_affinity;           // pin acceptors, and sessions they accept, to cores
     int max_clients;            // 0 = no limit
-
-    struct user* users;         // login data for users
-    int users_count;
+    int max_clients_per_ip;     // concurrent sessions from one address (0 = no limit)
+    int ip_connection_rate;     // connections one address may open per minute (0 = no limit)
+    int io_model;               // IO_MODEL_THREADS or IO_MODEL_EPOLL
+    int io_threads;             // number of event loops (epoll model only)
+    int transfer_threads;       // threads running data transfers off the event loops (epoll model only)
+    size_t transfer_chunk;      // bytes moved at once by data transfers
+    int io_backend;             // IO_BACKEND_*
+    size_t list_cache_size;     // bytes of cached directory listings (0 = no caching)
+    int digest_cache_size;      // files whose checksums are cached (0 = no caching)
+    size_t hot_cache_size;      // bytes of small files kept in memory for RETR (0 = no caching)
+    size_t hot_file_max;        // ...and the largest one that is
+    unsigned upload_digests;    // checksums computed while files are uploaded (bits of DIGEST_*)
+
+    size_t log_buffer;          // number of records buffered for the log writer
+    int log_sync;               // LOG_SYNC_*
+    int log_overflow;           // LOG_OVERFLOW_*
+
+    int metrics_port;           // local HTTP port for metrics (0 = none)
+    char metrics_socket[MAX_PATH];  // ...or unix socket path (takes precedence)
+
+    int auth_threads;           // threads verifying hashed passwords (epoll model only)
+    int max_segments;           // concurrent segmented transfers per session (0 = none)
+
+    int pasv_min_port, pasv_max_port;   // range of passive mode ports
+    char pasv_address[MAX_IPv4_LEN];    // address advertised by PASV (empty = the one client connected to)
+    int active_min_port, active_max_port;   // source ports of active mode connections (0 = any)
+    int connect_timeout;        // ms for active mode connection to be established
+
+    int login_timeout, idle_timeout, data_timeout;  // seconds (0 = never)
+
+    long rate_limit;            // bytes/s of all transfers together (0 = no limit)
+    long user_rate_limit;       // ...of all sessions of a user
+    long session_rate_limit;    // ...of a single session
+
+    int deflate_level;          // compression level of MODE Z (0 = MODE Z disabled)
+    char deflate_cache_dir[MAX_PATH];   // compressed files kept for next downloads (empty = none)
 };
 
 struct server
 {
     struct config config;
 
-    int listen_socket;          // listens on config.port
+    struct acceptor* acceptors; // listeners of config.port
+    int acceptors_count;
+    int stop_fd;                // eventfd waking acceptors up when server terminates
     int log_fd;
+    struct logger* logger;      // writes to log_fd asynchronously
+
+    struct session_pool* sessions;
+    struct user_db* users;
+    struct reactor* reactor;    // event loops (epoll model only)
+    struct listing_cache* list_cache;
+    struct digest_cache* digests;   // checksums of files (NULL = none cached)
+    struct hot_cache* hot_files;    // contents of small files (NULL = none cached)
+    struct port_allocator* pasv_ports;
+    struct port_allocator* active_ports;    // source ports of active mode (NULL = any)
+    struct timer_wheel* timers;
+    struct throttle* throttle;  // bandwidth limits
+    struct client_table* clients;   // per-address limits (NULL = none)
+
+    // replies that never change, rendered at startup
+    char motd_reply[BUF_LEN];
+    size_t motd_len;
+    char feat_reply[DIGEST_ALGORITHMS][FEAT_REPLY_LEN];     // by algorithm selected for HASH
+    size_t feat_len[DIGEST_ALGORITHMS];
+};
+
+// timer armed on the timer wheel
+struct timer
+{
+    struct timer *prev, *next;  // in wheel's slot (NULL = not armed)
+    unsigned long expires;      // tick
+    void (*fire)(struct timer*);
+};
+
+// sees data as it's moved between descriptors, e.g. to compute checksums on the way
+struct data_tap
+{
+    void (*seen)(struct data_tap*, const char* buf, size_t len);
+};
+
+// token bucket limiting bandwidth; it's refilled when tokens are taken
+struct rate_bucket
+{
+    pthread_mutex_t lock;
+    long rate;                  // bytes/s (0 = no limit)
+    double burst;               // most tokens it holds
+    double tokens;
+    struct timespec stamp;      // of last refill
 };
 
 // contains info about FTP client session
@@ -114,10 +317,17 @@ struct session
     struct
     {
         int type;                   // transmission type
+        int transfer_mode;          // transmission mode (stream or deflate)
         int mode;                   // connection mode (passive or active)
         uint16_t port;              // listening port (passive) or destination port for connecting (active)
-        uint32_t ip;                // destination IP (active only)
+        uint32_t ip;                // destination IP (active only, network byte order)
+        int source_port;            // allocated source port of active connection (0 = none)
+        int listening;              // data_socket is still a passive mode listener
     } data_conn;
+    off_t restart_offset;       // set by REST for the next transfer
+    off_t range_start, range_end;   // set by RANG for the next transfer (range_end = -1 if none)
+
+    int hash_algorithm;         // DIGEST_* used by HASH
 
     // client info
     int logged_in;
@@ -128,6 +338,66 @@ struct session
     char last_cmd[MAX_FTP_CMD_LEN];
     char last_cmd_data[MAX_PATH];
     int terminated;
+
+    // reusable buffer for data transfers that can't be done inside the kernel
+    // (allocated on first use, config.transfer_chunk bytes)
+    char* xfer_buf;
+
+    // input from control connection; commands are parsed in place,
+    // cmd_start..cmd_end being the part that hasn't been processed yet
+    char cmd_buf[CMD_BUF_LEN];
+    int cmd_start, cmd_end;
+    int cmd_overflow;           // discarding the rest of too long line
+
+    // replies formatted but not sent yet
+    char out_buf[OUT_BUF_LEN];
+    int out_len;
+    int out_corked;             // coalescing replies to a batch of commands
+
+    // guards output buffer and segments, as segment threads reply too
+    pthread_mutex_t lock;
+    // guards timer's state and swaps of data_socket; never held for long,
+    // so that timeouts fire even when lock is held by a blocked send
+    pthread_mutex_t timeout_lock;
+
+    // segmented transfers running in background
+    int segment_sockets[MAX_SEGMENTS];  // -1 = free slot
+    int segments_active;
+    int segments_aborted;
+    pthread_cond_t segments_done;
+
+    struct session* next_free;  // free list of session pool
+    struct session *used_prev, *used_next;  // sessions in use, ended before server stops
+
+    // timeout of whatever session is waiting for (guarded by timeout_lock)
+    struct timer timer;
+    int timer_phase;            // TIMEOUT_*
+    long long data_progress;    // bytes data connection has moved when timer was armed
+
+    // bandwidth limits (see throttle.c)
+    struct rate_bucket rate;    // of the session itself
+    struct user_rate* user_rate;    // shared by sessions of the user (NULL = none)
+    int throttled_by;           // THROTTLE_* level a transfer is waiting for now (-1 = none)
+    unsigned long long throttled_ns;    // time transfers have waited in total
+
+    // event loop servicing the session (epoll model only)
+    struct event_loop* loop;
+    struct acceptor* acceptor;  // that accepted the client
+    struct client* client;      // state of client's address (NULL = not tracked)
+
+    // password being verified off the event loop; session is suspended meanwhile
+    int auth_pending;
+    int auth_ok;
+    char auth_hash[MAX_PASSWORD];
+    char auth_password[MAX_PASSWORD];
+
+    // command that may block (data transfer) being run by a transfer thread; session is suspended meanwhile
+    int transfer_pending;
+    int data_pending;           // its data connection is being opened by the event loop first
+    int data_error;             // errno of failing to open it, for the transfer thread (0 = none)
+    char transfer_cmd[MAX_FTP_CMD_LEN + MAX_PATH];
+
+    struct session* queue_next; // in queue for verification or transfer, then for resuming
 };
 
 
@@ -136,6 +406,380 @@ struct control_thread_info
     struct session* session;
 };
 
+// record in the log buffer
+struct log_record
+{
+    unsigned long seq;          // sequence number synchronizing producers with the writer
+    time_t time;
+    size_t len;
+    char text[LOG_RECORD_LEN];
+};
+
+// asynchronous log writer
+struct logger
+{
+    struct log_record* records; // ring buffer
+    size_t mask;                // ring size - 1
+    unsigned long enqueue_pos;  // shared by producers
+    unsigned long dequeue_pos;  // writer thread only
+
+    int fd;
+    int sync;
+    int overflow;
+    int unsynced;               // something was written since last fdatasync()
+
+    pthread_t thread;
+    int wake_fd;                // eventfd for waking up the writer
+    int writer_sleeping;
+    int stopping;
+
+    // producers waiting for space (overflow policy `block`) sleep until writer frees some
+    pthread_mutex_t space_lock;
+    pthread_cond_t space_freed;
+    int producers_waiting;
+
+    unsigned long written, dropped, blocked, batches, syncs, errors;
+};
+
+struct logger_stats
+{
+    unsigned long written;      // records
+    unsigned long dropped;      // records lost because buffer was full
+    unsigned long blocked;      // times producer had to wait for space in buffer
+    unsigned long batches, syncs, errors;
+};
+
+// buffered output of directory listing
+struct listing_out
+{
+    int fd;                     // where the listing goes when buffer fills up (-1 = keep in memory)
+    char* buf;
+    size_t len, cap;
+    size_t limit;               // max. size of in-memory listing
+    int overflow_fd;            // where in-memory listing goes on once it reaches the limit (-1 = fail)
+    size_t sent;                // bytes written to fd so far
+};
+
+// rendered directory listing, shared by sessions
+struct listing_cache_entry
+{
+    char path[MAX_PATH];
+    int format;
+    char* data;
+    size_t len;                 // of data (or of the entry itself, if it's too big)
+    int too_big;                // listing isn't cached, as it's bigger than any entry may be
+
+    int wd;                     // inotify watch of the directory
+    int refs;                   // cache itself + sessions currently sending it
+    struct listing_cache_entry *prev, *next;    // LRU list, most recent first
+    struct listing_cache_entry* hash_next;
+};
+
+// LRU cache of directory listings, invalidated by inotify
+struct listing_cache
+{
+    pthread_mutex_t lock;
+    int inotify_fd;
+    unsigned long generation;   // number of inotify events seen so far
+
+    struct listing_cache_entry* buckets[LISTING_CACHE_BUCKETS];
+    struct listing_cache_entry *head, *tail;
+    size_t size, max_size;
+
+    unsigned long hits, misses, evictions, invalidations;
+};
+
+struct listing_cache_stats
+{
+    unsigned long hits, misses, evictions, invalidations;
+    size_t size;
+};
+
+// checksum of a file, as it was when it was computed
+struct digest_cache_entry
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int algorithm;
+    char hex[MAX_DIGEST_HEX];
+
+    struct digest_cache_entry *prev, *next;     // LRU list, most recent first
+    struct digest_cache_entry* hash_next;
+};
+
+// LRU cache of checksums; files are told apart by device and inode, and any
+// change of their modification time or size makes the old checksums miss
+struct digest_cache
+{
+    pthread_mutex_t lock;
+    struct digest_cache_entry* buckets[DIGEST_CACHE_BUCKETS];
+    struct digest_cache_entry *head, *tail;
+    int count, max_count;
+
+    unsigned long hits, misses, evictions, stores;
+};
+
+struct digest_cache_stats
+{
+    unsigned long hits, misses, evictions, stores;
+    int count;
+};
+
+// small file kept in memory, as it was when it was read
+struct hot_file
+{
+    char path[MAX_PATH];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    int refs;                   // transfers sending it right now
+    int referenced;             // used since the clock hand passed it
+    struct hot_file* hash_next; // read without lock
+    struct hot_file *clock_prev, *clock_next;   // ring swept by the clock hand
+    struct hot_file* retired_next;
+
+    char data[];
+};
+
+// contents of small files, looked up without locking: readers announce themselves
+// in readers[phase], and files taken out of the table are freed only once readers
+// of the phase they were removed in are gone (and nobody sends them any more);
+// lock guards everything else
+struct hot_cache
+{
+    pthread_mutex_t lock;
+    struct hot_file* buckets[HOT_CACHE_BUCKETS];
+    struct hot_file* hand;      // of the clock, evicting files not used for a whole sweep
+    int count;
+    size_t size, max_size, max_file;    // bytes of files in the table (or being read in for it)
+    size_t retired_size;        // bytes of files taken out, but not freed yet
+
+    unsigned phase;
+    long readers[2];
+    struct hot_file* retired;   // taken out in current phase
+    struct hot_file* waiting;   // ...in previous one, waiting for its readers
+    struct hot_file* draining;  // ...and still being sent
+
+    unsigned long hits, misses, evictions, invalidations;
+};
+
+struct hot_cache_stats
+{
+    unsigned long hits, misses, evictions, invalidations;
+    int count;
+    size_t size, retired_size;
+};
+
+// preallocated session structs, recycled through a free list
+struct session_pool
+{
+    pthread_mutex_t lock;
+    struct session** slabs;     // slots are never moved once allocated
+    int slabs_count;
+    struct session* free_list;
+    struct session* in_use;
+    pthread_cond_t released;    // signalled when the last session is released
+
+    int limit;                  // max. concurrent sessions (0 = no limit)
+    int capacity, used, peak;   // slots
+    size_t reserved;            // bytes taken by slabs
+    size_t memory, peak_memory; // bytes taken by sessions in use (incl. their buffers)
+    unsigned long rejected;     // clients turned away because of the limit
+};
+
+struct session_pool_stats
+{
+    int used, peak, capacity;
+    size_t reserved, memory, peak_memory;
+    unsigned long rejected;
+};
+
+struct deflate_cache_stats
+{
+    unsigned long hits, misses, stores;
+};
+
+// data connection ports in use, one bit per port of configured range
+struct port_allocator
+{
+    uint64_t* words;            // bits past the end of range are always set
+    uint64_t* busy;             // ports found in use by others, taken in words until next sweep
+    size_t words_count;
+    int min_port, max_port;
+    unsigned long cursor;       // where next search starts: word (modulo words_count), then bit
+    long used;
+    long busy_count;
+    time_t sweep_at;            // when busy ports are given back
+    unsigned long exhausted;    // times no free port was found
+};
+
+struct port_stats
+{
+    int total;
+    long used, busy;
+    unsigned long exhausted;
+};
+
+// byte range of a file sent in background over its own data connection
+struct segment
+{
+    struct session* session;
+    int slot;                   // in session's segment_sockets
+    int socket;                 // passive mode listener
+    int port;                   // its port, given back when segment is done
+    char file[MAX_PATH];
+    off_t offset, length;
+    pthread_t thread;
+};
+
+// login data of users, indexed by login (open addressing)
+struct user_table
+{
+    struct user* users;
+    int count;
+    int* slots;                 // indices to users, -1 = empty slot
+    size_t mask;                // number of slots - 1
+};
+
+// user database that can be replaced while it's being read
+struct user_db
+{
+    struct user_table* table;
+    unsigned long epoch;        // picks the counter for new readers
+    long readers[2];            // readers in even and odd epochs
+
+    pthread_t reload_thread;
+    pthread_mutex_t reload_lock;
+    pthread_cond_t reload_cond;
+    int reload_requested;
+
+    // verifying hashed passwords (epoll model only)
+    pthread_t* threads;
+    int threads_count;
+    pthread_mutex_t auth_lock;
+    pthread_cond_t auth_cond;
+    struct session *auth_queue, *auth_queue_tail;
+    int stopping;
+};
+
+// bucket shared by all sessions of a user
+struct user_rate
+{
+    char login[MAX_LOGIN];
+    struct rate_bucket bucket;
+    int refs;                   // sessions using it
+    struct user_rate* next;     // in hash chain
+};
+
+// bandwidth limits of the server
+struct throttle
+{
+    struct rate_bucket global;
+    pthread_mutex_t users_lock;
+    struct user_rate* users[USER_RATE_BUCKETS];
+
+    long waiting[THROTTLE_LEVELS];          // transfers waiting for tokens right now
+    unsigned long waits[THROTTLE_LEVELS];   // by level that made them wait
+    unsigned long long waited_ns[THROTTLE_LEVELS];
+};
+
+struct throttle_stats
+{
+    long waiting[THROTTLE_LEVELS];
+    unsigned long waits[THROTTLE_LEVELS];
+    double waited[THROTTLE_LEVELS];         // seconds
+};
+
+// connections from one address
+struct client
+{
+    in_addr_t addr;
+    int sessions;               // open right now
+    double tokens;              // connections it may still open at once
+    struct timespec stamp;      // of last refill
+    struct client* next;        // in hash chain
+};
+
+// clients' addresses, hashed into buckets; lock (i % CLIENT_STRIPES) guards bucket i
+struct client_table
+{
+    pthread_mutex_t locks[CLIENT_STRIPES];
+    struct client* buckets[CLIENT_BUCKETS];
+
+    long tracked;               // addresses in the table
+    unsigned long rejected_sessions;    // connections over the concurrent sessions limit
+    unsigned long rejected_rate;        // ...over the connection rate
+};
+
+struct client_table_stats
+{
+    long tracked;
+    unsigned long rejected_sessions, rejected_rate;
+};
+
+// hierarchical timer wheel, driven by a thread ticking every TIMER_TICK_MS
+struct timer_wheel
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;        // signalled when a timer has fired
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];  // list heads
+    struct timer expired;       // list of timers to be fired
+    struct timer* running;      // timer being fired right now
+    unsigned long now;          // ticks since start
+    unsigned long fired;
+
+    pthread_t thread;
+    int stopping;
+};
+
+// thread accepting clients on its own SO_REUSEPORT listener
+struct acceptor
+{
+    pthread_t thread;
+    int started;
+    struct server* server;
+    int index;
+    int socket;
+    int cpu;                    // core it's pinned to, with its sessions (-1 = none)
+    int next_loop;              // round-robin over its event loops (epoll model only)
+    unsigned long accepted;
+    unsigned long pauses;       // times it had to wait for descriptors or memory
+    time_t refusals_logged;     // second a refused client was last logged in
+    unsigned long refusals_unlogged;    // refused since then without a log line
+};
+
+// event loop multiplexing control connections of many sessions
+struct event_loop
+{
+    pthread_t thread;
+    int epoll_fd;
+
+    int wake_fd;                // eventfd signalled when sessions are to be resumed
+    pthread_mutex_t resume_lock;
+    struct session* resumed;    // sessions whose password verification or transfer is done
+
+    int started;
+    int stopping;
+};
+
+struct reactor
+{
+    struct event_loop* loops;
+    int loops_count;            // loop i serves sessions of acceptor i % acceptors
+
+    // threads running commands that would block an event loop
+    pthread_t* workers;
+    int workers_count;
+    pthread_mutex_t transfer_lock;
+    pthread_cond_t transfer_cond;
+    struct session *transfers, *transfers_tail;
+    int stopping;
+};
+
 
 /******************************************************************************
  * Functions
@@ -147,6 +791,14 @@ int free_strings(char** array, int size);
 
 ssize_t read_data(int fd, char* buf, size_t count);
 ssize_t write_data(int fd, const char* buf, size_t count);
+int wait_writable(int fd, int timeout);
+ssize_t copy_data(int out_fd, int in_fd, char* buf, size_t buf_len);
+ssize_t sendfile_data(int out_fd, int in_fd);
+ssize_t splice_data(int out_fd, int in_fd, size_t chunk);
+ssize_t splice_tapped(int out_fd, int in_fd, size_t chunk, char* buf, size_t buf_len, struct data_tap*);
+ssize_t uring_send(int out_fd, int in_fd, size_t chunk);
+ssize_t uring_receive(int out_fd, int in_fd, size_t chunk, struct data_tap*);
+ssize_t send_range(int out_fd, int in_fd, off_t offset, size_t count, char* buf, size_t buf_len);
 char* read_line(int fd);
 char* absolute_to_relative_path(const char* base, const char* target, char* out);
 char* relative_to_absolute_path(const char* base, const char* target, char* out);
@@ -157,18 +809,146 @@ int init_server(const char* config_file, struct server*);
 int start_server(struct server*);
 int stop_server(struct server*);
 
-int new_session(int sfd, struct session*);
+int init_acceptors(struct server*);
+int start_acceptors(struct server*);
+int stop_acceptors(struct server*);
+int free_acceptors(struct server*);
+int acceptor_cpu(const struct server*, int shard);
+int pin_thread_attr(pthread_attr_t*, int cpu);
+
+int init_ports(struct server*);
+int free_ports(struct server*);
+int acquire_port(struct port_allocator*);
+int release_port(struct port_allocator*, int port);
+int skip_busy_port(struct port_allocator*, int port);
+int port_allocator_stats(const struct port_allocator*, struct port_stats*);
+
+int init_session_pool(struct server*);
+int free_session_pool(struct server*);
+struct session* acquire_session(struct session_pool*);
+int release_session(struct session_pool*, struct session*);
+void session_pool_account(struct session_pool*, long bytes);
+int end_orphaned_sessions(struct server*);
+int wait_sessions(struct server*, int timeout);
+int session_pool_stats(const struct server*, struct session_pool_stats*);
+
+struct user* parse_users_file(const char* file, int* users_count);
+int init_users(struct server*);
+int request_users_reload(struct server*);
+int free_users(struct server*);
+int stop_auth_threads(struct server*);
+int find_user(struct user_db*, const char* login, struct user* out);
+uint32_t hash_login(const char* login);
+int password_hashed(const char* stored);
+int authenticate(const struct user*, const char* password);
+int submit_password(struct user_db*, struct session*);
+
+int new_session(int client_fd, const struct sockaddr_in* client_addr, struct session*);
 int start_session(struct session*);
+int end_session(struct session*);
+int send_welcome_message(struct session*);
+char* session_buffer(struct session*);
+int process_control_input(struct session*);
+int resume_session(struct session*);
+int process_data_ready(struct session*);
+int run_transfer(struct session*);
+void arm_session_timer(struct session*, int phase);
 int respond(struct session*, int code, const char* resp);
+int respond_rendered(struct session*, const char* reply, size_t len);
+int render_reply(char* out, size_t cap, int code, const char* resp);
+int render_static_replies(struct server*);
+int flush_output(struct session*, int more);
+
+int format_facts(const struct stat* st, char* out, size_t len);
+int list_directory(struct listing_out* out, const char* path, int format);
+int send_listing(struct session* ses, const char* path, int format);
+int init_listing_cache(struct server*);
+int free_listing_cache(struct server*);
+int listing_cache_stats(const struct server*, struct listing_cache_stats*);
+
+int digest_algorithm(const char* name);
+const char* digest_name(int algorithm);
+int file_digest(struct session*, const char* file, int algorithm, char* hex, off_t* size);
+ssize_t receive_digested(struct session*, int out_fd, int in_fd, char* buf, size_t buf_len, unsigned algorithms);
+int init_digest_cache(struct server*);
+int free_digest_cache(struct server*);
+int digest_cache_stats(const struct server*, struct digest_cache_stats*);
+
+ssize_t send_hot_file(struct session*, const char* file, const struct stat* st, off_t offset);
+int init_hot_cache(struct server*);
+int free_hot_cache(struct server*);
+int hot_cache_stats(const struct server*, struct hot_cache_stats*);
+
+int init_throttle(struct server*);
+int free_throttle(struct server*);
+int throttle_stats(const struct server*, struct throttle_stats*);
+void init_session_rate(struct session*);
+int attach_user_rate(struct session*);
+void free_session_rate(struct session*);
+int throttling(const struct session*);
+size_t throttle(struct session*, size_t want);
+void unthrottle(struct session*, size_t unused);
+ssize_t throttled_read(struct session*, int fd, char* buf, size_t count);
+ssize_t throttled_write(struct session*, int fd, const char* buf, size_t count);
+ssize_t throttled_send(struct session*, int out_fd, int in_fd, off_t* offset, size_t count, char* buf, size_t buf_len);
+ssize_t throttled_receive(struct session*, int out_fd, int in_fd, char* buf, size_t buf_len);
+
+int init_clients(struct server*);
+int free_clients(struct server*);
+int admit_client(struct server*, const struct sockaddr_in* addr, struct client** client);
+void leave_client(const struct server*, struct client*);
+int client_table_stats(const struct server*, struct client_table_stats*);
+
+int start_timers(struct server*);
+int stop_timers(struct server*);
+void init_timer(struct timer*, void (*fire)(struct timer*));
+int set_timer(struct timer_wheel*, struct timer*, unsigned long ms);
+int cancel_timer(struct timer_wheel*, struct timer*);
+
+int start_reactor(struct server*);
+int stop_reactor(struct server*);
+int reactor_add_session(struct reactor*, struct session*);
+int reactor_resume_session(struct session*);
+int reactor_submit_transfer(struct reactor*, struct session*);
+int reactor_watch_data(struct session*);
+int reactor_unwatch_data(struct session*);
 
 int open_data_connection(struct session* ses);
+int connect_data_connection(struct session* ses);
 int close_data_connection(struct session* ses);
-int send_file(struct session* ses, const char* file);
-int receive_file(struct session* ses, const char* file);
-
-int log_line(int logfd, const char* line);
+int send_file(struct session* ses, const char* file, const struct stat* st, off_t offset);
+int start_segment(struct session*, const char* file, off_t offset, off_t length, const char* reply);
+int abort_segments(struct session*);
+int receive_file(struct session* ses, const char* file, off_t offset, int append);
+size_t lf_to_crlf(const char* in, size_t len, char* out);
+size_t crlf_to_lf(const char* in, size_t len, char* out, int* cr);
+ssize_t send_ascii(struct session*, int out_fd, int in_fd, char* buf, size_t buf_len);
+ssize_t receive_ascii(struct session*, int out_fd, int in_fd, char* buf, size_t buf_len);
+
+ssize_t send_deflated(struct session*, int fd, off_t offset);
+ssize_t receive_deflated(struct session*, int fd);
+int init_deflate_cache(struct server*);
+int deflate_cache_stats(struct deflate_cache_stats*);
+
+struct logger* start_logger(int fd, const struct config*);
+int stop_logger(struct logger*);
+int free_logger(struct logger*);
+int log_append(struct logger*, const char* text, size_t len);
+int logger_stats(const struct logger*, struct logger_stats*);
+
+int start_metrics(const struct server*);
+int stop_metrics(const struct server*);
+void metrics_command(int cmd, const struct timespec* start, const struct timespec* end);
+void metrics_bytes(size_t in, size_t out);
+void metrics_sessions(int delta);
+void metrics_passive(int delta);
+const char* ftp_command_name(int cmd);
+int ftp_commands_count();
+int parse_ftp_command(const char* line, const char** data);
+
+int log_line(const struct server* serv, const char* line, size_t len);
 int log_command(struct session*, const char* cmd);
-int log_response(struct session*, const char* resp);
+int log_response(struct session*, const char* resp, size_t len);
 int log_event(const struct server* serv, const char* msg);
 
 void error(const char* file, int line, const char* msg);
@@ -181,5 +961,6 @@ void error(const char* file, int line, const char* msg);
  */
 
 extern volatile sig_atomic_t terminating; // whether server was terminated by SIGINT
+extern volatile sig_atomic_t reloading;   // whether SIGHUP asked for reloading users
 
 #endif // REEFS__H
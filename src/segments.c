@@ -0,0 +1,157 @@
+/** @file segments.c
+    Segmented downloads: byte ranges of a file sent concurrently over several
+    passive data connections of the same session, each by its own thread */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Segment threads
+ */
+
+/** Replies on behalf of a segment. Replies don't wait for control connection's batch to end. */
+static void respond_segment(struct session* ses, int code, const char* resp)
+{
+    respond (ses, code, resp);
+    flush_output (ses, 0);
+}
+
+/** Worker function for thread sending a single segment. */
+void* segment_proc(void* arg)
+{
+    struct segment* seg = (struct segment*)arg;
+    struct session* ses = seg->session;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    ssize_t c = -1;
+    int sfd = TEMP_FAILURE_RETRY(accept(seg->socket, NULL, NULL));
+    metrics_passive (-1);
+
+    // replacing the listening socket with data connection socket
+    pthread_mutex_lock (&(ses->lock));
+    ses->segment_sockets[seg->slot] = sfd;
+    if (ses->segments_aborted && sfd != -1) shutdown (sfd, SHUT_RDWR);
+    pthread_mutex_unlock (&(ses->lock));
+    TEMP_FAILURE_RETRY(close(seg->socket));
+
+    if (sfd != -1)
+    {
+        int fd = TEMP_FAILURE_RETRY(open(seg->file, O_RDONLY | O_CLOEXEC));
+        if (fd != -1)
+        {
+            size_t buf_len = ses->server->config.transfer_chunk;
+            char* buf = (char*)malloc(buf_len);
+            off_t offset = seg->offset;
+            if (throttling(ses))    c = throttled_send(ses, sfd, fd, &offset, seg->length, buf, buf_len);
+            else                    c = send_range(sfd, fd, seg->offset, seg->length, buf, buf_len);
+            if (c > 0)  metrics_bytes (0, c);
+
+            free (buf);
+            TEMP_FAILURE_RETRY(close(fd));
+        }
+        shutdown (sfd, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock (&(ses->lock));
+    ses->segment_sockets[seg->slot] = -1;
+    pthread_mutex_unlock (&(ses->lock));
+    if (sfd != -1)  TEMP_FAILURE_RETRY(close(sfd));
+    if (seg->port)  release_port (ses->server->pasv_ports, seg->port);
+
+    if (c == (ssize_t)seg->length)  respond_segment (ses, 226, "Transfer complete.");
+    else                            respond_segment (ses, 426, "Connection closed; transfer aborted.");
+
+    // only now the session may go away
+    pthread_mutex_lock (&(ses->lock));
+    --ses->segments_active;
+    pthread_cond_broadcast (&(ses->segments_done));
+    pthread_mutex_unlock (&(ses->lock));
+
+    free (seg);
+    return 0;
+}
+
+
+/******************************************************************************
+ * Starting and aborting segments
+ */
+
+/** Starts sending length bytes of the file from offset over session's passive data connection,
+    in background. Session's data connection is handed over to the segment, so that client can
+    open another one with PASV while this one is still going. The preliminary reply (150) goes out
+    once the segment has its slot, before its thread starts, so that segment's final reply
+    can't overtake it. */
+int start_segment(struct session* ses, const char* file, off_t offset, off_t length, const char* reply)
+{
+    if (!ses || !file || !reply)    { errno = EFAULT; return -1; }
+    if (ses->data_socket == -1 || !ses->data_conn.listening)    { errno = EBADF; return -1; }
+
+    struct segment* seg = (struct segment*)malloc(sizeof(struct segment));
+    if (!seg)   return -1;
+    seg->session = ses;
+    seg->socket = ses->data_socket;
+    seg->port = ses->data_conn.port;
+    strncpy (seg->file, file, MAX_PATH);
+    seg->offset = offset;
+    seg->length = length;
+
+    // find a free slot
+    pthread_mutex_lock (&(ses->lock));
+    int limit = ses->server->config.max_segments;
+    for (seg->slot = 0; seg->slot < limit && ses->segment_sockets[seg->slot] != -1; ++seg->slot) { }
+    if (seg->slot == limit)
+    {
+        pthread_mutex_unlock (&(ses->lock));
+        free (seg);
+        errno = EBUSY;  return -1;
+    }
+    ses->segment_sockets[seg->slot] = seg->socket;
+    ++ses->segments_active;
+    pthread_mutex_unlock (&(ses->lock));
+
+    respond (ses, 150, reply);
+
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&(seg->thread), &attr, segment_proc, seg) != 0)
+    {
+        pthread_mutex_lock (&(ses->lock));
+        ses->segment_sockets[seg->slot] = -1;
+        --ses->segments_active;
+        pthread_mutex_unlock (&(ses->lock));
+        free (seg);
+        errno = EAGAIN; return -1;
+    }
+
+    // data connection belongs to the segment now
+    pthread_mutex_lock (&(ses->timeout_lock));
+    ses->data_socket = -1;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+    ses->data_conn.port = 0;
+    ses->data_conn.mode = MODE_NONE;
+    ses->data_conn.listening = 0;
+    return 0;
+}
+
+/** Aborts all segments of the session and waits for their threads to finish. */
+int abort_segments(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    pthread_mutex_lock (&(ses->lock));
+    ses->segments_aborted = 1;
+    int i;
+    for (i = 0; i < MAX_SEGMENTS; ++i)
+        if (ses->segment_sockets[i] != -1)  shutdown (ses->segment_sockets[i], SHUT_RDWR);
+    while (ses->segments_active > 0)
+        pthread_cond_wait (&(ses->segments_done), &(ses->lock));
+    pthread_mutex_unlock (&(ses->lock));
+
+    return 0;
+}
@@ -21,65 +21,71 @@ int init_server(const char* config_file, struct server* serv)
 
     fprintf (stdout, "%s", "Opening log file...");
     if ((serv->log_fd = TEMP_FAILURE_RETRY(open(serv->config.log_file,
-                                                O_WRONLY | O_CREAT | O_APPEND | O_DSYNC, 0666))) == -1)
+                                                O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666))) == -1)
         return -1;
+    if (!(serv->logger = start_logger(serv->log_fd, &(serv->config))))  return -1;
     fprintf (stdout, "%s", "OK\n");
 
-    fprintf (stdout, "%s", "Initializing server socket...");
-    if ((serv->listen_socket = socket(PF_INET, SOCK_STREAM, 0)) == -1)    return -1;
-    int reuse = 1;
-    if (setsockopt(serv->listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, (socklen_t)sizeof(int)) == -1)
-        return -1;
+    fprintf (stdout, "%s", "Initializing server sockets...");
+    if (init_acceptors(serv) == -1) return -1;
+    fprintf (stdout, "%s", "OK\n");
 
-    // listen on server socket
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons((uint16_t)serv->config.port);
-    if (bind(serv->listen_socket, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) == -1)
-        return -1;
-    if (listen(serv->listen_socket, BACKLOG) == -1)  return -1;
+    fprintf (stdout, "%s", "Loading users...");
+    if (init_users(serv) == -1)         return -1;
     fprintf (stdout, "%s", "OK\n");
 
+    if (init_session_pool(serv) == -1)  return -1;
+    if (init_ports(serv) == -1)  return -1;
+    if (start_timers(serv) == -1)   return -1;
+    if (init_throttle(serv) == -1)  return -1;
+    if (init_clients(serv) == -1)   return -1;
+    if (render_static_replies(serv) == -1)  return -1;
+    if (init_listing_cache(serv) == -1) return -1;
+    if (init_digest_cache(serv) == -1)  return -1;
+    if (init_hot_cache(serv) == -1) return -1;
+    if (init_deflate_cache(serv) == -1) return -1;
+
+    fprintf (stdout, "%s", "Starting metrics...");
+    if (start_metrics(serv) == -1)  return -1;
+    fprintf (stdout, "%s", "OK\n");
+
+    serv->reactor = NULL;
+    if (serv->config.io_model == IO_MODEL_EPOLL)
+    {
+        fprintf (stdout, "%s", "Starting event loops...");
+        if (start_reactor(serv) == -1)  return -1;
+        fprintf (stdout, "%s", "OK\n");
+    }
+
     fprintf (stdout, "%s", "Server successfully initialized.\n");
     return 0;
 }
 
+/** Starts accepting clients and waits for signals until the server is terminated. */
 int start_server(struct server* serv)
 {
     if (!serv)  { errno = EFAULT; return -1; }
 
-    struct session* sessions = NULL;    // array with FTP sessions info
-    int sessions_count = 0;
-    struct session inc_session;
-
+    // SIGINT and SIGHUP are only seen here, while waiting for them; threads started
+    // from now on inherit the mask with both blocked
+    sigset_t sigs, wait_sigs;
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGHUP);
+    pthread_sigmask (SIG_BLOCK, &sigs, &wait_sigs);
+    sigdelset (&wait_sigs, SIGINT);
+    sigdelset (&wait_sigs, SIGHUP);
+
+    if (start_acceptors(serv) == -1)    return -1;
     log_event (serv, "Server started.");
-    fd_set fds;
-    int res;
+
     while (!terminating)
     {
-        // wait for incoming connections
-        FD_ZERO (&fds); FD_SET (serv->listen_socket, &fds);
-        res = select(serv->listen_socket + 1, &fds, NULL, NULL, NULL);
-        if (res == -1)
-        {
-            if (errno != EINTR) FATAL("Waiting for incoming connections.");
-            continue;
-        }
-        if (res == 0)   continue;
-
-        // accept them
-        if (new_session(serv->listen_socket, &inc_session) == -1)   FATAL("Accepting incoming connection");
-        inc_session.server = serv;
-        strncpy (inc_session.current_dir, serv->config.root_dir, MAX_PATH); // set initial directory
-
-        // start servicing the new connection
-        sessions = (struct session*)realloc(sessions, (sessions_count + 1) * sizeof(struct session));
-        memcpy (&sessions[sessions_count], &inc_session, sizeof(struct session));
-        ++sessions_count;
-        if (start_session(&sessions[sessions_count - 1]) == -1) FATAL("Handling client session");
+        sigsuspend (&wait_sigs);
+        if (reloading)  { reloading = 0; request_users_reload(serv); }
     }
 
+    if (stop_acceptors(serv) == -1) return -1;
     log_event (serv, "Server terminated.");
     return 0;
 }
@@ -88,10 +94,113 @@ int stop_server(struct server* serv)
 {
     if (!serv)  { errno = EFAULT; return -1; }
 
+    // suspended sessions are handed back to event loops, so authentication threads go first
+    if (stop_auth_threads(serv) == -1)  return -1;
+    if (stop_reactor(serv) == -1)   return -1;
+    if (stop_metrics(serv) == -1)   return -1;
+    if (free_acceptors(serv) == -1) return -1;
+
+    // nothing below may be freed while sessions (or their threads) could still use it
+    end_orphaned_sessions (serv);
+    int drained = wait_sessions(serv, SESSION_DRAIN_MS) != -1;
+
+    struct listing_cache_stats lcs;
+    if (listing_cache_stats(serv, &lcs) != -1 && serv->list_cache)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Listing cache: %lu hits, %lu misses, %lu evictions, %lu invalidations.",
+                  lcs.hits, lcs.misses, lcs.evictions, lcs.invalidations);
+        log_event (serv, buf);
+    }
+
+    struct digest_cache_stats dgs;
+    if (digest_cache_stats(serv, &dgs) != -1)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Checksum cache: %lu hits, %lu misses, %lu stored, %lu evictions.",
+                  dgs.hits, dgs.misses, dgs.stores, dgs.evictions);
+        log_event (serv, buf);
+    }
+
+    struct hot_cache_stats hcs;
+    if (hot_cache_stats(serv, &hcs) != -1)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Hot file cache: %lu hits, %lu misses, %lu evictions, %lu invalidations.",
+                  hcs.hits, hcs.misses, hcs.evictions, hcs.invalidations);
+        log_event (serv, buf);
+    }
+
+    struct deflate_cache_stats dcs;
+    if (*(serv->config.deflate_cache_dir) && deflate_cache_stats(&dcs) != -1)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Deflate cache: %lu hits, %lu misses, %lu stored.", dcs.hits, dcs.misses, dcs.stores);
+        log_event (serv, buf);
+    }
+
+    struct session_pool_stats sps;
+    if (session_pool_stats(serv, &sps) != -1)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Sessions: %d at peak, %lu bytes of memory at peak, %lu clients rejected.",
+                  sps.peak, (unsigned long)sps.peak_memory, sps.rejected);
+        log_event (serv, buf);
+        if (!drained)
+        {
+            snprintf (buf, BUF_LEN, "Sessions: %d still running, left to the process exit.", sps.used);
+            log_event (serv, buf);
+        }
+    }
+
+    struct throttle_stats ts;
+    if (throttle_stats(serv, &ts) != -1 && (ts.waits[THROTTLE_SESSION] || ts.waits[THROTTLE_USER] || ts.waits[THROTTLE_GLOBAL]))
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Throttling: transfers waited %.1f s for session, %.1f s for user and %.1f s for global limit.",
+                  ts.waited[THROTTLE_SESSION], ts.waited[THROTTLE_USER], ts.waited[THROTTLE_GLOBAL]);
+        log_event (serv, buf);
+    }
+
+    struct client_table_stats cts;
+    if (client_table_stats(serv, &cts) != -1 && (cts.rejected_sessions || cts.rejected_rate))
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Clients refused: %lu over sessions per address, %lu over connection rate.",
+                  cts.rejected_sessions, cts.rejected_rate);
+        log_event (serv, buf);
+    }
+
+    if (drained)
+    {
+        if (free_users(serv) == -1)     return -1;
+        if (free_listing_cache(serv) == -1) return -1;
+        if (free_digest_cache(serv) == -1)  return -1;
+        if (free_hot_cache(serv) == -1) return -1;
+        if (stop_timers(serv) == -1)    return -1;
+        if (free_throttle(serv) == -1)  return -1;
+        if (free_clients(serv) == -1)   return -1;
+        if (free_session_pool(serv) == -1)  return -1;
+        if (free_ports(serv) == -1)  return -1;
+    }
+
+    struct logger_stats ls;
+    if (logger_stats(serv->logger, &ls) != -1 && (ls.dropped > 0 || ls.blocked > 0 || ls.errors > 0))
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, "Log writer: %lu records dropped, %lu producers blocked, %lu write errors.",
+                  ls.dropped, ls.blocked, ls.errors);
+        log_event (serv, buf);
+    }
+    log_event (serv, "Server stopped.");
+
+    // sessions still running may log (in vain) until the process exits, so the logger stays then
+    if (!drained)   return stop_logger(serv->logger);
+    if (free_logger(serv->logger) == -1)    return -1;
+    serv->logger = NULL;
     if (TEMP_FAILURE_RETRY(close(serv->log_fd)) == -1)
         return -1;
 
-    log_event (serv, "Server stopped.");
     return 0;
 }
 
@@ -100,59 +209,44 @@ int stop_server(struct server* serv)
  * Logging functions
  */
 
-int log_line(int logfd, const char* line)
+/** Queues a line for the log writer, which will prefix it with current time. */
+int log_line(const struct server* serv, const char* line, size_t len)
 {
-    if (logfd < 0)  { errno = EBADFD; return -1; }
-    if (!line)      { errno = EFAULT; return -1; }
-    static const char* LINE_FEED = "\n";
-
-    int c;
+    if (!serv || !line)     { errno = EFAULT; return -1; }
+    if (!serv->logger)      { errno = EBADFD; return -1; }
 
-    // log current time
-    time_t time_val;        if (time(&time_val) == (time_t)-1)    return -1;
-    struct tm time_struct;  if (localtime_r(&time_val, &time_struct) == NULL)  return -1;
-    char time_buf[64];      if (asctime_r(&time_struct, time_buf) == NULL)   return -1;
-    *strstr(time_buf, "\n") = ' ';
-    c = strlen(time_buf);   if (write_data(logfd, time_buf, c) < c) return -1;
-
-    // log the message
-    c = strlen(line);       if (write_data(logfd, line, c) < c) return -1;
-    c = strlen(LINE_FEED);  if (write_data(logfd, LINE_FEED, c) < c)    return -1;
+    return log_append(serv->logger, line, len);
+}
 
-    // duplicate output to STDOUT
-    if (logfd != STDOUT_FILENO && log_line(STDOUT_FILENO, line) == -1)  return -1;
+/** Logs a line of session's traffic (len bytes of text), prefixed with client's address. */
+static int log_session_line(struct session* ses, const char* text, int len)
+{
+    static const int LINE_LEN = 1 + MAX_IPv4_LEN + 2 + MAX_PATH;
+    char buf[LINE_LEN];
+    int c = snprintf(buf, LINE_LEN, "[%s] %.*s", ses->ip_address, len, text);
+    if (c >= LINE_LEN)  c = LINE_LEN - 1;
 
-    return 0;
+    return log_line(ses->server, buf, c);
 }
 
 int log_command(struct session* ses, const char* cmd)
 {
     if (!ses || !cmd)               { errno = EFAULT; return -1; }
-    if (ses->server->log_fd < 0)    { errno = EBADFD; return -1; }
-
-    static const int LINE_LEN = 1 + MAX_IPv4_LEN + 2 + MAX_PATH;
-    char buf[LINE_LEN];
-    snprintf (buf, LINE_LEN, "[%s] %s", ses->ip_address, cmd);
 
-    return log_line(ses->server->log_fd, buf);
+    return log_session_line(ses, cmd, strlen(cmd));
 }
 
-int log_response(struct session* ses, const char* resp)
+/** Logs a reply (len bytes of text), line by line. */
+int log_response(struct session* ses, const char* resp, size_t len)
 {
     if (!ses || !resp)              { errno = EFAULT; return -1; }
-    if (ses->server->log_fd < 0)    { errno = EBADFD; return -1; }
 
-    int i; char* buf;
-    while (*resp)
+    const char *end = resp + len, *eol;
+    while (resp < end)
     {
-        for (i = 0; resp[i] && resp[i] != '\n'; ++i) { }
-        if (!(buf = (char*)malloc((i + 1) * sizeof(char)))) return -1;
-        strncpy (buf, resp, i);
-        buf[i] = '\0';
-
-        if (log_command(ses, buf) == -1)    return -1;
-        free (buf);
-        resp += i + 1;
+        if (!(eol = (const char*)memchr(resp, '\n', end - resp)))   eol = end;
+        if (log_session_line(ses, resp, eol - resp) == -1)  return -1;
+        resp = eol + 1;
     }
 
     return 0;
@@ -160,7 +254,8 @@ int log_response(struct session* ses, const char* resp)
 
 int log_event(const struct server* serv, const char* msg)
 {
-    return log_line(serv->log_fd, msg);
+    if (!serv || !msg)  { errno = EFAULT; return -1; }
+    return log_line(serv, msg, strlen(msg));
 }
 
 
@@ -3,6 +3,9 @@
 
 
 #include "reefs.h"
+#include <poll.h>
+#include <stddef.h>
+#include <linux/tcp.h>
 
 
 /******************************************************************************
@@ -20,6 +23,14 @@ int process_USER(struct session* ses, const char* data)
     return 0;
 }
 
+/** Replies to PASS once the password is checked. */
+static void reply_login(struct session* ses)
+{
+    if (ses->logged_in && attach_user_rate(ses) == -1)  ses->logged_in = 0;
+    if (ses->logged_in) respond (ses, 230, "Login successful.");
+    else                respond (ses, 530, "Login incorrect.");
+}
+
 int process_PASS(struct session* ses, const char* data)
 {
     if (!ses)   { errno = EFAULT; return -1; }
@@ -28,22 +39,25 @@ int process_PASS(struct session* ses, const char* data)
         respond (ses, 503, "Login with USER first.");
     else
     {
+        struct user u;
         if (strcmp(ses->login, "anonymous") == 0 || strcmp(ses->login, "ftp") == 0)
             ses->logged_in = (strstr(data, "@") != NULL);
-        else
+        else if (find_user(ses->server->users, ses->login, &u) != -1)
         {
-            // search users for a match
-            int i;
-            for (i = 0; i < ses->server->config.users_count; ++i)
-                if (strcmp(ses->login, ses->server->config.users[i].login) == 0
-                    && strcmp(data, ses->server->config.users[i].password) == 0)
-                    ses->logged_in = 1;
+            if (password_hashed(u.password) && ses->loop)
+            {
+                // don't stall the whole event loop on hashing: suspend the session instead
+                strncpy (ses->auth_hash, u.password, MAX_PASSWORD);
+                strncpy (ses->auth_password, data, MAX_PASSWORD - 1);
+                ses->auth_password[MAX_PASSWORD - 1] = '\0';
+                ses->auth_pending = 1;
+                return submit_password(ses->server->users, ses);
+            }
+            ses->logged_in = authenticate(&u, data);
         }
     }
 
-    if (ses->logged_in) respond (ses, 230, "Login successful.");
-    else                respond (ses, 530, "Login incorrect.");
-
+    reply_login (ses);
     return 0;
 }
 
@@ -57,9 +71,8 @@ int process_QUIT(struct session* ses, const char* data)
 
 int process_FEAT(struct session* ses, const char* data)
 {
-    static const char features[] = "Features:\nPASV\nEnd";
-    respond (ses, 211, features);
-
+    int a = ses->hash_algorithm;
+    respond_rendered (ses, ses->server->feat_reply[a], ses->server->feat_len[a]);
     return 0;
 }
 
@@ -69,6 +82,46 @@ int process_SYST(struct session* ses, const char* data)
     return 0;
 }
 
+/** Formats bandwidth limit for STAT. */
+static const char* format_rate(long rate, char* out)
+{
+    if (rate > 0)   snprintf (out, 32, "%ld B/s", rate);
+    else            strcpy (out, "none");
+    return out;
+}
+
+/** Reports the state of session, incl. how its bandwidth limits hold transfers back. */
+int process_STAT(struct session* ses, const char* data)
+{
+    if (*data)  { respond (ses, 504, "STAT with argument not implemented."); return 0; }
+
+    static const char* levels[THROTTLE_LEVELS] = { "session", "user", "global" };
+    const struct config* cfg = &(ses->server->config);
+    char sr[32], ur[32], gr[32], now[64] = "";
+    int by = __atomic_load_n(&(ses->throttled_by), __ATOMIC_RELAXED);
+    if (by >= 0 && by < THROTTLE_LEVELS)
+        snprintf (now, sizeof(now), ", waiting for %s limit now", levels[by]);
+
+    char resp[BUF_LEN + MAX_LOGIN];
+    snprintf (resp, sizeof(resp),
+              "Status of session:\n"
+              "Connected from %s\n"
+              "Logged in as %s\n"
+              "TYPE: %s, MODE: %s\n"
+              "Rate limits: session %s, user %s, global %s\n"
+              "Throttled for %.3f s in total%s\n"
+              "End of status.",
+              ses->ip_address, ses->logged_in ? ses->login : "nobody",
+              ses->data_conn.type == TYPE_ASCII ? "ASCII" : "BINARY",
+              ses->data_conn.transfer_mode == TRANSFER_DEFLATE ? "DEFLATE" : "STREAM",
+              format_rate(ses->rate.rate, sr),
+              format_rate(ses->user_rate ? ses->user_rate->bucket.rate : 0, ur),
+              format_rate(cfg->rate_limit, gr),
+              __atomic_load_n(&(ses->throttled_ns), __ATOMIC_RELAXED) / 1e9, now);
+    respond (ses, 211, resp);
+    return 0;
+}
+
 
 int process_PWD(struct session* ses, const char* data)
 {
@@ -230,386 +283,1547 @@ int process_TYPE(struct session* ses, const char* data)
     return 0;
 }
 
-int process_PASV(struct session* ses, const char* data)
+int process_MODE(struct session* ses, const char* data)
 {
-    int sfd = socket(PF_INET, SOCK_STREAM, 0);
-    if (sfd != -1)
-    {
-        // find a free port (in high range) to bind the socket to
-        uint16_t port = (uint16_t)(rand() % (65535 - MIN_PASV_PORT)) + MIN_PASV_PORT;
-        struct sockaddr_in sin;
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = htonl(INADDR_ANY);
-        do {
-            sin.sin_port = htons(++port);
-            if (port == 0)  goto Fail;
-        } while (bind(sfd, (struct sockaddr*)&sin, sizeof(struct sockaddr_in)) == -1 && errno == EADDRINUSE);
-
-        if (listen(sfd, BACKLOG) != -1)
+    if (strlen(data) == 1)
+        switch (*data)
         {
-            socklen_t addr_len = sizeof(struct sockaddr_in);
-            if (getpeername(ses->control_socket, (struct sockaddr*)&sin, &addr_len) != -1)
-            {
-                char ip[MAX_IPv4_LEN];
-                strncpy (ip, inet_ntoa(sin.sin_addr), MAX_IPv4_LEN);
-                char* p; for (p = ip; *p; ++p)    if (*p == '.') *p = ',';    // dots to commas
-
-                char buf[BUF_LEN];
-                snprintf (buf, BUF_LEN, "Entering Passive Mode (%s,%i,%i)", ip, port / 256, port % 256);
-                respond (ses, 227, buf);
+            case 'S':
+            case 's':
+                ses->data_conn.transfer_mode = TRANSFER_STREAM;
+                respond (ses, 200, "Mode set to S.");
+                return 0;
 
-                ses->data_socket = sfd;
-                ses->data_conn.port = port;
-                ses->data_conn.mode = MODE_PASSIVE;
+            case 'Z':
+            case 'z':
+                if (ses->server->config.deflate_level == 0)  break;
+                ses->data_conn.transfer_mode = TRANSFER_DEFLATE;
+                respond (ses, 200, "Mode set to Z.");
                 return 0;
-            }
         }
-    }
 
-Fail:
-    respond (ses, 500, "Switching to Passive Mode failed.");
-    TEMP_FAILURE_RETRY (close(sfd));
+    respond (ses, 504, "Unsupported transfer mode.");
     return 0;
 }
 
+/** Opens passive mode listener on given port. */
+static int listen_on_port(int port)
+{
+    int sfd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd == -1)  return -1;
+
+    // previous data connection on the port may be lingering in TIME_WAIT
+    int on = 1;
+    setsockopt (sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in sin;
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if (bind(sfd, (struct sockaddr*)&sin, sizeof(struct sockaddr_in)) == -1 || listen(sfd, BACKLOG) == -1)
+    {
+        int err = errno;
+        TEMP_FAILURE_RETRY(close(sfd));
+        errno = err;    return -1;
+    }
+    return sfd;
+}
 
-int process_LIST(struct session* ses, const char* data)
+int process_PASV(struct session* ses, const char* data)
 {
-    if (open_data_connection(ses) != -1)
+    if (ses->data_socket != -1) close_data_connection (ses);    // previous one wasn't used
+
+    // advertise configured public address, or the one client has connected to
+    struct sockaddr_in sin;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    const char* address = ses->server->config.pasv_address;
+    if (*address)   inet_aton (address, &sin.sin_addr);
+    else if (getsockname(ses->control_socket, (struct sockaddr*)&sin, &addr_len) == -1)
     {
-        // listing directory via  `ls` command piped to temporary file
-        char cmd[2*MAX_PATH];
-        snprintf (cmd, 2*MAX_PATH, "ls %s \"%s\" | tail -n+2 >%s", LIST_LS_PARAMS, ses->current_dir, LIST_LS_OUTFILE);
-        if (system(cmd) != -1)
-        {
-            respond (ses, 150, "Here comes the directory listing.");
-            if (send_file(ses, LIST_LS_OUTFILE) != -1)
-            {
-                respond (ses, 226, "Directory send OK.");
-                close_data_connection (ses);
+        respond (ses, 500, "Switching to Passive Mode failed.");
+        return 0;
+    }
 
-                unlink (LIST_LS_OUTFILE);
-                return 0;
-            }
+    // ports taken by someone else are skipped for a while and another one is tried
+    int port = -1, sfd = -1, attempts, err = 0;
+    for (attempts = 0; attempts < PORT_BIND_ATTEMPTS && sfd == -1; ++attempts)
+    {
+        if ((port = acquire_port(ses->server->pasv_ports)) == -1)  { err = errno; break; }
+        if ((sfd = listen_on_port(port)) == -1)
+        {
+            err = errno;
+            if (err != EADDRINUSE)  { release_port (ses->server->pasv_ports, port); break; }
+            skip_busy_port (ses->server->pasv_ports, port);
         }
     }
+    if (sfd == -1 && (err == EAGAIN || err == EADDRINUSE))
+    {
+        respond (ses, 421, "No passive ports available, try again later.");
+        return 0;
+    }
+    if (sfd == -1)
+    {
+        respond (ses, 500, "Switching to Passive Mode failed.");
+        return 0;
+    }
 
-    respond (ses, 550, "Directory listing failed.");
+    char ip[MAX_IPv4_LEN];
+    strncpy (ip, inet_ntoa(sin.sin_addr), MAX_IPv4_LEN);
+    char* p; for (p = ip; *p; ++p)    if (*p == '.') *p = ',';    // dots to commas
+
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, "Entering Passive Mode (%s,%i,%i)", ip, port / 256, port % 256);
+    respond (ses, 227, buf);
+
+    pthread_mutex_lock (&(ses->timeout_lock));
+    ses->data_socket = sfd;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+    ses->data_conn.port = port;
+    ses->data_conn.mode = MODE_PASSIVE;
+    ses->data_conn.listening = 1;
+    metrics_passive (1);
     return 0;
 }
 
-int process_RETR(struct session* ses, const char* data)
+
+/** Sets up active mode connection to given address, which must be client's own one
+    (so that server can't be used to attack a third party) and not a privileged port. */
+static int set_active_mode(struct session* ses, struct in_addr addr, int port)
 {
-    if (strlen(data) > 0)
+    struct sockaddr_in peer;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    if (getpeername(ses->control_socket, (struct sockaddr*)&peer, &addr_len) == -1
+        || peer.sin_addr.s_addr != addr.s_addr || port < 1024 || port > 65535)
+        return -1;
+
+    if (ses->data_socket != -1) close_data_connection (ses);    // previous one wasn't used
+    ses->data_conn.mode = MODE_ACTIVE;
+    ses->data_conn.ip = addr.s_addr;
+    ses->data_conn.port = port;
+    return 0;
+}
+
+int process_PORT(struct session* ses, const char* data)
+{
+    unsigned h[4], p[2];
+    int c;
+    char ip[MAX_IPv4_LEN + 4];
+    struct in_addr addr;
+    if (sscanf(data, "%u,%u,%u,%u,%u,%u%n", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1], &c) == 6 && !data[c]
+        && h[0] < 256 && h[1] < 256 && h[2] < 256 && h[3] < 256 && p[0] < 256 && p[1] < 256)
     {
-        char file[MAX_PATH];
-        if (relative_to_absolute_path(ses->current_dir, data, file))
+        snprintf (ip, sizeof(ip), "%u.%u.%u.%u", h[0], h[1], h[2], h[3]);
+        if (inet_aton(ip, &addr) && set_active_mode(ses, addr, p[0] * 256 + p[1]) != -1)
         {
-            struct stat st;
-            if (lstat(file, &st) != -1)
-                if (open_data_connection(ses) != -1)
-                {
-                    char buf[BUF_LEN];
-                    snprintf (buf, BUF_LEN, "Opening BINARY mode data connection for %s.", data);
-                    respond (ses, 150, buf);
-
-                    if (send_file(ses, file) != -1) respond (ses, 226, "Transfer complete.");
-                    else                            respond (ses, 550, "Transfer failed.");
-
-                    close_data_connection (ses);
-                    return 0;
-                }
+            respond (ses, 200, "PORT command successful. Consider using PASV.");
+            return 0;
         }
     }
 
-    respond (ses, 550, "Failed to open file.");
+    respond (ses, 500, "Illegal PORT command.");
     return 0;
 }
 
-int process_STOR(struct session* ses, const char* data)
+int process_EPRT(struct session* ses, const char* data)
 {
-    if (strlen(data) > 0)
+    // |proto|address|port| with any delimiter in place of |
+    char d = *data, proto[8], ip[MAX_IPv4_LEN], port[8];
+    const char* f[4];
+    int i;
+    for (f[0] = data, i = 1; i < 4; ++i)
+        if (!(f[i] = strchr(f[i-1] + 1, d)))    break;
+    if (d && i == 4 && f[1] - f[0] - 1 < (int)sizeof(proto) && f[2] - f[1] - 1 < (int)sizeof(ip)
+        && f[3] - f[2] - 1 < (int)sizeof(port) && f[3][1] == '\0')
     {
-        char file[MAX_PATH];
-        if (relative_to_absolute_path(ses->current_dir, data, file))
-            if (open_data_connection(ses) != -1)
-            {
-                char buf[BUF_LEN];
-                snprintf (buf, BUF_LEN, "Opening BINARY mode data connection for %s.", data);
-                respond (ses, 150, buf);
+        snprintf (proto, sizeof(proto), "%.*s", (int)(f[1] - f[0] - 1), f[0] + 1);
+        snprintf (ip, sizeof(ip), "%.*s", (int)(f[2] - f[1] - 1), f[1] + 1);
+        snprintf (port, sizeof(port), "%.*s", (int)(f[3] - f[2] - 1), f[2] + 1);
 
-                if (receive_file(ses, file) != -1)  respond (ses, 226, "Transfer complete.");
-                else                                respond (ses, 550, "Transfer failed.");
+        if (strcmp(proto, "1") != 0)
+        {
+            respond (ses, 522, "Network protocol not supported, use (1)");
+            return 0;
+        }
 
-                close_data_connection (ses);
-                return 0;
-            }
+        char* end;
+        long n = strtol(port, &end, 10);
+        struct in_addr addr;
+        if (*port && !*end && inet_aton(ip, &addr) && set_active_mode(ses, addr, (int)n) != -1)
+        {
+            respond (ses, 200, "EPRT command successful. Consider using EPSV.");
+            return 0;
+        }
     }
 
-    respond (ses, 553, "Could not create file.");
+    respond (ses, 500, "Illegal EPRT command.");
     return 0;
 }
 
-/*****************************************************************************/
-
-// pointer to function that processed FTP command
-typedef int (*FTP_CMD_PROC)(struct session*, const char* data);
-
-// mapping of FTP commands to functions that process them
-#define FC(x)  { #x, process_##x }
-const struct { const char* cmd; FTP_CMD_PROC proc; }
-FTP_CMD_PROCES[] = {
-    FC(USER), FC(PASS), FC(QUIT),
-    FC(FEAT), FC(SYST),
-    FC(PWD), FC(CDUP), FC(CWD), FC(MKD), FC(RMD),
-    FC(DELE), FC(RNFR), FC(RNTO),
-    FC(TYPE), FC(PASV), //FC(PORT),
-    FC(LIST), FC(RETR), FC(STOR),
-};
 
-int process_ftp_command(struct session* ses, const char* cmd)
+/** Resolves path given as listing command's argument (which may be preceded
+    by `ls` options, like in "LIST -la dir"). No path means current directory. */
+static char* listing_path(struct session* ses, const char* data, char* out)
 {
-    if (!ses || !cmd)   { errno = EFAULT; return -1; }
+    while (*data == '-')
+    {
+        while (*data && !isspace(*data))    ++data;
+        while (isspace(*data))              ++data;
+    }
 
-    int cmd_len = strlen(cmd);
-    char* buf = (char*)malloc((cmd_len + 1) * sizeof(char));
-    if (!buf)   return -1;
-    strcpy (buf, cmd);
+    if (!*data)     { strncpy (out, ses->current_dir, MAX_PATH); return out; }
 
-    // change first whitespace to \0 in order to extract command
-    char* p;
-    for (p = buf; *p; ++p)
-        if (isspace(*p))  { *p = '\0'; break; }
-    char* cmd_data = buf + strlen(buf) + 1;
+    const char* ref = *data == '/' ? ses->server->config.root_dir : ses->current_dir;
+    return relative_to_absolute_path(ref, data, out);
+}
 
-    // look up the command in table
-    int i;
-    for (i = 0; i < ARRAY_LEN(FTP_CMD_PROCES); ++i)
-        if (strcmp(buf, FTP_CMD_PROCES[i].cmd) == 0)
+/** Replies to a transfer command whose data connection couldn't be opened
+    (see open_data_connection()); this is the command's final reply. */
+static void refuse_transfer(struct session* ses)
+{
+    if (errno == ENOTCONN)  respond (ses, 425, "Use PORT or PASV first.");
+    else                    respond (ses, 425, "Can't open data connection.");
+}
+
+/** Sends directory listing in given format through data connection. */
+static int send_listing_reply(struct session* ses, const char* data, int format)
+{
+    char path[MAX_PATH];
+    if (listing_path(ses, data, path))
+    {
+        if (open_data_connection(ses) == -1)
         {
-            if ((*FTP_CMD_PROCES[i].proc)(ses, cmd_data) == -1)
-                return -1;
+            refuse_transfer (ses);
+            return 0;
+        }
 
-            strncpy (ses->last_cmd, buf, MAX_FTP_CMD_LEN);
-            strncpy (ses->last_cmd_data, cmd_data, MAX_PATH);
+        respond (ses, 150, "Here comes the directory listing.");
+        if (send_listing(ses, path, format) != -1)
+        {
+            respond (ses, 226, "Directory send OK.");
+            close_data_connection (ses);
             return 0;
         }
+        close_data_connection (ses);
+    }
 
-    return -1;
+    respond (ses, 550, "Directory listing failed.");
+    return 0;
 }
 
-
-/******************************************************************************
- * Worker functions for threads
- */
-
-int send_welcome_message(struct session* ses)
+int process_LIST(struct session* ses, const char* data)
 {
-    static const char motd[] = "REEFS\n(Rather Eerie Example of FTP Server)\nv%s\n"
-                               "End of MOTD";
+    return send_listing_reply(ses, data, LIST_FORMAT_LS);
+}
 
-    char buf[BUF_LEN];
-    snprintf (buf, BUF_LEN, motd, VERSION);
-    return respond(ses, 211, buf);
+int process_NLST(struct session* ses, const char* data)
+{
+    return send_listing_reply(ses, data, LIST_FORMAT_NAMES);
 }
 
-int open_data_connection(struct session* ses)
+int process_MLSD(struct session* ses, const char* data)
 {
-    if (!ses)                       { errno = EFAULT; return -1; }
-    if (ses->data_socket == -1)     { errno = EBADF;  return -1; }
+    return send_listing_reply(ses, data, LIST_FORMAT_FACTS);
+}
 
-    switch (ses->data_conn.mode)
+int process_MLST(struct session* ses, const char* data)
+{
+    char path[MAX_PATH];
+    struct stat st;
+    if (listing_path(ses, data, path) && lstat(path, &st) != -1)
     {
-        case MODE_NONE:
-            respond (ses, 425, "Use PORT or PASV first.");
-            errno = EINVAL;
-            return -1;
-
-        case MODE_ACTIVE:
-            errno = EINVAL; // active mode is not supported
-            return -1;
-
-        case MODE_PASSIVE:
+        char name[MAX_PATH], facts[BUF_LEN];
+        absolute_to_relative_path (ses->server->config.root_dir, path, name);
+        format_facts (&st, facts, BUF_LEN);
+
+        // room for both names, facts and the text around them
+        char buf[BUF_LEN + 2*MAX_PATH + 16];
+        int c = snprintf(buf, sizeof(buf), "Listing %s\n%s%s\nEnd", name, facts, name);
+        if (c >= 0 && (size_t)c < sizeof(buf))
         {
-            int sfd = TEMP_FAILURE_RETRY(accept(ses->data_socket, NULL, NULL));
-            if (sfd == -1)  return -1;
-
-            // replacing the listening socket with data connection socket
-            if (TEMP_FAILURE_RETRY(close(ses->data_socket)) == -1)  return -1;
-            ses->data_socket = sfd;
+            respond (ses, 250, buf);
+            return 0;
         }
-        return 0;
-
-        default:            return -1;
     }
+
+    respond (ses, 550, "Could not get file information.");
+    return 0;
 }
 
-int close_data_connection(struct session* ses)
+int process_REST(struct session* ses, const char* data)
 {
-    if (!ses)   { errno = EFAULT;   return -1; }
+    char* end;
+    errno = 0;
+    long long offset = strtoll(data, &end, 10);
+    if (errno || end == data || *end || offset < 0)
+    {
+        respond (ses, 501, "REST requires a non-negative byte offset.");
+        return 0;
+    }
 
-    shutdown (ses->data_socket, SHUT_RDWR);
-    TEMP_FAILURE_RETRY(close(ses->data_socket));
+    ses->restart_offset = (off_t)offset;
 
-    ses->data_conn.mode = MODE_NONE;
-    ses->data_socket = -1;
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, "Restarting at %lld. Send STOR or RETR to initiate transfer.", offset);
+    respond (ses, 350, buf);
     return 0;
 }
 
-int send_file(struct session* ses, const char* file)
+int process_SIZE(struct session* ses, const char* data)
 {
-    if (!ses)                   { errno = EFAULT; return -1; }
-    if (ses->data_socket == -1) { errno = EBADF; return -1; }
-
-    int fd = TEMP_FAILURE_RETRY(open(file, O_RDONLY));
-    if (fd != -1)
+    char file[MAX_PATH];
+    struct stat st;
+    if (relative_to_absolute_path(ses->current_dir, data, file) && stat(file, &st) != -1 && S_ISREG(st.st_mode))
     {
         char buf[BUF_LEN];
-        ssize_t c;
-
-        while ((c = read_data(fd, buf, BUF_LEN)) != -1)
-        {
-            c = write_data(ses->data_socket, buf, c);
-            if (c == -1)
-            {
-                if (errno == EPIPE || errno == ECONNRESET)  ses->terminated = 1;
-                else                                        return -1;
-            }
-            if (c < BUF_LEN) break;
-        }
+        snprintf (buf, BUF_LEN, "%lld", (long long)st.st_size);
+        respond (ses, 213, buf);
     }
+    else    respond (ses, 550, "Could not get file size.");
 
-    return TEMP_FAILURE_RETRY(close(fd));
+    return 0;
 }
 
-int receive_file(struct session* ses, const char* file)
+/** Replies with checksum of the file: in HASH format (with algorithm, range and file name)
+    or in XCRC/XMD5/XSHA256 one (just the checksum). */
+static int reply_digest(struct session* ses, const char* data, int algorithm, int hash)
 {
-    if (!ses)                   { errno = EFAULT; return -1; }
-    if (ses->data_socket == -1) { errno = EBADF; return -1; }
-
-    int fd = TEMP_FAILURE_RETRY(open(file, O_WRONLY | O_CREAT, 0755));
-    if (fd == -1)   return -1;
-
-    char buf[BUF_LEN];
-    ssize_t c = -1;
-
-    fd_set fds;
-    int res;
-    for (;;)
+    char file[MAX_PATH], hex[MAX_DIGEST_HEX];
+    off_t size;
+    if (!relative_to_absolute_path(ses->current_dir, data, file)
+        || file_digest(ses, file, algorithm, hex, &size) == -1)
     {
-        FD_ZERO (&fds); FD_SET (ses->data_socket, &fds);
-        res = select(ses->data_socket + 1, &fds, NULL, NULL, NULL);
-        if (res == -1)
-        {
-            if (errno != EINTR) return -1;
-            continue;
-        }
-        if (res == 0)   continue;
-
-        c = read_data(ses->data_socket, buf, BUF_LEN);
-        if (c == 0 || c == -1)  break; // end of file (connection) or error
+        respond (ses, 550, "Could not compute checksum.");
+        return 0;
+    }
 
-        if (write_data(fd, buf, c) < c) return -1;
+    if (hash)
+    {
+        // range is inclusive like RANG's; an empty file has none, so it's `1-0` (start past end)
+        char buf[BUF_LEN];
+        if (size > 0)   snprintf (buf, BUF_LEN, "%s 0-%lld %s %s", digest_name(algorithm), (long long)size - 1, hex, data);
+        else            snprintf (buf, BUF_LEN, "%s 1-0 %s %s", digest_name(algorithm), hex, data);
+        respond (ses, 213, buf);
     }
+    else    respond (ses, 250, hex);
+    return 0;
+}
 
-    if (TEMP_FAILURE_RETRY(close(fd)) == -1)    return -1;
-    return c;
+int process_HASH(struct session* ses, const char* data)
+{
+    return reply_digest(ses, data, ses->hash_algorithm, 1);
 }
 
-/*****************************************************************************/
+int process_XCRC(struct session* ses, const char* data)
+{
+    return reply_digest(ses, data, DIGEST_CRC32, 0);
+}
 
-/** Main loop for thread that services the control connection of FTP session. */
-int control_thread_loop(struct control_thread_info* cti)
+int process_XMD5(struct session* ses, const char* data)
 {
-    int sfd = cti->session->control_socket;
-    fd_set fds;
-    int res;
+    return reply_digest(ses, data, DIGEST_MD5, 0);
+}
 
-    while (!cti->session->terminated && !terminating)
-    {
-        FD_ZERO (&fds); FD_SET (sfd, &fds);
-        res = select(sfd + 1, &fds, NULL, NULL, NULL);
-        if (res == -1)
-        {
-            if (errno != EINTR) FATAL("Waiting for input on control connection socket.");
-            continue;
-        }
-        if (res == 0)   continue;
+int process_XSHA256(struct session* ses, const char* data)
+{
+    return reply_digest(ses, data, DIGEST_SHA256, 0);
+}
 
-        char* line = read_line(sfd);
-        if (!line || strlen(line) == 0)
+int process_OPTS(struct session* ses, const char* data)
+{
+    if (strncasecmp(data, "HASH", 4) == 0 && (data[4] == '\0' || data[4] == ' '))
+    {
+        // selects algorithm of HASH, or tells which one it is
+        const char* name;
+        for (name = data + 4; *name == ' '; ++name) { }
+        if (*name)
         {
-            free(line);
-            respond (cti->session, 500, "Connection lost.");
-            cti->session->terminated = 1;
-            break;
+            int a = digest_algorithm(name);
+            if (a == -1)
+            {
+                respond (ses, 501, "Unknown algorithm.");
+                return 0;
+            }
+            ses->hash_algorithm = a;
         }
-        log_command (cti->session, line);
-
-        if (process_ftp_command(cti->session, line) == -1)
-            respond (cti->session, 500, "Unknown or invalid command.");
+        respond (ses, 200, digest_name(ses->hash_algorithm));
+        return 0;
     }
 
+    respond (ses, 501, "Option not understood.");
     return 0;
 }
 
-/** Worker function for thread that manages the control connection of FTP session. */
-void* control_thread_proc(void* info)
+int process_RANG(struct session* ses, const char* data)
 {
-    struct control_thread_info* cti = (struct control_thread_info*)info;
-
-    // set appropriate signal mask for this thread
-    sigset_t sigs;  sigemptyset (&sigs);
-    sigaddset (&sigs, SIGINT);
-    sigaddset (&sigs, SIGPIPE);
-    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
-
-    if (send_welcome_message(cti->session) == -1)
-        cti->session->terminated = 1;
-
-    control_thread_loop (cti);
-
-    char buf[MAX_PATH];
-    snprintf (buf, MAX_PATH, "Client `%s` disconnected.", cti->session->ip_address);
-    log_event (cti->session->server, buf);
+    if (ses->server->config.max_segments == 0)
+    {
+        respond (ses, 502, "Byte ranges are disabled.");
+        return 0;
+    }
 
-    // end the control connection
-    int sfd = cti->session->control_socket;
-    shutdown (sfd, SHUT_RDWR);
-    TEMP_FAILURE_RETRY(close(sfd));
+    long long start, end;
+    int c;
+    if (sscanf(data, "%lld %lld%n", &start, &end, &c) != 2 || data[c] || start < 0 || end < 0)
+    {
+        respond (ses, 501, "RANG requires start and end byte offsets.");
+        return 0;
+    }
 
-    // end the data connection if any
-    int dfd = cti->session->data_socket;
-    if (!(dfd < 0))
+    char buf[BUF_LEN];
+    if (start == 1 && end == 0)
     {
-        shutdown (dfd, SHUT_RDWR);
-        TEMP_FAILURE_RETRY(close(dfd));
+        // resets the range
+        ses->range_start = 0;
+        ses->range_end = -1;
+        respond (ses, 350, "Resetting byte range.");
+        return 0;
+    }
+    if (end < start)
+    {
+        respond (ses, 501, "Byte range ends before it starts.");
+        return 0;
     }
 
+    ses->range_start = (off_t)start;
+    ses->range_end = (off_t)end;
+    snprintf (buf, BUF_LEN, "Restarting at %lld. End byte range at %lld.", start, end);
+    respond (ses, 350, buf);
+    return 0;
+}
+
+/** Starts sending the byte range set by RANG in background, so that client can request
+    another range (over another passive connection) while this one is being transferred. */
+static int retrieve_segment(struct session* ses, const char* data, const char* file, const struct stat* st)
+{
+    off_t start = ses->range_start, end = ses->range_end;
+    ses->range_start = 0;
+    ses->range_end = -1;
+
+    if (ses->data_conn.transfer_mode == TRANSFER_DEFLATE)
+    {
+        respond (ses, 504, "Byte ranges are not supported in MODE Z.");
+        return 0;
+    }
+    if (ses->data_conn.type == TYPE_ASCII)
+    {
+        respond (ses, 504, "Byte ranges are not supported in ASCII mode.");
+        return 0;
+    }
+    if (start >= st->st_size)
+    {
+        respond (ses, 554, "Byte range starts past the end of file.");
+        return 0;
+    }
+    if (end >= st->st_size) end = st->st_size - 1;
+    if (ses->data_socket == -1 || !ses->data_conn.listening)
+    {
+        respond (ses, 425, "Use PASV first.");
+        return 0;
+    }
+
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, "Opening BINARY mode data connection for %s (bytes %lld-%lld).",
+              data, (long long)start, (long long)end);
+    if (start_segment(ses, file, start, end - start + 1, buf) == -1)
+    {
+        if (errno == EBUSY) respond (ses, 425, "Too many concurrent segments.");
+        else                respond (ses, 425, "Can't start the transfer.");
+    }
+    return 0;
+}
+
+int process_RETR(struct session* ses, const char* data)
+{
+    // restart offset applies to this transfer only
+    off_t offset = ses->restart_offset;
+    ses->restart_offset = 0;
+
+    if (strlen(data) > 0)
+    {
+        char file[MAX_PATH];
+        if (relative_to_absolute_path(ses->current_dir, data, file))
+        {
+            struct stat st;
+            if (lstat(file, &st) != -1)
+            {
+                if (ses->range_end != -1)
+                    return retrieve_segment(ses, data, file, &st);
+                if (offset > st.st_size)
+                {
+                    respond (ses, 554, "Restart offset is past the end of file.");
+                    return 0;
+                }
+                if (open_data_connection(ses) == -1)
+                {
+                    refuse_transfer (ses);
+                    return 0;
+                }
+
+                char buf[BUF_LEN];
+                snprintf (buf, BUF_LEN, "Opening BINARY mode data connection for %s.", data);
+                respond (ses, 150, buf);
+
+                if (send_file(ses, file, &st, offset) != -1)    respond (ses, 226, "Transfer complete.");
+                else                                            respond (ses, 550, "Transfer failed.");
+
+                close_data_connection (ses);
+                return 0;
+            }
+        }
+    }
+
+    respond (ses, 550, "Failed to open file.");
+    return 0;
+}
+
+/** Common part of STOR and APPE. Receives the file from offset set by REST (STOR) or appends to it (APPE). */
+static int store_file(struct session* ses, const char* data, int append)
+{
+    off_t offset = ses->restart_offset;
+    ses->restart_offset = 0;
+
+    if (strlen(data) > 0)
+    {
+        char file[MAX_PATH];
+        if (relative_to_absolute_path(ses->current_dir, data, file))
+        {
+            // resumed upload must continue the part that's already there
+            struct stat st;
+            if (!append && offset > 0 && (stat(file, &st) == -1 || offset > st.st_size))
+            {
+                respond (ses, 554, "Restart offset is past the end of file.");
+                return 0;
+            }
+            if (open_data_connection(ses) == -1)
+            {
+                refuse_transfer (ses);
+                return 0;
+            }
+
+            char buf[BUF_LEN];
+            snprintf (buf, BUF_LEN, "Opening BINARY mode data connection for %s.", data);
+            respond (ses, 150, buf);
+
+            if (receive_file(ses, file, append ? 0 : offset, append) != -1)
+                respond (ses, 226, "Transfer complete.");
+            else
+                respond (ses, 550, "Transfer failed.");
+
+            close_data_connection (ses);
+            return 0;
+        }
+    }
+
+    respond (ses, 553, "Could not create file.");
+    return 0;
+}
+
+int process_STOR(struct session* ses, const char* data)
+{
+    return store_file(ses, data, 0);
+}
+
+int process_APPE(struct session* ses, const char* data)
+{
+    return store_file(ses, data, 1);
+}
+
+/*****************************************************************************/
+
+// pointer to function that processed FTP command
+typedef int (*FTP_CMD_PROC)(struct session*, const char* data);
+
+// FTP commands: name, letters of the verb (padded with zeros) and what arguments it takes
+#define FTP_COMMANDS(X) \
+    X(USER, 'U','S','E','R', ARGS_REQUIRED) \
+    X(PASS, 'P','A','S','S', ARGS_OPTIONAL) \
+    X(QUIT, 'Q','U','I','T', ARGS_NONE)     \
+    X(FEAT, 'F','E','A','T', ARGS_NONE)     \
+    X(SYST, 'S','Y','S','T', ARGS_NONE)     \
+    X(STAT, 'S','T','A','T', ARGS_OPTIONAL) \
+    X(PWD,  'P','W','D', 0,  ARGS_NONE)     \
+    X(CDUP, 'C','D','U','P', ARGS_NONE)     \
+    X(CWD,  'C','W','D', 0,  ARGS_REQUIRED) \
+    X(MKD,  'M','K','D', 0,  ARGS_REQUIRED) \
+    X(RMD,  'R','M','D', 0,  ARGS_REQUIRED) \
+    X(DELE, 'D','E','L','E', ARGS_REQUIRED) \
+    X(RNFR, 'R','N','F','R', ARGS_REQUIRED) \
+    X(RNTO, 'R','N','T','O', ARGS_REQUIRED) \
+    X(TYPE, 'T','Y','P','E', ARGS_REQUIRED) \
+    X(MODE, 'M','O','D','E', ARGS_REQUIRED) \
+    X(PASV, 'P','A','S','V', ARGS_NONE)     \
+    X(PORT, 'P','O','R','T', ARGS_REQUIRED) \
+    X(EPRT, 'E','P','R','T', ARGS_REQUIRED) \
+    X(LIST, 'L','I','S','T', ARGS_OPTIONAL) \
+    X(NLST, 'N','L','S','T', ARGS_OPTIONAL) \
+    X(MLSD, 'M','L','S','D', ARGS_OPTIONAL) \
+    X(MLST, 'M','L','S','T', ARGS_OPTIONAL) \
+    X(SIZE, 'S','I','Z','E', ARGS_REQUIRED) \
+    X(REST, 'R','E','S','T', ARGS_REQUIRED) \
+    X(RANG, 'R','A','N','G', ARGS_REQUIRED) \
+    X(RETR, 'R','E','T','R', ARGS_REQUIRED) \
+    X(STOR, 'S','T','O','R', ARGS_REQUIRED) \
+    X(APPE, 'A','P','P','E', ARGS_REQUIRED) \
+    X(OPTS, 'O','P','T','S', ARGS_REQUIRED) \
+    X(HASH, 'H','A','S','H', ARGS_REQUIRED) \
+    X(XCRC, 'X','C','R','C', ARGS_REQUIRED) \
+    X(XMD5, 'X','M','D','5', ARGS_REQUIRED)
+
+// commands with verbs longer than four letters: the first four, and the rest
+#define FTP_LONG_COMMANDS(X) \
+    X(XSHA256, 'X','S','H','A', "256", ARGS_REQUIRED)
+
+// verb packed into a single integer, so that it can be dispatched with switch
+#define FTP_VERB(a, b, c, d)  ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+enum
+{
+#define X(name, a, b, c, d, args)   CMD_##name,
+#define XL(name, a, b, c, d, rest, args)    CMD_##name,
+    FTP_COMMANDS(X)
+    FTP_LONG_COMMANDS(XL)
+#undef X
+#undef XL
+    FTP_COMMANDS_COUNT
+};
+
+// mapping of FTP commands to functions that process them
+const struct { const char* cmd; FTP_CMD_PROC proc; int args; }
+FTP_CMD_PROCES[] = {
+#define X(name, a, b, c, d, args)   { #name, process_##name, args },
+#define XL(name, a, b, c, d, rest, args)    { #name, process_##name, args },
+    FTP_COMMANDS(X)
+    FTP_LONG_COMMANDS(XL)
+#undef X
+#undef XL
+};
+
+/** Finds the command that given line starts with (case-insensitively) without copying it.
+    Returns command's index and points data at its arguments, or -1 if command is unknown. */
+int parse_ftp_command(const char* line, const char** data)
+{
+    uint32_t verb = 0;
+    int i;
+    for (i = 0; i < 4 && line[i] && line[i] != ' ' && line[i] != '\t'; ++i)
+    {
+        if (!isalnum((unsigned char)line[i]))  return -1;
+        verb = verb << 8 | toupper((unsigned char)line[i]);
+    }
+    if (i < 4)  verb <<= 8 * (4 - i);
+
+    // the rest of longer verb
+    const char* rest = line + i;
+    for (; line[i] && line[i] != ' ' && line[i] != '\t'; ++i)
+        if (!isalnum((unsigned char)line[i]) || i >= MAX_FTP_CMD_LEN - 1)  return -1;
+    size_t rest_len = line + i - rest;
+    if (i == 0) return -1;  // no verb
+
+    *data = line[i] ? line + i + 1 : line + i;  // command without data gets empty string
+    if (rest_len == 0)
+        switch (verb)
+        {
+#define X(name, a, b, c, d, args)   case FTP_VERB(a, b, c, d):  return CMD_##name;
+            FTP_COMMANDS(X)
+#undef X
+        }
+    else
+        switch (verb)
+        {
+#define XL(name, a, b, c, d, r, args)   case FTP_VERB(a, b, c, d): \
+            if (rest_len == sizeof(r) - 1 && strncasecmp(rest, r, rest_len) == 0)  return CMD_##name; \
+            break;
+            FTP_LONG_COMMANDS(XL)
+#undef XL
+        }
+    return -1;
+}
+
+/** Checks command's arguments against what it takes. */
+static int valid_arguments(int cmd, const char* data)
+{
+    const char* p;
+    for (p = data; *p == ' '; ++p) { }
+
+    switch (FTP_CMD_PROCES[cmd].args)
+    {
+        case ARGS_NONE:     return *p == '\0';
+        case ARGS_REQUIRED: if (*p == '\0')  return 0;
+                            // fall through
+        default:            return strlen(data) < MAX_PATH;
+    }
+}
+
+int process_ftp_command(struct session* ses, const char* cmd)
+{
+    if (!ses || !cmd)   { errno = EFAULT; return -1; }
+
+    const char* data;
+    int i = parse_ftp_command(cmd, &data);
+    if (i == -1)    return -1;
+
+    if (!valid_arguments(i, data))
+    {
+        respond (ses, 501, "Syntax error in parameters or arguments.");
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    int res = (*FTP_CMD_PROCES[i].proc)(ses, data);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    metrics_command (i, &start, &end);
+    if (res == -1)  return -1;
+
+    strncpy (ses->last_cmd, FTP_CMD_PROCES[i].cmd, MAX_FTP_CMD_LEN);
+    strncpy (ses->last_cmd_data, data, MAX_PATH);
+    return 0;
+}
+
+const char* ftp_command_name(int cmd)
+{
+    return cmd >= 0 && cmd < FTP_COMMANDS_COUNT ? FTP_CMD_PROCES[cmd].cmd : NULL;
+}
+
+int ftp_commands_count()
+{
+    return FTP_COMMANDS_COUNT;
+}
+
+
+/******************************************************************************
+ * Worker functions for threads
+ */
+
+int send_welcome_message(struct session* ses)
+{
+    return respond_rendered(ses, ses->server->motd_reply, ses->server->motd_len);
+}
+
+/** Renders replies that never change, once for the whole server. */
+int render_static_replies(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    static const char motd[] = "REEFS\n(Rather Eerie Example of FTP Server)\nv%s\n"
+                               "End of MOTD";
+    static const char features[] = "Features:\nPASV\nREST STREAM\nRANG STREAM\nSIZE\n%s"
+                                   "MLST type*;size*;modify*;perm*;UNIX.mode*;\nHASH %s\nXCRC\nXMD5\nXSHA256\nEnd";
+
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, motd, VERSION);
+    int c;
+    if ((c = render_reply(serv->motd_reply, BUF_LEN, 211, buf)) == -1)        return -1;
+    serv->motd_len = c;
+
+    // HASH feature marks the selected algorithm, so there's a reply for each of them
+    char feat[FEAT_REPLY_LEN];
+    int a, i;
+    for (a = 0; a < DIGEST_ALGORITHMS; ++a)
+    {
+        char algorithms[64];
+        size_t len = 0;
+        for (i = 0; i < DIGEST_ALGORITHMS; ++i)
+        {
+            c = snprintf(algorithms + len, sizeof(algorithms) - len, "%s%s%s",
+                         i > 0 ? ";" : "", digest_name(i), i == a ? "*" : "");
+            if (c < 0 || (size_t)c >= sizeof(algorithms) - len)  { errno = EMSGSIZE; return -1; }
+            len += c;
+        }
+        c = snprintf(feat, sizeof(feat), features, serv->config.deflate_level > 0 ? "MODE Z\n" : "", algorithms);
+        if (c < 0 || (size_t)c >= sizeof(feat))  { errno = EMSGSIZE; return -1; }
+        if ((c = render_reply(serv->feat_reply[a], FEAT_REPLY_LEN, 211, feat)) == -1)     return -1;
+        serv->feat_len[a] = c;
+    }
+
+    return 0;
+}
+
+/** Replaces passive mode listener with the data connection accepted on it. */
+static int take_data_connection(struct session* ses, int sfd)
+{
+    pthread_mutex_lock (&(ses->timeout_lock));
+    int lfd = ses->data_socket;
+    ses->data_socket = sfd;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+    ses->data_conn.listening = 0;
+    metrics_passive (-1);
+    return TEMP_FAILURE_RETRY(close(lfd));
+}
+
+/** Opens data connection set up by PORT or PASV, waiting for the client (PASV)
+    or connecting to it (PORT). Sends no reply: on failure (ENOTCONN if there's
+    no data connection set up) it's up to the caller to send its one final reply.
+    With epoll I/O model the event loop has opened it already (see process_data_ready()). */
+int open_data_connection(struct session* ses)
+{
+    if (!ses)                       { errno = EFAULT; return -1; }
+    if (ses->data_error)
+    {
+        // event loop has failed to open it
+        errno = ses->data_error;
+        ses->data_error = 0;
+        return -1;
+    }
+    if (ses->data_socket == -1 && ses->data_conn.mode != MODE_ACTIVE)   { errno = ENOTCONN; return -1; }
+
+    switch (ses->data_conn.mode)
+    {
+        case MODE_NONE:
+            errno = ENOTCONN;
+            return -1;
+
+        case MODE_ACTIVE:
+            if (flush_output(ses, 0) == -1)  return -1;
+            arm_session_timer (ses, TIMEOUT_DATA);
+            if (ses->data_socket != -1) return 0;   // connected by event loop
+            if (connect_data_connection(ses) == -1)
+            {
+                ses->data_conn.mode = MODE_NONE;    // client has to send another PORT
+                return -1;
+            }
+            return 0;
+
+        case MODE_PASSIVE:
+        {
+            // client may be waiting for replies to earlier commands before it connects
+            if (flush_output(ses, 0) == -1)  return -1;
+
+            arm_session_timer (ses, TIMEOUT_DATA);
+            if (!ses->data_conn.listening)  return 0;   // accepted by event loop
+            int sfd = TEMP_FAILURE_RETRY(accept(ses->data_socket, NULL, NULL));
+            if (sfd == -1)  return -1;
+            return take_data_connection(ses, sfd);
+        }
+
+        default:            return -1;
+    }
+}
+
+/** Starts connecting active mode data connection with a non-blocking connect(), which
+    data_socket is until finish_connect(). Source port is taken from configured range, if any. */
+static int start_connect(struct session* ses)
+{
+    // data connection comes from the address client has connected to
+    struct sockaddr_in local, remote;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    if (getsockname(ses->control_socket, (struct sockaddr*)&local, &addr_len) == -1)    return -1;
+    remote.sin_family = AF_INET;
+    remote.sin_addr.s_addr = ses->data_conn.ip;
+    remote.sin_port = htons(ses->data_conn.port);
+
+    struct port_allocator* ports = ses->server->active_ports;
+    int sfd = -1, port = 0, attempts, err;
+    for (attempts = 0; attempts < PORT_BIND_ATTEMPTS; ++attempts)
+    {
+        if (ports && (port = acquire_port(ports)) == -1)  return -1;
+        local.sin_port = htons(port);
+
+        if ((sfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)   break;
+        int on = 1;
+        setsockopt (sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(sfd, (struct sockaddr*)&local, sizeof(struct sockaddr_in)) != -1
+            && (connect(sfd, (struct sockaddr*)&remote, sizeof(struct sockaddr_in)) != -1 || errno == EINPROGRESS))
+            break;
+
+        // port may be taken (then it's skipped for a while), or still in TIME_WAIT
+        // with the same client address
+        err = errno;
+        TEMP_FAILURE_RETRY(close(sfd));
+        sfd = -1;
+        if (port && err == EADDRINUSE)  skip_busy_port (ports, port);
+        else if (port)                  release_port (ports, port);
+        port = 0;
+        errno = err;
+        if (err != EADDRINUSE && err != EADDRNOTAVAIL)  break;
+    }
+    if (sfd == -1)  return -1;
+
+    pthread_mutex_lock (&(ses->timeout_lock));
+    ses->data_socket = sfd;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+    ses->data_conn.source_port = port;
+    return 0;
+}
+
+/** Finishes connect() started by start_connect() once the socket is writable or has failed.
+    err is the outcome if it's known already (ETIMEDOUT), 0 checks the socket. Connected socket
+    is made blocking for the transfer; failed one is closed and its source port released. */
+static int finish_connect(struct session* ses, int err)
+{
+    int sfd = ses->data_socket;
+    socklen_t len = sizeof(err);
+    struct sockaddr_in peer;
+    socklen_t addr_len = sizeof(peer);
+    if (err == 0 && getsockopt(sfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)    err = errno;
+    // socket shut down by timeout before it has connected reports no error
+    if (err == 0 && getpeername(sfd, (struct sockaddr*)&peer, &addr_len) == -1)   err = ETIMEDOUT;
+
+    // transfers themselves block
+    if (err == 0 && fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) & ~O_NONBLOCK) == -1)  err = errno;
+    if (err == 0)   return 0;
+
+    pthread_mutex_lock (&(ses->timeout_lock));
+    ses->data_socket = -1;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+    TEMP_FAILURE_RETRY(close(sfd));
+    if (ses->data_conn.source_port) release_port (ses->server->active_ports, ses->data_conn.source_port);
+    ses->data_conn.source_port = 0;
+    errno = err;    return -1;
+}
+
+/** Opens active mode data connection, waiting for it at most config.connect_timeout ms.
+    The wait blocks the calling thread, so it must never run on an event loop; with epoll
+    I/O model the loop connects without waiting instead (see wait_data_connection()). */
+int connect_data_connection(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+    if (start_connect(ses) == -1)   return -1;
+
+    struct pollfd pfd = { ses->data_socket, POLLOUT, 0 };
+    int c = TEMP_FAILURE_RETRY(poll(&pfd, 1, ses->server->config.connect_timeout));
+    return finish_connect(ses, c == 0 ? ETIMEDOUT : c == -1 ? errno : 0);
+}
+
+int close_data_connection(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT;   return -1; }
+
+    // timeout may be shutting the socket down meanwhile
+    pthread_mutex_lock (&(ses->timeout_lock));
+    int sfd = ses->data_socket;
+    ses->data_socket = -1;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+
+    shutdown (sfd, SHUT_RDWR);
+    TEMP_FAILURE_RETRY(close(sfd));
+    if (ses->data_conn.listening)   metrics_passive (-1);
+    if (ses->data_conn.mode == MODE_PASSIVE && ses->data_conn.port)
+        release_port (ses->server->pasv_ports, ses->data_conn.port);
+    if (ses->data_conn.mode == MODE_ACTIVE && ses->data_conn.source_port)
+        release_port (ses->server->active_ports, ses->data_conn.source_port);
+
+    ses->data_conn.port = 0;
+    ses->data_conn.source_port = 0;
+    ses->data_conn.mode = MODE_NONE;
+    ses->data_conn.listening = 0;
+    return 0;
+}
+
+/** Sends the file, starting at given offset, through data connection. Binary transfers don't
+    leave the kernel: sendfile() is used if possible, then splice() through a pipe, then plain copying
+    (unless configured backend is io_uring, which is tried first, or plain copying only).
+    In MODE Z, the file is compressed on the way (see send_deflated()), in TYPE A its line ends
+    are converted (see send_ascii()). Otherwise small files are sent from memory, if they're
+    in the cache of hot files (see send_hot_file(); st is what lstat() said about the file).
+    Sessions with bandwidth limits send by sendfile() in pieces their buckets allow (see throttle.c). */
+int send_file(struct session* ses, const char* file, const struct stat* st, off_t offset)
+{
+    if (!ses)                   { errno = EFAULT; return -1; }
+    if (ses->data_socket == -1) { errno = EBADF; return -1; }
+
+    if (st && ses->data_conn.transfer_mode != TRANSFER_DEFLATE && ses->data_conn.type != TYPE_ASCII)
+    {
+        ssize_t c = send_hot_file(ses, file, st, offset);
+        if (c != -1)    { metrics_bytes (0, c); return 0; }
+        if (errno == EPIPE || errno == ECONNRESET)  { ses->terminated = 1; return 0; }
+        if (errno != EINVAL)    return -1;
+    }
+
+    int fd = TEMP_FAILURE_RETRY(open(file, O_RDONLY | O_CLOEXEC));
+    if (fd == -1)   return -1;
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) == -1)
+    {
+        int err = errno;
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = err;    return -1;
+    }
+
+    size_t chunk = ses->server->config.transfer_chunk;
+    ssize_t c = -1;
+    errno = EINVAL;
+    int backend = ses->server->config.io_backend;
+    if (ses->data_conn.transfer_mode == TRANSFER_DEFLATE)
+        c = send_deflated(ses, fd, offset);
+    else if (ses->data_conn.type == TYPE_ASCII)
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? send_ascii(ses, ses->data_socket, fd, buf, chunk) : -1;
+    }
+    else if (throttling(ses))
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? throttled_send(ses, ses->data_socket, fd, NULL, SIZE_MAX, buf, chunk) : -1;
+    }
+    else if (backend != IO_BACKEND_COPY)
+    {
+        if (backend == IO_BACKEND_URING)
+            c = uring_send(ses->data_socket, fd, chunk);
+        if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+            c = sendfile_data(ses->data_socket, fd);
+        if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+            c = splice_data(ses->data_socket, fd, chunk);
+    }
+    if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? copy_data(ses->data_socket, fd, buf, chunk) : -1;
+    }
+
+    if (c == -1)
+    {
+        if (errno == EPIPE || errno == ECONNRESET)  ses->terminated = 1;
+        else
+        {
+            int err = errno;
+            TEMP_FAILURE_RETRY(close(fd));
+            errno = err;    return -1;
+        }
+    }
+    else    metrics_bytes (0, c);
+
+    return TEMP_FAILURE_RETRY(close(fd));
+}
+
+/** Receives the file from data connection, writing it from given offset on (anything after
+    that is replaced) or appending to it. Data is spliced from socket to file in large chunks
+    (or moved by io_uring, if configured); if that's not possible, it's copied through
+    session's transfer buffer. In MODE Z, it's decompressed, in TYPE A its line ends are
+    converted. Checksums of whole files are computed on the way (see receive_digested()).
+    Sessions with bandwidth limits read from the socket only as much as their buckets allow. */
+int receive_file(struct session* ses, const char* file, off_t offset, int append)
+{
+    if (!ses)                   { errno = EFAULT; return -1; }
+    if (ses->data_socket == -1) { errno = EBADF; return -1; }
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (append)             flags |= O_APPEND;
+    else if (offset == 0)   flags |= O_TRUNC;
+    int fd = TEMP_FAILURE_RETRY(open(file, flags, 0755));
+    if (fd == -1)   return -1;
+    if (offset > 0 && (ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1))
+    {
+        int err = errno;
+        TEMP_FAILURE_RETRY(close(fd));
+        errno = err;    return -1;
+    }
+
+    size_t chunk = ses->server->config.transfer_chunk;
+    ssize_t c = -1;
+    errno = EINVAL;
+    int backend = ses->server->config.io_backend;
+    if (ses->data_conn.transfer_mode == TRANSFER_DEFLATE)
+        c = receive_deflated(ses, fd);
+    else if (ses->data_conn.type == TYPE_ASCII)
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? receive_ascii(ses, fd, ses->data_socket, buf, chunk) : -1;
+    }
+    else if (!append && offset == 0 && ses->server->digests && ses->server->config.upload_digests)
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? receive_digested(ses, fd, ses->data_socket, buf, chunk, ses->server->config.upload_digests) : -1;
+    }
+    else if (throttling(ses))
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? throttled_receive(ses, fd, ses->data_socket, buf, chunk) : -1;
+    }
+    else if (backend != IO_BACKEND_COPY)
+    {
+        if (backend == IO_BACKEND_URING)
+            c = uring_receive(fd, ses->data_socket, chunk, NULL);
+        if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+            c = splice_data(fd, ses->data_socket, chunk);
+    }
+    if (c == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+        char* buf = session_buffer(ses);
+        c = buf ? copy_data(fd, ses->data_socket, buf, chunk) : -1;
+    }
+
+    if (c > 0)  metrics_bytes (c, 0);
+
+    int err = errno;
+    if (TEMP_FAILURE_RETRY(close(fd)) == -1)    return -1;
+    errno = err;
+    return c < 0 ? -1 : 0;
+}
+
+/*****************************************************************************/
+
+/** Reads whatever is available on control connection into session's command buffer,
+    filling as much of it as possible with a single call. Returns the recv() result. */
+static ssize_t fill_command_buffer(struct session* ses, int flags)
+{
+    if (ses->cmd_end == CMD_BUF_LEN - 1)
+    {
+        if (ses->cmd_start > 0)
+        {
+            // move the incomplete line to the front to make room
+            ses->cmd_end -= ses->cmd_start;
+            memmove (ses->cmd_buf, ses->cmd_buf + ses->cmd_start, ses->cmd_end);
+            ses->cmd_start = 0;
+        }
+        else
+        {
+            // line is too long to ever fit into the buffer: drop it up to its end
+            if (!ses->cmd_overflow) respond (ses, 500, "Command too long.");
+            ses->cmd_start = ses->cmd_end = 0;
+            ses->cmd_overflow = 1;
+        }
+    }
+
+    ssize_t c = TEMP_FAILURE_RETRY(recv(ses->control_socket, ses->cmd_buf + ses->cmd_end,
+                                        CMD_BUF_LEN - 1 - ses->cmd_end, flags));
+    if (c > 0)  ses->cmd_end += c;
+    return c;
+}
+
+/** Extracts next complete command line from session's command buffer.
+    Line is terminated in place (without its \r\n) and stays valid until the buffer
+    is filled again. Returns NULL if there is no complete line buffered. */
+static char* next_command_line(struct session* ses)
+{
+    char *line, *eol;
+    while (ses->cmd_start < ses->cmd_end)
+    {
+        line = ses->cmd_buf + ses->cmd_start;
+        if (!(eol = (char*)memchr(line, '\n', ses->cmd_end - ses->cmd_start)))
+            break;
+
+        ses->cmd_start = eol + 1 - ses->cmd_buf;
+        *eol = '\0';
+        if (eol > line && eol[-1] == '\r')  eol[-1] = '\0';
+
+        if (ses->cmd_overflow)  { ses->cmd_overflow = 0; continue; }    // tail of too long line
+        if (*line)              return line;
+    }
+
+    if (ses->cmd_start == ses->cmd_end)
+        ses->cmd_start = ses->cmd_end = 0;  // buffer is empty, start over
+    return NULL;
+}
+
+/** Tells whether the command may block for long (moving data or reading whole files),
+    so that event loop has to hand it over to a transfer thread. Its data connection
+    is opened by the loop beforehand (see wait_data_connection()). */
+static int blocking_command(const char* line)
+{
+    const char* data;
+    switch (parse_ftp_command(line, &data))
+    {
+        case CMD_LIST: case CMD_NLST: case CMD_MLSD:
+        case CMD_RETR: case CMD_STOR: case CMD_APPE:
+        case CMD_HASH: case CMD_XCRC: case CMD_XMD5: case CMD_XSHA256:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/** Tells whether pending transfer command needs a data connection the event loop has
+    to open first. RETR of a byte range leaves the listener to its segment (see start_segment()). */
+static int needs_data_connection(struct session* ses)
+{
+    const char* data;
+    switch (parse_ftp_command(ses->transfer_cmd, &data))
+    {
+        case CMD_LIST: case CMD_NLST: case CMD_MLSD:
+        case CMD_STOR: case CMD_APPE:
+            return 1;
+        case CMD_RETR:
+            return ses->range_end == -1;
+        default:
+            return 0;
+    }
+}
+
+/** Hands the session over to a transfer thread, which runs its pending command. */
+static void submit_transfer(struct session* ses)
+{
+    if (reactor_submit_transfer(ses->server->reactor, ses) == -1)
+    {
+        ses->transfer_pending = 0;
+        ses->terminated = 1;
+    }
+}
+
+/** Starts opening data connection of pending transfer command without blocking the event
+    loop: listener (PASV) or socket connecting to the client (PORT) is watched by the loop,
+    which calls process_data_ready() until the connection is open. Returns -1 if there's
+    nothing to wait for, as there's no data connection set up or connecting has failed
+    right away (data_error tells the transfer thread then). */
+static int wait_data_connection(struct session* ses)
+{
+    if (ses->data_conn.mode == MODE_PASSIVE && ses->data_conn.listening)
+    {
+        arm_session_timer (ses, TIMEOUT_DATA);
+        if (fcntl(ses->data_socket, F_SETFL, fcntl(ses->data_socket, F_GETFL) | O_NONBLOCK) == -1
+            || reactor_watch_data(ses) == -1)
+            { ses->data_error = errno; close_data_connection (ses); return -1; }
+    }
+    else if (ses->data_conn.mode == MODE_ACTIVE && ses->data_socket == -1)
+    {
+        if (start_connect(ses) == -1 || reactor_watch_data(ses) == -1)
+        {
+            if (ses->data_socket != -1) finish_connect (ses, errno);    // closes it
+            ses->data_error = errno;
+            ses->data_conn.mode = MODE_NONE;
+            return -1;
+        }
+
+        // connecting is bounded by its own timeout rather than the data one
+        arm_session_timer (ses, TIMEOUT_DATA);
+        if (ses->server->config.connect_timeout > 0)
+            set_timer (ses->server->timers, &(ses->timer), ses->server->config.connect_timeout);
+    }
+    else    return -1;
+
+    ses->data_pending = 1;
+    return 0;
+}
+
+/** Single step of opening data connection for pending transfer command (epoll model):
+    accepts the client's connection (PASV) or checks whether connect() is done (PORT).
+    Once the connection is open, or has failed, the command goes to a transfer thread. */
+int process_data_ready(struct session* ses)
+{
+    if (!ses)               { errno = EFAULT; return -1; }
+    if (!ses->data_pending) return 0;
+
+    int err = 0;
+    if (ses->data_conn.mode == MODE_PASSIVE)
+    {
+        int sfd = TEMP_FAILURE_RETRY(accept4(ses->data_socket, NULL, NULL, SOCK_CLOEXEC));
+        if (sfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED))
+            return 0;   // not yet
+        reactor_unwatch_data (ses);
+        if (sfd != -1)  take_data_connection (ses, sfd);
+        else
+        {
+            err = errno;
+            close_data_connection (ses);    // client has to send another PASV
+        }
+    }
+    else
+    {
+        struct pollfd pfd = { ses->data_socket, POLLOUT, 0 };
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) == 0)  return 0;   // still connecting
+        reactor_unwatch_data (ses);
+        if (finish_connect(ses, 0) == -1)
+        {
+            err = errno;
+            ses->data_conn.mode = MODE_NONE;    // client has to send another PORT
+        }
+    }
+
+    ses->data_error = err;
+    ses->data_pending = 0;
+    submit_transfer (ses);
+    return 0;
+}
+
+/** Executes all complete commands buffered for the session, which allows clients
+    to pipeline several commands without waiting for replies. */
+static void process_buffered_commands(struct session* ses)
+{
+    // suspended session's commands wait for it to be resumed
+    if (ses->auth_pending || ses->transfer_pending) return;
+
+    // replies are coalesced and sent together once the batch is done
+    char* line;
+    int count = 0;
+    ses->out_corked = 1;
+    while (!ses->terminated && !ses->auth_pending && (line = next_command_line(ses)))
+    {
+        log_command (ses, line);
+        ++count;
+        if (ses->loop && blocking_command(line) && strlen(line) < sizeof(ses->transfer_cmd))
+        {
+            // rest of the batch waits for the transfer thread (too long line fails inline anyway)
+            strcpy (ses->transfer_cmd, line);
+            ses->transfer_pending = 1;
+            break;
+        }
+        if (process_ftp_command(ses, line) == -1)
+            respond (ses, 500, "Unknown or invalid command.");
+    }
+    ses->out_corked = 0;
+    flush_output (ses, 0);
+
+    // only complete commands count as activity; login deadline is never extended
+    if (ses->transfer_pending)
+    {
+        // transfer thread takes the session over only now, as it arms the timer itself
+        if (!needs_data_connection(ses) || wait_data_connection(ses) == -1)
+            submit_transfer (ses);
+    }
+    else if (count > 0 && ses->logged_in)   arm_session_timer (ses, TIMEOUT_IDLE);
+}
+
+/*****************************************************************************/
+
+/** Main loop for thread that services the control connection of FTP session. */
+int control_thread_loop(struct control_thread_info* cti)
+{
+    struct session* ses = cti->session;
+    int sfd = ses->control_socket;
+    fd_set fds;
+    int res;
+
+    while (!ses->terminated && !terminating)
+    {
+        // wake up now and then, so that the session ends soon after the server is terminated
+        struct timeval tv = { SESSION_WAIT_MS / 1000, (SESSION_WAIT_MS % 1000) * 1000 };
+        FD_ZERO (&fds); FD_SET (sfd, &fds);
+        res = select(sfd + 1, &fds, NULL, NULL, &tv);
+        if (res == -1)
+        {
+            if (errno != EINTR) FATAL("Waiting for input on control connection socket.");
+            continue;
+        }
+        if (res == 0)   continue;
+
+        ssize_t c = fill_command_buffer(ses, 0);
+        if (c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))  continue;
+        if (c <= 0)
+        {
+            respond (ses, 500, "Connection lost.");
+            ses->terminated = 1;
+            break;
+        }
+        process_buffered_commands (ses);
+    }
+
+    return 0;
+}
+
+/** Worker function for thread that manages the control connection of FTP session. */
+void* control_thread_proc(void* info)
+{
+    struct control_thread_info* cti = (struct control_thread_info*)info;
+
+    // set appropriate signal mask for this thread
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    if (send_welcome_message(cti->session) == -1)
+        cti->session->terminated = 1;
+
+    control_thread_loop (cti);
+    end_session (cti->session);
+    release_session (cti->session->server->sessions, cti->session);
+
     free (cti);
     return 0;
 }
 
+/** Single step of non-blocking control connection handling (epoll model):
+    reads everything the socket has available and executes complete commands. */
+int process_control_input(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    ssize_t c;
+    while (!ses->terminated)
+    {
+        // suspended session only buffers its input, for as long as there is room
+        if ((ses->auth_pending || ses->transfer_pending) && ses->cmd_end == CMD_BUF_LEN - 1)  break;
+
+        c = fill_command_buffer(ses, MSG_DONTWAIT);
+        if (c == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;   // drained
+            ses->terminated = 1;
+            break;
+        }
+        if (c == 0)
+        {
+            respond (ses, 500, "Connection lost.");
+            ses->terminated = 1;
+            break;
+        }
+
+        process_buffered_commands (ses);
+    }
+
+    return 0;
+}
+
+
+/** Continues the session after its password has been verified or its transfer is done
+    (epoll model): replies to PASS and carries on with commands that were buffered meanwhile. */
+int resume_session(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    if (ses->transfer_pending)
+    {
+        ses->transfer_pending = 0;
+        if (ses->terminated)    return 0;
+    }
+    else
+    {
+        ses->auth_pending = 0;
+        ses->logged_in = ses->auth_ok;
+        if (ses->terminated)    return 0;
+
+        ses->out_corked = 1;    // goes out with replies to the rest of the batch
+        reply_login (ses);
+    }
+
+    // timer is still counting down the login or transfer's data connection
+    if (ses->logged_in) arm_session_timer (ses, TIMEOUT_IDLE);
+    process_buffered_commands (ses);
+    return process_control_input(ses);
+}
+
+/** Runs the command session has been suspended for (epoll model). Called from transfer threads,
+    which own the session until they hand it back to its event loop. */
+int run_transfer(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    if (process_ftp_command(ses, ses->transfer_cmd) == -1)
+        respond (ses, 500, "Unknown or invalid command.");
+
+    // data connection opened for the command, which has failed before using it
+    ses->data_error = 0;
+    if (ses->data_socket != -1 && !ses->data_conn.listening)  close_data_connection (ses);
+    return flush_output(ses, 0);
+}
+
 
 /******************************************************************************
- * FTP session functions
+ * Timeouts
  */
 
-/** Accepts client connection and saves its data to given session struct. */
-int new_session(int sfd, struct session* ses)
+/** Tells how many bytes the data connection has moved so far (both ways). Returns -1
+    if the kernel doesn't say, in which case the connection is never considered stalled. */
+static long long data_progress(int sfd)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset (&ti, 0, sizeof(ti));
+    if (getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1
+        || len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(ti.tcpi_bytes_received))
+        return -1;
+    return (long long)(ti.tcpi_bytes_acked + ti.tcpi_bytes_received);
+}
+
+/** Fired by the timer wheel when session has waited too long. Stalled data connection
+    is shut down, so that the transfer fails; otherwise it's the control connection,
+    which ends the whole session. Either way, the session's own thread takes it from there.
+    Session's lock may be held by a thread stuck sending to the very client that timed out,
+    so only timeout_lock is waited for here. */
+static void session_timeout(struct timer* t)
+{
+    struct session* ses = (struct session*)((char*)t - offsetof(struct session, timer));
+    const char* what = NULL;
+
+    pthread_mutex_lock (&(ses->timeout_lock));
+    if (ses->timer_phase == TIMEOUT_DATA)
+    {
+        long long progress = ses->data_socket != -1 ? data_progress(ses->data_socket) : 0;
+        if (progress == -1 || progress != ses->data_progress)
+        {
+            // still moving: check again later
+            ses->data_progress = progress;
+            set_timer (ses->server->timers, t, ses->server->config.data_timeout * 1000UL);
+        }
+        else if (ses->data_socket != -1)
+        {
+            shutdown (ses->data_socket, SHUT_RDWR);
+            what = "Data connection of client `%s` timed out.";
+        }
+    }
+    else
+    {
+        // best effort: client that doesn't read won't get it, nor will one whose
+        // reply is being sent right now (it mustn't be cut in two)
+        static const char reply[] = "421 Timeout.\r\n";
+        if (pthread_mutex_trylock(&(ses->lock)) == 0)
+        {
+            send (ses->control_socket, reply, sizeof(reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            pthread_mutex_unlock (&(ses->lock));
+        }
+        shutdown (ses->control_socket, SHUT_RDWR);
+        if (ses->data_socket != -1) shutdown (ses->data_socket, SHUT_RDWR);
+        what = ses->timer_phase == TIMEOUT_LOGIN ? "Client `%s` didn't log in in time." : "Client `%s` timed out.";
+    }
+    pthread_mutex_unlock (&(ses->timeout_lock));
+
+    if (what)
+    {
+        char buf[BUF_LEN];
+        snprintf (buf, BUF_LEN, what, ses->ip_address);
+        log_event (ses->server, buf);
+    }
+}
+
+/** (Re)arms session's timer for given phase with the timeout configured for it. */
+void arm_session_timer(struct session* ses, int phase)
 {
-    if (sfd < 0)    { errno = EINVAL; return -1; }
-    if (!ses)       { errno = EFAULT; return -1; }
+    const struct config* cfg = &(ses->server->config);
+    int timeout = phase == TIMEOUT_LOGIN ? cfg->login_timeout
+                : phase == TIMEOUT_IDLE ? cfg->idle_timeout : cfg->data_timeout;
+
+    pthread_mutex_lock (&(ses->timeout_lock));
+    ses->timer_phase = phase;
+    ses->data_progress = 0;
+    pthread_mutex_unlock (&(ses->timeout_lock));
+
+    if (timeout > 0)    set_timer (ses->server->timers, &(ses->timer), timeout * 1000UL);
+    else                cancel_timer (ses->server->timers, &(ses->timer));
+}
+
 
-    int client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(struct sockaddr_in);
-    client_fd = TEMP_FAILURE_RETRY(accept(sfd, (struct sockaddr*)&client_addr, &client_addr_len));
-    if (client_fd == -1)    return -1;
+/******************************************************************************
+ * FTP session functions
+ */
+
+/** Saves data of accepted client connection to given session struct. */
+int new_session(int client_fd, const struct sockaddr_in* client_addr, struct session* ses)
+{
+    if (client_fd < 0)          { errno = EINVAL; return -1; }
+    if (!client_addr || !ses)   { errno = EFAULT; return -1; }
 
     ses->control_socket = client_fd;
     ses->data_socket = -1;          // no data connection initially
-    strncpy (ses->ip_address, inet_ntoa(client_addr.sin_addr), MAX_IPv4_LEN);
+    ses->data_conn.type = TYPE_BINARY;
+    ses->data_conn.transfer_mode = TRANSFER_STREAM;
+    ses->data_conn.mode = MODE_NONE;
+    ses->data_conn.port = 0;
+    ses->data_conn.source_port = 0;
+    ses->data_conn.listening = 0;
+    ses->restart_offset = 0;
+    ses->range_start = 0;
+    ses->range_end = -1;
+    ses->hash_algorithm = DEFAULT_DIGEST;
+    ses->xfer_buf = NULL;
+    ses->cmd_start = ses->cmd_end = 0;
+    ses->cmd_overflow = 0;
+    ses->out_len = 0;
+    ses->out_corked = 0;
+    pthread_mutex_init (&(ses->lock), NULL);
+    pthread_mutex_init (&(ses->timeout_lock), NULL);
+    pthread_cond_init (&(ses->segments_done), NULL);
+    ses->segments_active = 0;
+    ses->segments_aborted = 0;
+    int i;
+    for (i = 0; i < MAX_SEGMENTS; ++i)  ses->segment_sockets[i] = -1;
+    ses->loop = NULL;
+    ses->client = NULL;
+    ses->auth_pending = 0;
+    ses->transfer_pending = 0;
+    ses->data_pending = 0;
+    ses->data_error = 0;
+    init_timer (&(ses->timer), session_timeout);
+    ses->timer_phase = TIMEOUT_LOGIN;
+    ses->data_progress = 0;
+    strncpy (ses->ip_address, inet_ntoa(client_addr->sin_addr), MAX_IPv4_LEN);
     ses->logged_in = 0;
     *(ses->current_dir) = '\0';
     *(ses->last_cmd) = '\0';
@@ -619,9 +1833,24 @@ int new_session(int sfd, struct session* ses)
     return 0;
 }
 
-/** Initiates client session, which includes firing up the thread for control connection. */
+/** Initiates client session, which includes firing up the thread for control connection
+    or handing it over to one of event loops, depending on configured I/O model. */
 int start_session(struct session* ses)
 {
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    // account for the client before its session can possibly end
+    metrics_sessions (1);
+
+    char buf[BUF_LEN];
+    snprintf (buf, BUF_LEN, "Client `%s` connected.", ses->ip_address);
+    log_event (ses->server, buf);
+    init_session_rate (ses);
+    arm_session_timer (ses, TIMEOUT_LOGIN);
+
+    if (ses->server->config.io_model == IO_MODEL_EPOLL)
+        return reactor_add_session(ses->server->reactor, ses);
+
     struct control_thread_info* cti = (struct control_thread_info*)malloc(sizeof(struct control_thread_info));
     if (!cti)   return -1;
     cti->session = ses;
@@ -629,66 +1858,241 @@ int start_session(struct session* ses)
     pthread_attr_t attr;
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-    if (pthread_create(&(ses->control_thread), &attr, control_thread_proc, (void*)cti) == -1)
+    if (pthread_create(&(ses->control_thread), &attr, control_thread_proc, (void*)cti) != 0)
         { free(cti); return -1; }
 
-    char buf[BUF_LEN];
-    snprintf (buf, BUF_LEN, "Client `%s` connected.", ses->ip_address);
+    return 0;
+}
+
+/** Returns session's transfer buffer, allocating it on first use. */
+char* session_buffer(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return NULL; }
+
+    if (!ses->xfer_buf && (ses->xfer_buf = (char*)malloc(ses->server->config.transfer_chunk)))
+        session_pool_account (ses->server->sessions, ses->server->config.transfer_chunk);
+    return ses->xfer_buf;
+}
+
+/** Ends client session, closing its control and data connections. */
+int end_session(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    char buf[MAX_PATH];
+    snprintf (buf, MAX_PATH, "Client `%s` disconnected.", ses->ip_address);
     log_event (ses->server, buf);
+    metrics_sessions (-1);
+
+    // timeout must not touch the session once it's gone
+    cancel_timer (ses->server->timers, &(ses->timer));
+
+    // segments reply over control connection, so they have to be gone before it's closed
+    abort_segments (ses);
+
+    // end the control connection
+    int sfd = ses->control_socket;
+    shutdown (sfd, SHUT_RDWR);
+    TEMP_FAILURE_RETRY(close(sfd));
+
+    // end the data connection if any
+    if (!(ses->data_socket < 0))
+        close_data_connection (ses);
+
+    free_session_rate (ses);
+    leave_client (ses->server, ses->client);
+    ses->client = NULL;
+
+    if (ses->xfer_buf)
+    {
+        free (ses->xfer_buf);
+        ses->xfer_buf = NULL;
+        session_pool_account (ses->server->sessions, -(long)ses->server->config.transfer_chunk);
+    }
 
+    pthread_cond_destroy (&(ses->segments_done));
+    pthread_mutex_destroy (&(ses->lock));
+    pthread_mutex_destroy (&(ses->timeout_lock));
     return 0;
 }
 
 /*****************************************************************************/
 
-int respond(struct session* ses, int code, const char* resp)
+/** Tells how many bytes the reply will take once formatted. */
+static size_t reply_size(const char* resp, size_t* len)
 {
-    if (!ses || !resp)                  { errno = EFAULT; return -1; }
-    if (code < 0 || code > 999)         { errno = EINVAL; return -1; }
+    size_t lines = 1;
+    const char* p;
+    for (p = resp; *p; ++p)
+        if (*p == '\n') ++lines;
+
+    *len = p - resp;
+    return *len + 4 * lines + 1;
+}
 
-    // convert response code to text
-    char code_str[4];
+/** Formats the reply into out (which must have enough room for it). Response format requires
+    having a correct prefixing of response lines:
+    - for single line: code + space
+    - for multiline: code + dash in first line, space in following ones, code + space on last line */
+static size_t format_reply(char* out, int code, const char* resp)
+{
+    char code_str[3];
     code_str[0] = (code / 100) + '0';   code %= 100;
     code_str[1] = (code / 10) + '0';    code %= 10;
     code_str[2] = code + '0';
-    code_str[3] = '\0';
 
-    int len = strlen(resp); if (len < 4) len = 4;
-    char* buf = (char*)malloc((2 * len + 1) * sizeof(char));
-    if (!buf)   return -1;
-
-    // count lines in response
-    int lines = 1; const char* p;
-    for (p = resp; *p; ++p)
-        if (*p == '\n') ++lines;
-
-    // response format requires having a correct prefixing of response lines:
-    // - for single line: code + space
-    // - for multiline: code + dash in first line, space in following ones, code + space on last line
-    int i, j = 0;
-    for (i = 0; i < lines; ++i)
+    char* o = out;
+    const char* eol;
+    for (;;)
     {
-        if (i == 0 || i + 1 == lines)
+        eol = strchrnul(resp, '\n');
+        int first = (o == out), last = (*eol == '\0');
+        if (first || last)
         {
-            strcpy (buf + j, code_str); j += strlen(code_str);
-            buf[j++] = (i == 0 && lines > 1 ? '-' : ' ');
+            memcpy (o, code_str, 3);    o += 3;
+            *o++ = (first && !last ? '-' : ' ');
         }
-        else    buf[j++] = ' ';
+        else    *o++ = ' ';
 
-        for (; *resp && *resp != '\n'; ++resp)
-            buf[j++] = *resp;
-        buf[j++] = '\n';
-        ++resp; // jump through \n in response
+        memcpy (o, resp, eol - resp);   o += eol - resp;
+        *o++ = '\n';
+        if (last)   break;
+        resp = eol + 1;
     }
-    buf[j] = '\0';  // this \0 goes to log but not to client
 
-    if (write_data(ses->control_socket, buf, (size_t)j) < 0)
+    return o - out;
+}
+
+/** Pre-renders the reply, for replies that are always the same. */
+int render_reply(char* out, size_t cap, int code, const char* resp)
+{
+    if (!out || !resp)          { errno = EFAULT; return -1; }
+    if (code < 0 || code > 999) { errno = EINVAL; return -1; }
+
+    size_t len;
+    if (reply_size(resp, &len) > cap)   { errno = EMSGSIZE; return -1; }
+    return format_reply(out, code, resp);
+}
+
+/** Sends len bytes over control connection. Caller holds session's lock. */
+static int send_control(struct session* ses, const char* buf, size_t len, int more)
+{
+    ssize_t c;
+    while (len > 0)
     {
-        if (errno == EPIPE || errno == ECONNRESET)  ses->terminated = 1;
-        else                                        return -1;
+        c = TEMP_FAILURE_RETRY(send(ses->control_socket, buf, len, more ? MSG_MORE : 0));
+        // event loop's sessions share the thread (or the lock) with others, so they don't wait for long
+        if (c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)
+            && wait_writable(ses->control_socket, ses->loop ? CONTROL_WAIT_MS : -1) != -1)
+            continue;
+        if (c == -1)
+        {
+            if (errno == ETIMEDOUT)     shutdown (ses->control_socket, SHUT_RDWR);  // client doesn't read replies
+            else if (errno != EPIPE && errno != ECONNRESET) return -1;
+            ses->terminated = 1;
+            return 0;
+        }
+        buf += c;
+        len -= c;
     }
-    if (log_response(ses, buf) == -1)                           return -1;
 
-    free (buf);
     return 0;
 }
+
+/** Sends everything from session's output buffer. Caller holds session's lock. */
+static int send_output(struct session* ses, int more)
+{
+    size_t len = ses->out_len;
+    ses->out_len = 0;
+    return send_control(ses, ses->out_buf, len, more);
+}
+
+/** Sends everything from session's output buffer. With more set,
+    kernel is told that more data will follow shortly. */
+int flush_output(struct session* ses, int more)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    pthread_mutex_lock (&(ses->lock));
+    int res = send_output(ses, more);
+    pthread_mutex_unlock (&(ses->lock));
+    return res;
+}
+
+/** Makes room for len bytes in session's output buffer. */
+static int reserve_output(struct session* ses, size_t len)
+{
+    if (len > OUT_BUF_LEN)  { errno = EMSGSIZE; return -1; }
+    if (ses->out_len + len > OUT_BUF_LEN)
+        return send_output(ses, 1);
+    return 0;
+}
+
+/** Ends the reply: sends it unless replies are being coalesced. Reply goes out
+    even if the log has no room for it. */
+static int finish_reply(struct session* ses, int code, const char* text, size_t len)
+{
+    log_response (ses, text, len);
+
+    // preliminary replies go out at once, as data transfer follows them
+    if (!ses->out_corked || code < 200)
+        return send_output(ses, 0);
+    return 0;
+}
+
+/** Sends a reply too big for the output buffer (e.g. a long multiline one) straight away,
+    right after whatever is buffered. Caller holds session's lock. */
+static int send_oversized(struct session* ses, const char* reply, size_t len)
+{
+    log_response (ses, reply, len);
+    if (send_output(ses, 1) == -1)  return -1;
+    return send_control(ses, reply, len, 0);
+}
+
+/** Sends a reply. Replies may come from segment threads too, hence the locking. */
+int respond(struct session* ses, int code, const char* resp)
+{
+    if (!ses || !resp)                  { errno = EFAULT; return -1; }
+    if (code < 0 || code > 999)         { errno = EINVAL; return -1; }
+
+    size_t len, size = reply_size(resp, &len);
+    int res = -1;
+    pthread_mutex_lock (&(ses->lock));
+    if (size > OUT_BUF_LEN)
+    {
+        char* out = (char*)malloc(size);
+        if (out)
+        {
+            res = send_oversized(ses, out, format_reply(out, code, resp));
+            free (out);
+        }
+    }
+    else if (reserve_output(ses, size) != -1)
+    {
+        char* out = ses->out_buf + ses->out_len;
+        size_t c = format_reply(out, code, resp);
+        ses->out_len += c;
+        res = finish_reply(ses, code, out, c);
+    }
+    pthread_mutex_unlock (&(ses->lock));
+    return res;
+}
+
+/** Sends a reply pre-rendered with render_reply(). */
+int respond_rendered(struct session* ses, const char* reply, size_t len)
+{
+    if (!ses || !reply)     { errno = EFAULT; return -1; }
+
+    int res = -1;
+    pthread_mutex_lock (&(ses->lock));
+    if (len > OUT_BUF_LEN)  res = send_oversized(ses, reply, len);
+    else if (reserve_output(ses, len) != -1)
+    {
+        char* out = ses->out_buf + ses->out_len;
+        memcpy (out, reply, len);
+        ses->out_len += len;
+        res = finish_reply(ses, (reply[0] - '0') * 100, out, len);
+    }
+    pthread_mutex_unlock (&(ses->lock));
+    return res;
+}
@@ -0,0 +1,364 @@
+/** @file throttle.c
+    Bandwidth limits of data transfers: token buckets of the whole server, of each user
+    and of each session. Buckets are refilled lazily, by whoever takes tokens from them,
+    so no thread has to keep them topped up */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Buckets
+ */
+
+static void init_bucket(struct rate_bucket* b, long rate)
+{
+    pthread_mutex_init (&(b->lock), NULL);
+    b->rate = rate > 0 ? rate : 0;
+    b->burst = (double)b->rate * THROTTLE_BURST_MS / 1000;
+    if (b->burst < THROTTLE_MIN_BURST)  b->burst = THROTTLE_MIN_BURST;
+    b->tokens = b->burst;
+    clock_gettime (CLOCK_MONOTONIC, &(b->stamp));
+}
+
+/** Adds tokens for the time elapsed since last refill. Must be called with bucket's lock held. */
+static void refill_bucket(struct rate_bucket* b, const struct timespec* now)
+{
+    double elapsed = (now->tv_sec - b->stamp.tv_sec) + (now->tv_nsec - b->stamp.tv_nsec) / 1e9;
+    if (elapsed <= 0)   return;
+
+    b->tokens += elapsed * b->rate;
+    if (b->tokens > b->burst)   b->tokens = b->burst;
+    b->stamp = *now;
+}
+
+/** Fills in buckets limiting the session, indexed by THROTTLE_* (NULL = no limit there). */
+static void session_buckets(struct session* ses, struct rate_bucket** b)
+{
+    struct throttle* th = ses->server->throttle;
+    b[THROTTLE_SESSION] = ses->rate.rate > 0 ? &(ses->rate) : NULL;
+    b[THROTTLE_USER] = ses->user_rate ? &(ses->user_rate->bucket) : NULL;
+    b[THROTTLE_GLOBAL] = th && th->global.rate > 0 ? &(th->global) : NULL;
+}
+
+/** Locks the buckets, from the widest one down, so that transfers never deadlock. */
+static void lock_buckets(struct rate_bucket** b)
+{
+    int i;
+    for (i = THROTTLE_LEVELS - 1; i >= 0; --i)
+        if (b[i])   pthread_mutex_lock (&(b[i]->lock));
+}
+
+static void unlock_buckets(struct rate_bucket** b)
+{
+    int i;
+    for (i = 0; i < THROTTLE_LEVELS; ++i)
+        if (b[i])   pthread_mutex_unlock (&(b[i]->lock));
+}
+
+
+/******************************************************************************
+ * Taking tokens
+ */
+
+/** Tells whether transfers of the session are limited at all. */
+int throttling(const struct session* ses)
+{
+    const struct throttle* th = ses->server->throttle;
+    return ses->rate.rate > 0 || ses->user_rate || (th && th->global.rate > 0);
+}
+
+/** Takes tokens for up to `want` bytes from all buckets limiting the session, waiting
+    until each of them has at least a burst's worth (or `want`, if it's less). Returns
+    the number of bytes granted, which is never 0; what isn't used should be given back
+    with unthrottle(). */
+size_t throttle(struct session* ses, size_t want)
+{
+    struct rate_bucket* b[THROTTLE_LEVELS];
+    session_buckets (ses, b);
+    struct throttle* th = ses->server->throttle;
+    int held = -1, i;   // level the transfer is counted as waiting for
+
+    for (;;)
+    {
+        struct timespec now;
+        lock_buckets (b);
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        size_t grant = want;
+        double wait = 0;
+        int by = -1;
+        for (i = 0; i < THROTTLE_LEVELS; ++i)
+        {
+            if (!b[i])  continue;
+            refill_bucket (b[i], &now);
+
+            double need = want < b[i]->burst ? want : b[i]->burst;
+            if (b[i]->tokens < need)
+            {
+                double w = (need - b[i]->tokens) / b[i]->rate;
+                if (w > wait)   { wait = w; by = i; }
+            }
+            else if (b[i]->tokens < grant)  grant = (size_t)b[i]->tokens;
+        }
+        if (by == -1)
+            for (i = 0; i < THROTTLE_LEVELS; ++i)
+                if (b[i])   b[i]->tokens -= grant;
+        unlock_buckets (b);
+
+        if (by == -1)
+        {
+            if (held != -1)
+            {
+                __atomic_store_n (&(ses->throttled_by), -1, __ATOMIC_RELAXED);
+                __atomic_sub_fetch (&(th->waiting[held]), 1, __ATOMIC_RELAXED);
+            }
+            return grant;
+        }
+
+        if (by != held)
+        {
+            if (held != -1) __atomic_sub_fetch (&(th->waiting[held]), 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch (&(th->waiting[by]), 1, __ATOMIC_RELAXED);
+            held = by;
+        }
+        __atomic_store_n (&(ses->throttled_by), by, __ATOMIC_RELAXED);
+
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9) + 1;
+        if (ts.tv_nsec >= 1000000000L)  { ts.tv_nsec -= 1000000000L; ++ts.tv_sec; }
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) { }
+
+        unsigned long long ns = (unsigned long long)(wait * 1e9);
+        __atomic_add_fetch (&(ses->throttled_ns), ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&(th->waits[by]), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&(th->waited_ns[by]), ns, __ATOMIC_RELAXED);
+    }
+}
+
+/** Gives back tokens for bytes that were granted, but not transferred after all. */
+void unthrottle(struct session* ses, size_t unused)
+{
+    if (unused == 0)    return;
+
+    struct rate_bucket* b[THROTTLE_LEVELS];
+    session_buckets (ses, b);
+    lock_buckets (b);
+    int i;
+    for (i = 0; i < THROTTLE_LEVELS; ++i)
+    {
+        if (!b[i])  continue;
+        b[i]->tokens += unused;
+        if (b[i]->tokens > b[i]->burst) b[i]->tokens = b[i]->burst;
+    }
+    unlock_buckets (b);
+}
+
+
+/******************************************************************************
+ * Throttled transfers
+ */
+
+/** Reads whatever is available from descriptor, but no more than session's buckets allow. */
+ssize_t throttled_read(struct session* ses, int fd, char* buf, size_t count)
+{
+    if (!throttling(ses))   return TEMP_FAILURE_RETRY(read(fd, buf, count));
+
+    size_t n = throttle(ses, count);
+    ssize_t c = TEMP_FAILURE_RETRY(read(fd, buf, n));
+    unthrottle (ses, c > 0 ? n - c : n);
+    return c;
+}
+
+/** Writes the whole buffer to descriptor, in pieces session's buckets allow. */
+ssize_t throttled_write(struct session* ses, int fd, const char* buf, size_t count)
+{
+    if (!throttling(ses))   return write_data(fd, buf, count);
+
+    size_t len = 0;
+    while (len < count)
+    {
+        size_t n = throttle(ses, count - len);
+        if (write_data(fd, buf + len, n) < (ssize_t)n)  return -1;
+        len += n;
+    }
+    return len;
+}
+
+/** Copies up to count bytes of input file (from *offset, if given, without touching the file
+    offset) to output descriptor, in pieces session's buckets allow. sendfile() is used if possible,
+    otherwise the data is copied through buf. Returns number of bytes copied or -1. */
+ssize_t throttled_send(struct session* ses, int out_fd, int in_fd, off_t* offset, size_t count,
+                       char* buf, size_t buf_len)
+{
+    size_t len = 0;
+    ssize_t c = 0;
+    int copying = 0;
+
+    while (len < count)
+    {
+        size_t max = copying ? buf_len : ZERO_COPY_CHUNK;
+        size_t n = throttle(ses, count - len < max ? count - len : max);
+        if (!copying)
+        {
+            c = TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, offset, n));
+            if (c == -1 && (errno == EINVAL || errno == ENOSYS) && buf)
+            {
+                // sendfile() can't handle these descriptors: copy the rest
+                unthrottle (ses, n);
+                copying = 1;
+                continue;
+            }
+        }
+        else
+        {
+            c = offset ? TEMP_FAILURE_RETRY(pread(in_fd, buf, n, *offset)) : read_data(in_fd, buf, n);
+            if (c > 0 && write_data(out_fd, buf, c) < c)    c = -1;
+            else if (c > 0 && offset)   *offset += c;
+        }
+
+        unthrottle (ses, c > 0 ? n - c : n);
+        if (c <= 0) break;
+        len += c;
+    }
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+/** Receives everything from input descriptor (until it's closed) into output file,
+    never reading faster than session's buckets allow. */
+ssize_t throttled_receive(struct session* ses, int out_fd, int in_fd, char* buf, size_t buf_len)
+{
+    ssize_t c;
+    size_t len = 0;
+
+    while ((c = throttled_read(ses, in_fd, buf, buf_len)) > 0)
+    {
+        if (write_data(out_fd, buf, c) < c) return -1;
+        len += c;
+    }
+
+    return c < 0 ? -1 : (ssize_t)len;
+}
+
+
+/******************************************************************************
+ * Sessions and users
+ */
+
+/** Sets up session's own bucket. */
+void init_session_rate(struct session* ses)
+{
+    init_bucket (&(ses->rate), ses->server->config.session_rate_limit);
+    ses->user_rate = NULL;
+    ses->throttled_by = -1;
+    ses->throttled_ns = 0;
+}
+
+/** Lets go of session's user bucket; it's freed with its last session. */
+static void detach_user_rate(struct session* ses)
+{
+    struct throttle* th = ses->server->throttle;
+    struct user_rate* ur = ses->user_rate;
+    if (!ur)    return;
+
+    struct user_rate** p = &(th->users[hash_login(ur->login) % USER_RATE_BUCKETS]);
+    pthread_mutex_lock (&(th->users_lock));
+    if (--ur->refs == 0)
+    {
+        for (; *p != ur; p = &((*p)->next)) { }
+        *p = ur->next;
+        pthread_mutex_destroy (&(ur->bucket.lock));
+        free (ur);
+    }
+    pthread_mutex_unlock (&(th->users_lock));
+    ses->user_rate = NULL;
+}
+
+/** Makes the session share the bucket of its user (once it has logged in),
+    creating the bucket for user's first session. */
+int attach_user_rate(struct session* ses)
+{
+    if (!ses)   { errno = EFAULT; return -1; }
+
+    struct throttle* th = ses->server->throttle;
+    if (!th || ses->server->config.user_rate_limit <= 0)    return 0;
+    if (ses->user_rate)
+    {
+        if (strcmp(ses->user_rate->login, ses->login) == 0) return 0;
+        detach_user_rate (ses);     // logged in again as someone else
+    }
+
+    struct user_rate** head = &(th->users[hash_login(ses->login) % USER_RATE_BUCKETS]);
+    struct user_rate* ur;
+    pthread_mutex_lock (&(th->users_lock));
+    for (ur = *head; ur && strcmp(ur->login, ses->login) != 0; ur = ur->next) { }
+    if (!ur && (ur = (struct user_rate*)calloc(1, sizeof(struct user_rate))))
+    {
+        strncpy (ur->login, ses->login, MAX_LOGIN - 1);
+        init_bucket (&(ur->bucket), ses->server->config.user_rate_limit);
+        ur->next = *head;
+        *head = ur;
+    }
+    if (ur) ++ur->refs;
+    pthread_mutex_unlock (&(th->users_lock));
+
+    if (!ur)    return -1;
+    ses->user_rate = ur;
+    return 0;
+}
+
+/** Lets go of session's buckets. */
+void free_session_rate(struct session* ses)
+{
+    detach_user_rate (ses);
+    pthread_mutex_destroy (&(ses->rate.lock));
+}
+
+
+/******************************************************************************
+ * Managing the limits
+ */
+
+int init_throttle(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    struct throttle* th = (struct throttle*)calloc(1, sizeof(struct throttle));
+    if (!th)    return -1;
+    init_bucket (&(th->global), serv->config.rate_limit);
+    pthread_mutex_init (&(th->users_lock), NULL);
+
+    serv->throttle = th;
+    return 0;
+}
+
+int free_throttle(struct server* serv)
+{
+    if (!serv)              { errno = EFAULT; return -1; }
+    if (!serv->throttle)    return 0;
+
+    struct throttle* th = serv->throttle;
+    pthread_mutex_destroy (&(th->users_lock));
+    pthread_mutex_destroy (&(th->global.lock));
+    free (th);
+    serv->throttle = NULL;
+    return 0;
+}
+
+int throttle_stats(const struct server* serv, struct throttle_stats* stats)
+{
+    if (!serv || !stats)    { errno = EFAULT; return -1; }
+    if (!serv->throttle)    { errno = EBADFD; return -1; }
+
+    const struct throttle* th = serv->throttle;
+    int i;
+    for (i = 0; i < THROTTLE_LEVELS; ++i)
+    {
+        stats->waiting[i] = __atomic_load_n(&(th->waiting[i]), __ATOMIC_RELAXED);
+        stats->waits[i] = __atomic_load_n(&(th->waits[i]), __ATOMIC_RELAXED);
+        stats->waited[i] = __atomic_load_n(&(th->waited_ns[i]), __ATOMIC_RELAXED) / 1e9;
+    }
+    return 0;
+}
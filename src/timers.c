@@ -0,0 +1,230 @@
+/** @file timers.c
+    Hierarchical timer wheel shared by all sessions: arming and cancelling a timer
+    takes constant time, and timers that expire are fired in batches by single thread */
+
+
+#include "reefs.h"
+
+
+/******************************************************************************
+ * Wheel
+ */
+
+/* Level 0 has a slot for each of the next TIMER_SLOTS ticks; a slot of each further
+   level spans a whole turn of the previous one. Whenever a level completes its turn,
+   timers in next slot of the level above are cascaded down to where they belong now. */
+
+static void unlink_timer(struct timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+static void append_timer(struct timer* head, struct timer* t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/** Puts the timer into the slot its expiry falls into. Must be called with wheel's lock held. */
+static void place_timer(struct timer_wheel* w, struct timer* t)
+{
+    unsigned long delta = t->expires > w->now ? t->expires - w->now : 0;
+    int level;
+    for (level = 0; level < TIMER_LEVELS - 1 && delta >= (1UL << (TIMER_SLOT_BITS * (level + 1))); ++level) { }
+
+    // farther than the wheel reaches: fire when it's as far as it gets
+    if (delta >= (1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+        t->expires = w->now + (1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+
+    size_t slot = (t->expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    append_timer (&(w->slots[level][slot]), t);
+}
+
+/** Moves the wheel one tick forward, collecting timers that expire with it. */
+static void advance_wheel(struct timer_wheel* w)
+{
+    ++w->now;
+
+    int level;
+    for (level = 1; level < TIMER_LEVELS; ++level)
+    {
+        // levels below haven't completed their turn
+        if (w->now & ((1UL << (TIMER_SLOT_BITS * level)) - 1))  break;
+
+        size_t slot = (w->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+        struct timer* head = &(w->slots[level][slot]);
+        while (head->next != head)
+        {
+            struct timer* t = head->next;
+            unlink_timer (t);
+            place_timer (w, t);
+        }
+    }
+
+    struct timer* head = &(w->slots[0][w->now & (TIMER_SLOTS - 1)]);
+    while (head->next != head)
+    {
+        struct timer* t = head->next;
+        unlink_timer (t);
+        append_timer (&(w->expired), t);
+    }
+}
+
+
+/******************************************************************************
+ * Timer thread
+ */
+
+/** Worker function for thread that drives the wheel. */
+void* timer_proc(void* arg)
+{
+    struct timer_wheel* w = (struct timer_wheel*)arg;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct timespec next;
+    clock_gettime (CLOCK_MONOTONIC, &next);
+
+    pthread_mutex_lock (&(w->lock));
+    while (!w->stopping)
+    {
+        pthread_mutex_unlock (&(w->lock));
+        next.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L)    { next.tv_nsec -= 1000000000L; ++next.tv_sec; }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) { }
+
+        // catch up with ticks missed while firing timers took long
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock (&(w->lock));
+        do
+        {
+            advance_wheel (w);
+            if (next.tv_sec > now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec >= now.tv_nsec))  break;
+            next.tv_nsec += TIMER_TICK_MS * 1000000L;
+            if (next.tv_nsec >= 1000000000L)    { next.tv_nsec -= 1000000000L; ++next.tv_sec; }
+        } while (!w->stopping);
+
+        // fire the whole batch; each timer can still be cancelled until it's its turn
+        while (w->expired.next != &(w->expired))
+        {
+            struct timer* t = w->expired.next;
+            unlink_timer (t);
+            w->running = t;
+            ++w->fired;
+            pthread_mutex_unlock (&(w->lock));
+
+            t->fire (t);
+
+            pthread_mutex_lock (&(w->lock));
+            w->running = NULL;
+            pthread_cond_broadcast (&(w->done));
+        }
+    }
+    pthread_mutex_unlock (&(w->lock));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Arming and cancelling
+ */
+
+void init_timer(struct timer* t, void (*fire)(struct timer*))
+{
+    t->prev = t->next = NULL;
+    t->fire = fire;
+}
+
+/** Arms the timer to fire after ms milliseconds (rounded up to whole ticks),
+    moving it if it's armed already. */
+int set_timer(struct timer_wheel* w, struct timer* t, unsigned long ms)
+{
+    if (!w || !t)   { errno = EFAULT; return -1; }
+
+    pthread_mutex_lock (&(w->lock));
+    if (t->next)    unlink_timer (t);
+    t->expires = w->now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires == w->now)   ++t->expires;
+    place_timer (w, t);
+    pthread_mutex_unlock (&(w->lock));
+
+    return 0;
+}
+
+/** Disarms the timer. If it's firing right now, waits until it's done,
+    so that the timer (and whatever it belongs to) may be freed afterwards. */
+int cancel_timer(struct timer_wheel* w, struct timer* t)
+{
+    if (!w || !t)   { errno = EFAULT; return -1; }
+
+    pthread_mutex_lock (&(w->lock));
+    if (t->next)    unlink_timer (t);
+    while (w->running == t)
+    {
+        pthread_cond_wait (&(w->done), &(w->lock));
+        if (t->next)    unlink_timer (t);   // it may have re-armed itself
+    }
+    pthread_mutex_unlock (&(w->lock));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the wheel
+ */
+
+int start_timers(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    struct timer_wheel* w = (struct timer_wheel*)calloc(1, sizeof(struct timer_wheel));
+    if (!w) return -1;
+    pthread_mutex_init (&(w->lock), NULL);
+    pthread_cond_init (&(w->done), NULL);
+
+    int level, slot;
+    for (level = 0; level < TIMER_LEVELS; ++level)
+        for (slot = 0; slot < TIMER_SLOTS; ++slot)
+            w->slots[level][slot].prev = w->slots[level][slot].next = &(w->slots[level][slot]);
+    w->expired.prev = w->expired.next = &(w->expired);
+
+    if (pthread_create(&(w->thread), NULL, timer_proc, w) != 0)
+    {
+        pthread_cond_destroy (&(w->done));
+        pthread_mutex_destroy (&(w->lock));
+        free (w);
+        errno = EAGAIN; return -1;
+    }
+
+    serv->timers = w;
+    return 0;
+}
+
+/** Stops the timer thread and frees the wheel. Timers still armed never fire. */
+int stop_timers(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->timers)  return 0;
+
+    struct timer_wheel* w = serv->timers;
+    pthread_mutex_lock (&(w->lock));
+    w->stopping = 1;
+    pthread_mutex_unlock (&(w->lock));
+    pthread_join (w->thread, NULL);
+
+    pthread_cond_destroy (&(w->done));
+    pthread_mutex_destroy (&(w->lock));
+    free (w);
+    serv->timers = NULL;
+    return 0;
+}
@@ -0,0 +1,427 @@
+/** @file uring.c
+    io_uring backend of data transfers: several reads and writes of a single transfer
+    are kept in flight at once, using buffers registered with the kernel */
+
+
+#include "reefs.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/******************************************************************************
+ * Rings
+ */
+
+// submission and completion queues of a thread, with their transfer buffers
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned queued;            // SQEs not submitted yet
+    unsigned inflight;          // reads and writes submitted and not completed yet
+
+    char* bufs;                 // URING_DEPTH buffers of buf_len bytes
+    size_t buf_len;
+    int fixed;                  // buffers are registered
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static int uring_unsupported;   // set when kernel refused to set up a ring
+
+#define CANCEL_DATA (~0ULL)     // user data of cancel requests, which aren't counted in flight
+
+/** Frees the ring. Nothing may be in flight by then (see drop_thread_uring()):
+    closing the ring doesn't wait for operations to finish, and those on plain
+    (not registered) buffers would still write through this mapping. */
+static void free_uring(void* arg)
+{
+    struct uring* r = (struct uring*)arg;
+
+    if (r->fd != -1)        TEMP_FAILURE_RETRY(close(r->fd));
+    if (r->sqes)            munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)    munmap (r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)          munmap (r->sq_ptr, r->sq_len);
+    if (r->bufs)            munmap (r->bufs, URING_DEPTH * r->buf_len);
+    free (r);
+}
+
+static void create_uring_key()
+{
+    pthread_key_create (&uring_key, free_uring);
+}
+
+/** Sets up a ring with URING_DEPTH buffers of buf_len bytes. */
+static struct uring* setup_uring(size_t buf_len)
+{
+    struct uring* r = (struct uring*)calloc(1, sizeof(struct uring));
+    if (!r) return NULL;
+
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, 2 * URING_DEPTH, &p)) == -1)
+    {
+        int err = errno;
+        if (err == ENOSYS || err == EPERM)  uring_unsupported = 1;
+        free (r);
+        errno = ENOSYS; return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len)    r->sq_len = r->cq_len;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)    { r->sq_ptr = NULL; goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)   r->cq_ptr = r->sq_ptr;
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)    { r->cq_ptr = NULL; goto fail; }
+    }
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)  { r->sqes = NULL; goto fail; }
+
+    r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+
+    // buffers are mapped rather than allocated, so that no other allocation
+    // can land on them while the kernel still holds them
+    r->buf_len = buf_len;
+    r->bufs = (char*)mmap(NULL, URING_DEPTH * buf_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->bufs == MAP_FAILED)  { r->bufs = NULL; goto fail; }
+
+    // registering may fail on locked memory limit; plain buffers will do then
+    struct iovec iov[URING_DEPTH];
+    int i;
+    for (i = 0; i < URING_DEPTH; ++i)
+        { iov[i].iov_base = r->bufs + i * buf_len; iov[i].iov_len = buf_len; }
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) == 0;
+
+    return r;
+
+fail:
+    free_uring (r);
+    errno = ENOSYS; return NULL;
+}
+
+/** Returns thread's ring, setting it up on first use. Fails with ENOSYS if kernel can't do io_uring. */
+static struct uring* thread_uring(size_t buf_len)
+{
+    if (uring_unsupported)  { errno = ENOSYS; return NULL; }
+    pthread_once (&uring_once, create_uring_key);
+
+    struct uring* r = (struct uring*)pthread_getspecific(uring_key);
+    if (!r && (r = setup_uring(buf_len)))   pthread_setspecific (uring_key, r);
+    return r;
+}
+
+
+
+/******************************************************************************
+ * Submitting and completing
+ */
+
+/** Returns the next free submission queue entry, cleared. It's queued by queue_sqe(). */
+static struct io_uring_sqe* next_sqe(struct uring* r)
+{
+    struct io_uring_sqe* sqe = &(r->sqes[*(r->sq_tail) & *(r->sq_mask)]);
+    memset (sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+static void queue_sqe(struct uring* r)
+{
+    unsigned tail = *(r->sq_tail);
+    unsigned idx = tail & *(r->sq_mask);
+    r->sq_array[idx] = idx;
+    __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+}
+
+/** Queues read (or write) of len bytes at offset (-1 = current position) into slot's buffer.
+    Ring is never fuller than two entries per slot, so there's always room. */
+static void queue_rw(struct uring* r, int write, int fd, int slot, size_t done, size_t len, off_t offset)
+{
+    struct io_uring_sqe* sqe = next_sqe(r);
+    if (r->fixed)
+    {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    }
+    else    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(r->bufs + slot * r->buf_len + done);
+    sqe->len = len;
+    sqe->off = (unsigned long long)offset;
+    sqe->user_data = (unsigned long long)(slot << 1 | write);
+    queue_sqe (r);
+    ++r->inflight;
+}
+
+/** Submits queued entries, waiting for at least one completion if asked to. */
+static int submit_uring(struct uring* r, int wait)
+{
+    int c = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (c == -1)    return errno == EINTR ? 0 : -1;
+    r->queued -= c;
+    return 0;
+}
+
+/** Submits queued entries and waits for at least one completion of a read or write,
+    which is returned as slot number and result. */
+static int complete_rw(struct uring* r, int* slot, int* write, int* res)
+{
+    for (;;)
+    {
+        unsigned head = *(r->cq_head);
+        while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) || r->queued > 0)
+            if (submit_uring(r, 1) == -1)   return -1;
+
+        struct io_uring_cqe* cqe = &(r->cqes[head & *(r->cq_mask)]);
+        unsigned long long data = cqe->user_data;
+        *slot = (int)(data >> 1);
+        *write = (int)(data & 1);
+        *res = cqe->res;
+        __atomic_store_n (r->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (data != CANCEL_DATA)    { --r->inflight; return 0; }
+    }
+}
+
+/** Cancels reads and writes still in flight, and waits until they're all done.
+    Ones already running (e.g. reading a file) are just waited for. */
+static int cancel_uring(struct uring* r)
+{
+    int i, slot, write, res;
+    for (i = 0; i < 2 * URING_DEPTH && r->inflight > 0; ++i)
+    {
+        // submitted one by one, so that they never fill the queue
+        struct io_uring_sqe* sqe = next_sqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long long)i;
+        sqe->user_data = CANCEL_DATA;
+        queue_sqe (r);
+        while (r->queued > 0)
+            if (submit_uring(r, 0) == -1)   return -1;
+    }
+    while (r->inflight > 0)
+        if (complete_rw(r, &slot, &write, &res) == -1)  return -1;
+    return 0;
+}
+
+/** Throws thread's ring away after failed transfer. Whatever is still in flight
+    is cancelled first; if even that fails, plain buffers are left mapped for good,
+    so that the kernel can't write into memory reused for something else. */
+static void drop_thread_uring(struct uring* r)
+{
+    int err = errno;
+    pthread_setspecific (uring_key, NULL);
+    if (cancel_uring(r) == -1 && !r->fixed) r->bufs = NULL;
+    free_uring (r);
+    errno = err;
+}
+
+
+/******************************************************************************
+ * Transfers
+ */
+
+// state of a transfer buffer
+#define SLOT_FREE 0
+#define SLOT_READING 1
+#define SLOT_READY 2            // read completely, waiting for its turn to be written
+#define SLOT_WRITING 3
+
+struct uring_slot
+{
+    int state;
+    size_t len, done;
+    off_t offset;
+};
+
+/** Tells what to report when a completion fails. Failures of the very first operations
+    (e.g. of opcodes older kernel doesn't know) let caller fall back to another method. */
+static int failure(int res, size_t moved)
+{
+    int err = -res;
+    if (moved == 0 && (err == EINVAL || err == EOPNOTSUPP)) return ENOSYS;
+    if (moved > 0 && (err == EINVAL || err == ENOSYS))      return EIO;
+    return err;
+}
+
+/** Sends the rest of regular file (from its current offset) to output descriptor.
+    File is read ahead into up to URING_DEPTH buffers at once, while they're written
+    to the output one after another, in order. Returns number of bytes sent or -1;
+    ENOSYS means that io_uring isn't available and nothing has been sent. */
+ssize_t uring_send(int out_fd, int in_fd, size_t chunk)
+{
+    struct stat st;
+    off_t start = lseek(in_fd, 0, SEEK_CUR);
+    if (start == -1 || fstat(in_fd, &st) == -1) return -1;
+    if (!S_ISREG(st.st_mode))   { errno = EINVAL; return -1; }
+
+    struct uring* r = thread_uring(chunk);
+    if (!r) return -1;
+
+    struct uring_slot slots[URING_DEPTH];
+    memset (slots, 0, sizeof(slots));
+    off_t total = st.st_size > start ? st.st_size - start : 0;
+    unsigned long chunks = (total + chunk - 1) / chunk;
+    unsigned long next_read = 0, next_write = 0;
+    int writing = 0;
+    size_t sent = 0, written = 0;   // written counts partial writes too
+
+    while (next_write < chunks)
+    {
+        // read ahead into every free buffer
+        for (; next_read < chunks && next_read - next_write < URING_DEPTH; ++next_read)
+        {
+            struct uring_slot* s = &slots[next_read % URING_DEPTH];
+            s->state = SLOT_READING;
+            s->offset = start + (off_t)(next_read * chunk);
+            s->len = total - (off_t)(next_read * chunk) < (off_t)chunk ? total - next_read * chunk : chunk;
+            s->done = 0;
+            queue_rw (r, 0, in_fd, next_read % URING_DEPTH, 0, s->len, s->offset);
+        }
+
+        // output is written strictly in order, by one operation at a time
+        struct uring_slot* w = &slots[next_write % URING_DEPTH];
+        if (!writing && w->state == SLOT_READY)
+        {
+            w->state = SLOT_WRITING;
+            w->done = 0;
+            queue_rw (r, 1, out_fd, next_write % URING_DEPTH, 0, w->len, -1);
+            writing = 1;
+        }
+
+        int slot = 0, write = 0, res;
+        if (complete_rw(r, &slot, &write, &res) == -1)  res = -errno;
+        struct uring_slot* s = &slots[slot];
+        if (res <= 0)
+        {
+            // file shrinking under us is as bad as failed read
+            errno = res == 0 ? EIO : failure(res, written);
+            drop_thread_uring (r);
+            return -1;
+        }
+
+        if (write)  written += res;
+        s->done += res;
+        if (s->done < s->len)
+        {
+            if (write)  queue_rw (r, 1, out_fd, slot, s->done, s->len - s->done, -1);
+            else        queue_rw (r, 0, in_fd, slot, s->done, s->len - s->done, s->offset + s->done);
+        }
+        else if (write)
+        {
+            s->state = SLOT_FREE;
+            sent += s->len;
+            ++next_write;
+            writing = 0;
+        }
+        else    s->state = SLOT_READY;
+    }
+
+    // leave file offset where plain reading would
+    lseek (in_fd, start + sent, SEEK_SET);
+    return sent;
+}
+
+/** Receives everything from input descriptor (until it's closed), writing it to the file
+    from its current offset on. Input is read by one operation at a time, while up to
+    URING_DEPTH - 1 buffers received before are being written to the file. The tap
+    (if any) sees every buffer, in order, as soon as it's been read. Returns number
+    of bytes received or -1; ENOSYS means that io_uring isn't available and nothing
+    has been received. */
+ssize_t uring_receive(int out_fd, int in_fd, size_t chunk, struct data_tap* tap)
+{
+    // writes go to explicit offsets, which appending would ignore
+    int flags = fcntl(out_fd, F_GETFL);
+    if (flags == -1)    return -1;
+    off_t offset = lseek(out_fd, 0, (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+    if (offset == -1)   return -1;
+
+    struct uring* r = thread_uring(chunk);
+    if (!r) return -1;
+    if ((flags & O_APPEND) && fcntl(out_fd, F_SETFL, flags & ~O_APPEND) == -1)  return -1;
+    ssize_t c = -1;
+
+    struct uring_slot slots[URING_DEPTH];
+    memset (slots, 0, sizeof(slots));
+    int reading = 0, writing = 0, eof = 0, i;
+    size_t received = 0;
+
+    while (!eof || writing > 0)
+    {
+        if (!eof && !reading)
+        {
+            for (i = 0; i < URING_DEPTH && slots[i].state != SLOT_FREE; ++i) { }
+            if (i < URING_DEPTH)
+            {
+                slots[i].state = SLOT_READING;
+                queue_rw (r, 0, in_fd, i, 0, chunk, -1);
+                reading = 1;
+            }
+        }
+
+        int slot = 0, write = 0, res;
+        if (complete_rw(r, &slot, &write, &res) == -1)  res = -errno;
+        struct uring_slot* s = &slots[slot];
+        if (res < 0 || (write && res == 0))
+        {
+            // anything read has been taken off the connection, and can't be received again
+            errno = res == 0 ? EIO : failure(res, received);
+            drop_thread_uring (r);
+            goto done;
+        }
+
+        if (!write)
+        {
+            reading = 0;
+            if (res == 0)   { s->state = SLOT_FREE; eof = 1; continue; }
+
+            if (tap)    tap->seen (tap, r->bufs + slot * r->buf_len, res);
+            s->state = SLOT_WRITING;
+            s->len = res;
+            s->done = 0;
+            s->offset = offset;
+            offset += res;
+            received += res;
+            queue_rw (r, 1, out_fd, slot, 0, s->len, s->offset);
+            ++writing;
+        }
+        else if ((s->done += res) < s->len)
+            queue_rw (r, 1, out_fd, slot, s->done, s->len - s->done, s->offset + s->done);
+        else
+        {
+            s->state = SLOT_FREE;
+            --writing;
+        }
+    }
+
+    lseek (out_fd, offset, SEEK_SET);
+    c = received;
+
+done:
+    if (flags & O_APPEND)
+    {
+        int err = errno;
+        fcntl (out_fd, F_SETFL, flags);
+        errno = err;
+    }
+    return c;
+}
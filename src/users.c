@@ -0,0 +1,364 @@
+/** @file users.c
+    User database: hash index over accounts, password verification
+    and reloading the whole table without stopping logins */
+
+
+#include "reefs.h"
+#include <crypt.h>
+
+
+/******************************************************************************
+ * Hash index
+ */
+
+/** FNV-1a hash of user's login. */
+uint32_t hash_login(const char* login)
+{
+    uint32_t h = 2166136261u;
+    for (; *login; ++login)
+        { h ^= (unsigned char)*login; h *= 16777619u; }
+    return h;
+}
+
+/** Loads users from file and indexes them with open addressing hash table. */
+static struct user_table* load_user_table(const char* file)
+{
+    struct user_table* t = (struct user_table*)calloc(1, sizeof(struct user_table));
+    if (!t) return NULL;
+    if (!(t->users = parse_users_file(file, &(t->count))))
+        { free(t); return NULL; }
+
+    // keep load factor at or below 1/2
+    size_t size = 2;
+    while (size < 2 * (size_t)t->count)  size *= 2;
+    if (!(t->slots = (int*)malloc(size * sizeof(int))))
+        { free(t->users); free(t); return NULL; }
+    memset (t->slots, 0xff, size * sizeof(int));  // -1 = empty
+    t->mask = size - 1;
+
+    int i;
+    size_t s;
+    for (i = 0; i < t->count; ++i)
+    {
+        // linear probing; the first entry for a login wins
+        for (s = hash_login(t->users[i].login) & t->mask; t->slots[s] != -1; s = (s + 1) & t->mask)
+            if (strcmp(t->users[t->slots[s]].login, t->users[i].login) == 0)   break;
+        if (t->slots[s] == -1)  t->slots[s] = i;
+    }
+
+    return t;
+}
+
+static void free_user_table(struct user_table* t)
+{
+    if (!t) return;
+    free (t->slots);
+    free (t->users);
+    free (t);
+}
+
+static const struct user* lookup_user(const struct user_table* t, const char* login)
+{
+    size_t s;
+    for (s = hash_login(login) & t->mask; t->slots[s] != -1; s = (s + 1) & t->mask)
+        if (strcmp(t->users[t->slots[s]].login, login) == 0)
+            return &(t->users[t->slots[s]]);
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Read-side critical sections
+ */
+
+/* Readers never block: they announce themselves in one of two counters, picked by
+   current epoch, and release it when done. Reloading publishes the new table, then
+   flips the epoch twice, each time waiting for readers of the previous epoch to leave.
+   After that, no reader can still see the old table. */
+
+static int read_lock(struct user_db* db)
+{
+    int idx = (int)(__atomic_load_n(&(db->epoch), __ATOMIC_SEQ_CST) & 1);
+    __atomic_add_fetch (&(db->readers[idx]), 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+static void read_unlock(struct user_db* db, int idx)
+{
+    __atomic_sub_fetch (&(db->readers[idx]), 1, __ATOMIC_SEQ_CST);
+}
+
+/** Waits until all readers that might have seen the previous table are gone. */
+static void synchronize_readers(struct user_db* db)
+{
+    int flip;
+    for (flip = 0; flip < 2; ++flip)
+    {
+        int idx = (int)(__atomic_fetch_add(&(db->epoch), 1, __ATOMIC_SEQ_CST) & 1);
+        while (__atomic_load_n(&(db->readers[idx]), __ATOMIC_SEQ_CST) > 0)
+        {
+            struct timespec ts = { 0, 100000 };
+            nanosleep (&ts, NULL);
+        }
+    }
+}
+
+/** Copies user's account data. Returns -1 with errno set to ENOENT if there is no such user. */
+int find_user(struct user_db* db, const char* login, struct user* out)
+{
+    if (!db || !login || !out)  { errno = EFAULT; return -1; }
+
+    int idx = read_lock(db);
+    const struct user_table* t = __atomic_load_n(&(db->table), __ATOMIC_SEQ_CST);
+    const struct user* u = lookup_user(t, login);
+    if (u)  memcpy (out, u, sizeof(struct user));
+    read_unlock (db, idx);
+
+    if (!u) { errno = ENOENT; return -1; }
+    return 0;
+}
+
+
+/******************************************************************************
+ * Passwords
+ */
+
+/** Tells whether stored password is a salted hash (in crypt(3) format) rather than plain text. */
+int password_hashed(const char* stored)
+{
+    return stored && stored[0] == '$';
+}
+
+static int verify_password(const char* stored, const char* password, struct crypt_data* cd)
+{
+    if (!password_hashed(stored))   return strcmp(stored, password) == 0;
+
+    cd->initialized = 0;
+    const char* hash = crypt_r(password, stored, cd);
+    return hash && *hash != '*' && strcmp(hash, stored) == 0;
+}
+
+/** Checks given password against user's one. Hashing may take a while, so in the epoll
+    model it's left to authentication threads (see submit_password()) instead. */
+int authenticate(const struct user* u, const char* password)
+{
+    if (!u || !password)    { errno = EFAULT; return 0; }
+    if (!password_hashed(u->password))  return strcmp(u->password, password) == 0;
+
+    struct crypt_data* cd = (struct crypt_data*)malloc(sizeof(struct crypt_data));
+    if (!cd)    return 0;
+    int res = verify_password(u->password, password, cd);
+    free (cd);
+    return res;
+}
+
+
+/******************************************************************************
+ * Authentication threads (epoll model)
+ */
+
+/** Worker function for threads that verify hashed passwords. */
+void* auth_proc(void* arg)
+{
+    struct user_db* db = (struct user_db*)arg;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    struct crypt_data* cd = (struct crypt_data*)malloc(sizeof(struct crypt_data));
+    if (!cd)    return 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock (&(db->auth_lock));
+        while (!db->auth_queue && !db->stopping)
+            pthread_cond_wait (&(db->auth_cond), &(db->auth_lock));
+        struct session* ses = db->auth_queue;
+        if (ses)
+        {
+            db->auth_queue = ses->queue_next;
+            if (!db->auth_queue)    db->auth_queue_tail = NULL;
+        }
+        pthread_mutex_unlock (&(db->auth_lock));
+        if (!ses)   break;  // stopping
+
+        ses->auth_ok = verify_password(ses->auth_hash, ses->auth_password, cd);
+        memset (ses->auth_password, 0, MAX_PASSWORD);
+        reactor_resume_session (ses);
+    }
+
+    free (cd);
+    return 0;
+}
+
+/** Queues session's password for verification. Session stays suspended
+    until the result is handed back to its event loop. */
+int submit_password(struct user_db* db, struct session* ses)
+{
+    if (!db || !ses)    { errno = EFAULT; return -1; }
+
+    ses->queue_next = NULL;
+    pthread_mutex_lock (&(db->auth_lock));
+    if (db->auth_queue_tail)    db->auth_queue_tail->queue_next = ses;
+    else                        db->auth_queue = ses;
+    db->auth_queue_tail = ses;
+    pthread_cond_signal (&(db->auth_cond));
+    pthread_mutex_unlock (&(db->auth_lock));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Reloading
+ */
+
+/** Loads the users file again and swaps it in. Logins in progress keep using
+    the old table until they're done with it; new ones see the new table. */
+static int reload_users(struct server* serv)
+{
+    struct user_db* db = serv->users;
+    struct user_table* t = load_user_table(serv->config.users_file);
+    if (!t) return -1;
+
+    struct user_table* old = __atomic_exchange_n(&(db->table), t, __ATOMIC_SEQ_CST);
+    synchronize_readers (db);
+    free_user_table (old);
+    return t->count;
+}
+
+/** Worker function for thread reloading users on request,
+    as users file may be huge and nobody should wait for it. */
+void* reload_proc(void* arg)
+{
+    struct server* serv = (struct server*)arg;
+    struct user_db* db = serv->users;
+
+    sigset_t sigs;  sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    pthread_mutex_lock (&(db->reload_lock));
+    for (;;)
+    {
+        while (!db->reload_requested && !db->stopping)
+            pthread_cond_wait (&(db->reload_cond), &(db->reload_lock));
+        if (db->stopping)   break;
+        db->reload_requested = 0;
+        pthread_mutex_unlock (&(db->reload_lock));
+
+        char buf[BUF_LEN];
+        int count = reload_users(serv);
+        if (count == -1)    snprintf (buf, BUF_LEN, "Reloading users failed: %s.", strerror(errno));
+        else                snprintf (buf, BUF_LEN, "Users reloaded, %d accounts.", count);
+        log_event (serv, buf);
+
+        pthread_mutex_lock (&(db->reload_lock));
+    }
+    pthread_mutex_unlock (&(db->reload_lock));
+
+    return 0;
+}
+
+/** Asks for the users file to be loaded again. Returns immediately. */
+int request_users_reload(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->users)   { errno = EBADFD; return -1; }
+
+    struct user_db* db = serv->users;
+    pthread_mutex_lock (&(db->reload_lock));
+    db->reload_requested = 1;
+    pthread_cond_signal (&(db->reload_cond));
+    pthread_mutex_unlock (&(db->reload_lock));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * Managing the database
+ */
+
+int init_users(struct server* serv)
+{
+    if (!serv)  { errno = EFAULT; return -1; }
+
+    struct user_db* db = (struct user_db*)calloc(1, sizeof(struct user_db));
+    if (!db)    return -1;
+    pthread_mutex_init (&(db->reload_lock), NULL);
+    pthread_cond_init (&(db->reload_cond), NULL);
+    pthread_mutex_init (&(db->auth_lock), NULL);
+    pthread_cond_init (&(db->auth_cond), NULL);
+
+    // missing users file means there are no users
+    if (!(db->table = load_user_table(serv->config.users_file)))
+    {
+        if (errno != ENOENT || !(db->table = (struct user_table*)calloc(1, sizeof(struct user_table))))
+            { free(db); return -1; }
+        db->table->slots = (int*)malloc(sizeof(int));
+        db->table->slots[0] = -1;
+    }
+
+    if (serv->config.io_model == IO_MODEL_EPOLL)
+    {
+        db->threads_count = serv->config.auth_threads > 0 ? serv->config.auth_threads : DEFAULT_AUTH_THREADS;
+        if (!(db->threads = (pthread_t*)calloc(db->threads_count, sizeof(pthread_t))))    return -1;
+
+        int i;
+        for (i = 0; i < db->threads_count; ++i)
+            if (pthread_create(&(db->threads[i]), NULL, auth_proc, db) != 0)    return -1;
+    }
+
+    serv->users = db;
+    if (pthread_create(&(db->reload_thread), NULL, reload_proc, serv) != 0)  return -1;
+    return 0;
+}
+
+/** Stops authentication threads; sessions whose passwords they haven't verified yet
+    stay suspended. Users can still be looked up until free_users(). */
+int stop_auth_threads(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->users)   return 0;
+
+    struct user_db* db = serv->users;
+    pthread_mutex_lock (&(db->auth_lock));
+    db->stopping = 1;
+    pthread_cond_broadcast (&(db->auth_cond));
+    pthread_mutex_unlock (&(db->auth_lock));
+
+    int i;
+    for (i = 0; i < db->threads_count; ++i)   pthread_join (db->threads[i], NULL);
+    free (db->threads);
+    db->threads = NULL;
+    db->threads_count = 0;
+    return 0;
+}
+
+int free_users(struct server* serv)
+{
+    if (!serv)          { errno = EFAULT; return -1; }
+    if (!serv->users)   return 0;
+
+    struct user_db* db = serv->users;
+    pthread_mutex_lock (&(db->reload_lock));
+    db->stopping = 1;
+    pthread_cond_signal (&(db->reload_cond));
+    pthread_mutex_unlock (&(db->reload_lock));
+    pthread_join (db->reload_thread, NULL);
+    stop_auth_threads (serv);
+
+    free_user_table (db->table);
+    pthread_cond_destroy (&(db->auth_cond));
+    pthread_mutex_destroy (&(db->auth_lock));
+    pthread_cond_destroy (&(db->reload_cond));
+    pthread_mutex_destroy (&(db->reload_lock));
+    free (db);
+
+    serv->users = NULL;
+    return 0;
+}